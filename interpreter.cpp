@@ -3,6 +3,20 @@
 #include <vector>
 #include <map>
 #include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <charconv>
+#include <climits>
+#include <cstdio>
+#include <cstdint>
+#ifdef _WIN32
+#include <fstream>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 using namespace std;
 
@@ -50,8 +64,253 @@ void execute(string line)
     }
 }
 
-int main()
+// --- Batch mode: `interpreter FILE` replays a whole command log ---
+// The file is compiled in one pass into packed commands, with every
+// variable name replaced by a slot number, and then run without touching
+// a string. Results match execute() line for line.
+
+enum Op : uint8_t
+{
+    OP_LET,   // slots[slot] = value
+    OP_PRINT, // print slots[slot]
+    OP_ADD    // slots[slot] += value, if it was set
+};
+
+struct Command
+{
+    Op op;
+    int slot;
+    int value;
+};
+
+struct Program
+{
+    vector<Command> commands;
+    vector<string_view> names; // By slot, for the "not found" message
+};
+
+// The whole file, memory-mapped where we can
+class InputFile
+{
+    const char *base = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    string contents;
+#endif
+
+public:
+    bool opened = false;
+
+    explicit InputFile(const string &path)
+    {
+#ifdef _WIN32
+        ifstream in(path, ios::binary);
+        if (!in)
+            return;
+        contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+        base = contents.data();
+        length = contents.size();
+        opened = true;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            opened = true;
+            if (st.st_size > 0)
+            {
+                void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED)
+                {
+                    base = (const char *)p;
+                    length = (size_t)st.st_size;
+                    madvise(p, length, MADV_SEQUENTIAL);
+                }
+                else
+                    opened = false;
+            }
+        }
+        close(fd); // The mapping keeps the file alive
+#endif
+    }
+
+    ~InputFile()
+    {
+#ifndef _WIN32
+        if (base)
+            munmap((void *)base, length);
+#endif
+    }
+
+    InputFile(const InputFile &) = delete;
+    InputFile &operator=(const InputFile &) = delete;
+
+    string_view text() const { return string_view(base, length); }
+};
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+// The next whitespace-separated word of `line`, like `ss >> word`
+static string_view nextWord(string_view &line)
+{
+    size_t start = 0;
+    while (start < line.size() && isSpace(line[start]))
+        start++;
+    size_t end = start;
+    while (end < line.size() && !isSpace(line[end]))
+        end++;
+    string_view word = line.substr(start, end - start);
+    line.remove_prefix(end);
+    return word;
+}
+
+// Like `ss >> value`: a leading number, clamped on overflow, 0 if there is none
+static int toInt(string_view word)
+{
+    if (!word.empty() && word[0] == '+')
+    {
+        word.remove_prefix(1);
+        if (!word.empty() && word[0] == '-')
+            return 0;
+    }
+    long long value = 0;
+    auto result = from_chars(word.data(), word.data() + word.size(), value);
+    if (result.ec == errc::result_out_of_range || value > INT_MAX || value < INT_MIN)
+        return word[0] == '-' ? INT_MIN : INT_MAX;
+    return result.ec == errc() ? (int)value : 0;
+}
+
+// One pass over the text; the names stay views into it
+Program compile(string_view text)
+{
+    Program program;
+    unordered_map<string_view, int> slots;
+    auto slotFor = [&](string_view name)
+    {
+        auto it = slots.try_emplace(name, (int)program.names.size()).first;
+        if (it->second == (int)program.names.size())
+            program.names.push_back(name);
+        return it->second;
+    };
+
+    while (!text.empty())
+    {
+        size_t newline = text.find('\n');
+        string_view line = text.substr(0, newline);
+        text.remove_prefix(newline == string_view::npos ? text.size() : newline + 1);
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line == "exit")
+            break;
+
+        string_view command = nextWord(line);
+        if (command == "let")
+        {
+            string_view name = nextWord(line);
+            nextWord(line); // "="
+            int slot = slotFor(name);
+            program.commands.push_back({OP_LET, slot, toInt(nextWord(line))});
+        }
+        else if (command == "print")
+            program.commands.push_back({OP_PRINT, slotFor(nextWord(line)), 0});
+        else if (command == "add")
+        {
+            int slot = slotFor(nextWord(line));
+            program.commands.push_back({OP_ADD, slot, toInt(nextWord(line))});
+        }
+    }
+    return program;
+}
+
+// Collects output and writes it out in large blocks
+class OutputBuffer
+{
+    static constexpr size_t kFlushAt = 1 << 16;
+    string buffer;
+
+public:
+    OutputBuffer() { buffer.reserve(kFlushAt + 256); }
+    ~OutputBuffer() { flush(); }
+
+    void append(string_view text)
+    {
+        buffer.append(text.data(), text.size());
+        if (buffer.size() >= kFlushAt)
+            flush();
+    }
+
+    void append(int value)
+    {
+        char digits[16];
+        auto result = to_chars(digits, digits + sizeof digits, value);
+        append(string_view(digits, result.ptr - digits));
+    }
+
+    void flush()
+    {
+        fwrite(buffer.data(), 1, buffer.size(), stdout);
+        buffer.clear();
+    }
+};
+
+void run(const Program &program)
 {
+    vector<int> values(program.names.size(), 0);
+    vector<uint8_t> isSet(program.names.size(), 0);
+    OutputBuffer out;
+
+    for (const Command &c : program.commands)
+    {
+        switch (c.op)
+        {
+        case OP_LET:
+            values[c.slot] = c.value;
+            isSet[c.slot] = 1;
+            break;
+        case OP_PRINT:
+            if (isSet[c.slot])
+            {
+                out.append(">> ");
+                out.append(values[c.slot]);
+                out.append("\n");
+            }
+            else
+            {
+                out.append(">> Error: Variable '");
+                out.append(program.names[c.slot]);
+                out.append("' not found.\n");
+            }
+            break;
+        case OP_ADD:
+            if (isSet[c.slot])
+                values[c.slot] += c.value;
+            break;
+        }
+    }
+}
+
+int runBatch(const string &path)
+{
+    InputFile file(path);
+    if (!file.opened)
+    {
+        cout << "Error: cannot read " << path << endl;
+        return 1;
+    }
+    run(compile(file.text()));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        return runBatch(argv[1]);
+
     string line;
     cout << "TinyLang Interpreter v1.0" << endl;
     cout << "Commands: 'let x = 10', 'print x', 'add x 5', 'exit'" << endl;
@@ -67,4 +326,4 @@ int main()
         execute(line);
     }
     return 0;
-}
\ No newline at end of file
+}
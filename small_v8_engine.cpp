@@ -2,12 +2,53 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <functional>
 #include <sstream>
 #include <thread>
 #include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <charconv>
+#include <new>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#define HAVE_EPOLL 1 // Non-blocking I/O natives (section 11)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#endif
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#endif
+#include <fstream>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <atomic>
+#include <csignal>
 
 using namespace std;
 
@@ -15,6 +56,12 @@ using namespace std;
 // 1. CORE TYPES & FORWARD DECLARATIONS
 // ==========================================
 
+#ifdef _MSC_VER
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE __attribute__((noinline))
+#endif
+
 enum ValueType
 {
     V_NULL,
@@ -24,710 +71,9287 @@ enum ValueType
     V_LIST,
     V_OBJ,
     V_FUNC,
-    V_NATIVE
+    V_NATIVE,
+    V_PROMISE,
+    // Heap-internal cell kinds, never the type of a Value
+    V_ENV,
+    V_ASYNC, // A suspended async function (section 3)
+    V_FREE
 };
 
-struct Value;
 struct ASTNode;
 class Environment;
+struct BytecodeFunction;
 
-// A "Box" to hold our dynamic values safely
-struct Value
+// Machine code for a hot BytecodeFunction (section 10)
+struct JitCode;
+struct JitCodeDeleter
 {
-    ValueType type = V_NULL;
-    double numVal = 0;
-    string strVal;
-    bool boolVal = false;
-    vector<shared_ptr<Value>> listVal;
-    map<string, shared_ptr<Value>> objVal;
+    void operator()(JitCode *code) const;
+};
 
-    // For User Functions
-    vector<string> params;
-    shared_ptr<ASTNode> body;        // AST Node for function body
-    shared_ptr<Environment> closure; // Closure scope
-
-    // For Native Functions (print, setTimeout)
-    function<shared_ptr<Value>(vector<shared_ptr<Value>>)> nativeFn;
-
-    string toString()
-    {
-        if (type == V_NUM)
-        {
-            string s = to_string(numVal);
-            return s.substr(0, s.find_last_not_of('0') + 1);
-        }
-        if (type == V_STR)
-            return strVal;
-        if (type == V_BOOL)
-            return boolVal ? "true" : "false";
-        if (type == V_NULL)
-            return "null";
-        if (type == V_LIST)
-            return "[Array]";
-        if (type == V_OBJ)
-            return "[Object]";
-        if (type == V_FUNC || type == V_NATIVE)
-            return "[Function]";
-        return "";
-    }
+// Per-isolate state. Every thread runs at most one Isolate at a time and
+// reaches it through Isolate::current; these accessors are defined with the
+// Isolate class.
+class Isolate;
+class Heap;
+class GlobalScope;
+class VM;
+struct Shape;
+inline Heap &currentHeap();
+inline GlobalScope &currentGlobals();
+inline VM &currentVM();
+inline Shape *currentRootShape();
+struct StringCell;
+inline StringCell *internString(string_view text);
+inline StringCell *findInternedString(string_view text);
+class MicrotaskQueue;
+inline MicrotaskQueue &currentMicrotasks();
+
+// Always-on counters, cheap enough to leave in every build. Allocations by
+// type live in HeapStats, next to the rest of the allocator's numbers.
+struct RuntimeStats
+{
+    static constexpr int kDepthBuckets = 8; // The last one counts 7 or more
+
+    size_t userCalls = 0;
+    size_t nativeCalls = 0; // Natives and builtin methods
+    size_t scopeDepth[kDepthBuckets] = {}; // Variable accesses by scopes walked
+    size_t timersQueued = 0;
+    size_t timersFired = 0;
+    double timerLatenessMs = 0; // Total time fired timers spent overdue
+    double maxTimerLatenessMs = 0;
+    size_t microtasksRun = 0;
+    size_t parses = 0;
+    double parseMs = 0; // Lexing and parsing, without folding or compiling
+
+    void countAccess(int depth) { scopeDepth[depth < kDepthBuckets ? depth : kDepthBuckets - 1]++; }
 };
+inline RuntimeStats &currentStats();
 
-// ==========================================
-// 2. THE ENVIRONMENT (SCOPE)
-// ==========================================
+// Common header of every garbage-collected cell. Cells are allocated from the
+// Heap's arenas and reclaimed by its mark-sweep collector.
+struct HeapCell
+{
+    ValueType type;
+    bool marked = false;
+    HeapCell(ValueType t) : type(t) {}
+};
+
+// Raw allocation from the managed heap; see section 4
+void *gcAllocate(size_t size);
+// Storage outside a cell (elements, string text, slot vectors) counts
+// towards the heap. Report it before allocating it: past the heap limit
+// this throws, and nothing has changed yet.
+void gcReportExternal(size_t bytes);
+// The same accounting without the check, for constructors, which must not
+// throw once their cell's memory is handed out
+void gcNoteExternal(size_t bytes);
+// Reported like gcReportExternal, for memory that lives as long as the heap
+// (the shape tree) and so is never found by a sweep
+void gcReportPinned(size_t bytes);
+
+void gcCountAllocation(ValueType type);
 
-class Environment : public enable_shared_from_this<Environment>
+template <class T, class... Args>
+T *gcNew(Args &&...args)
 {
-public:
-    map<string, shared_ptr<Value>> vars;
-    shared_ptr<Environment> parent;
+    T *cell = new (gcAllocate(sizeof(T))) T(forward<Args>(args)...);
+    gcCountAllocation(cell->type);
+    return cell;
+}
+
+struct ListCell;
+struct ObjectCell;
+struct FunctionCell;
+struct NativeCell;
+struct PromiseCell;
+
+// A NaN-boxed value: always 8 bytes and trivially copyable. Doubles are stored
+// as themselves; every other type hides in the payload of a quiet NaN. Null
+// and booleans are immediates, the remaining types carry a 48-bit HeapCell
+// pointer that the collector traces.
+class Value
+{
+    static constexpr uint64_t QNAN = 0x7ffc000000000000ULL;
+    static constexpr uint64_t CELL_TAG = 0x8000000000000000ULL | QNAN;
+    static constexpr uint64_t NULL_BITS = QNAN | 1;
+    static constexpr uint64_t FALSE_BITS = QNAN | 2;
+    static constexpr uint64_t TRUE_BITS = QNAN | 3;
+
+    uint64_t bits = NULL_BITS;
 
-    Environment(shared_ptr<Environment> p = nullptr) : parent(p) {}
+    friend class JitCompiler; // Emits tag checks and constants as raw bits
+
+public:
+    Value() = default;
+    explicit Value(HeapCell *cell) : bits(CELL_TAG | (uint64_t)(uintptr_t)cell) {}
 
-    void define(string name, shared_ptr<Value> val)
+    static Value number(double d)
     {
-        vars[name] = val;
+        Value v;
+        if (d != d)
+            d = NAN; // Canonicalize so no NaN payload can look like a tag
+        memcpy(&v.bits, &d, sizeof d);
+        return v;
+    }
+    static Value boolean(bool b)
+    {
+        Value v;
+        v.bits = b ? TRUE_BITS : FALSE_BITS;
+        return v;
     }
 
-    shared_ptr<Value> lookup(string name)
+    bool isNumber() const { return (bits & QNAN) != QNAN; }
+    bool isCell() const { return (bits & CELL_TAG) == CELL_TAG; }
+    bool isNull() const { return bits == NULL_BITS; }
+    bool isBool() const { return bits == TRUE_BITS || bits == FALSE_BITS; }
+
+    double asNumber() const
     {
-        if (vars.count(name))
-            return vars[name];
-        if (parent)
-            return parent->lookup(name);
-        throw runtime_error("Undefined variable: " + name);
+        double d;
+        memcpy(&d, &bits, sizeof d);
+        return d;
     }
+    bool asBool() const { return bits == TRUE_BITS; }
+    HeapCell *asCell() const { return (HeapCell *)(uintptr_t)(bits & ~CELL_TAG); }
 
-    void assign(string name, shared_ptr<Value> val)
+    ValueType type() const
     {
-        if (vars.count(name))
-        {
-            vars[name] = val;
-            return;
-        }
-        if (parent)
-        {
-            parent->assign(name, val);
-            return;
-        }
-        throw runtime_error("Cannot assign to undefined variable: " + name);
+        if (isNumber())
+            return V_NUM;
+        if (isCell())
+            return asCell()->type;
+        return isNull() ? V_NULL : V_BOOL;
     }
-};
+    bool is(ValueType t) const { return isCell() ? asCell()->type == t : type() == t; }
 
-// ==========================================
-// 3. ABSTRACT SYNTAX TREE (AST) NODES
-// ==========================================
+    // Typed views of the heap cell; only valid after checking type()
+    StringCell *asString() const { return (StringCell *)asCell(); }
+    ListCell *asList() const { return (ListCell *)asCell(); }
+    ObjectCell *asObject() const { return (ObjectCell *)asCell(); }
+    FunctionCell *asFunction() const { return (FunctionCell *)asCell(); }
+    NativeCell *asNative() const { return (NativeCell *)asCell(); }
+    PromiseCell *asPromise() const { return (PromiseCell *)asCell(); }
 
-struct ASTNode
-{
-    virtual ~ASTNode() = default;
-    virtual shared_ptr<Value> eval(shared_ptr<Environment> env) = 0;
-};
+    // Numeric view used by arithmetic: non-numbers read as 0
+    double num() const { return isNumber() ? asNumber() : 0; }
+    // String view used by equality: non-strings read as ""
+    const string &str() const;
 
-// --- Literals ---
-struct NumberNode : ASTNode
-{
-    double val;
-    NumberNode(double v) : val(v) {}
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    string toString() const;
+    void appendTo(string &out) const; // toString() without the temporary
+
+    bool truthy() const
     {
-        auto v = make_shared<Value>();
-        v->type = V_NUM;
-        v->numVal = val;
-        return v;
+        if (isNumber())
+            return asNumber() != 0;
+        return bits == TRUE_BITS;
     }
 };
 
-struct StringNode : ASTNode
+static_assert(sizeof(Value) == 8, "Value must stay a single NaN-boxed word");
+static_assert(is_trivially_copyable<Value>::value, "Values are copied freely; the GC owns lifetimes");
+
+// Either flat, with the text in `value`, or a rope: the lazy concatenation
+// left + right, flattened in place the first time its text is needed. So `+`
+// in a loop costs O(1) per append and a single copy at the end.
+struct StringCell : HeapCell
 {
-    string val;
-    StringNode(string v) : val(v) {}
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    string value;
+    StringCell *left = nullptr, *right = nullptr; // Non-null while an unflattened rope
+    uint32_t length;       // 32 bits keeps the cell in the 64-byte size class
+    bool interned = false; // Owned by the StringTable: the only cell with this text
+    StringCell(string s) : HeapCell(V_STR), value(move(s)), length(checkedLength(value.size())) {}
+    StringCell(StringCell *l, StringCell *r)
+        : HeapCell(V_STR), left(l), right(r), length(checkedLength((size_t)l->length + r->length)) {}
+
+    static uint32_t checkedLength(size_t n)
     {
-        auto v = make_shared<Value>();
-        v->type = V_STR;
-        v->strVal = val;
-        return v;
+        if (n > UINT32_MAX)
+            throw runtime_error("String too long");
+        return (uint32_t)n;
     }
+
+    bool isRope() const { return left != nullptr; }
+    const string &flat();
 };
 
-struct IdentifierNode : ASTNode
+static_assert(sizeof(StringCell) <= 64, "StringCell should fit the 64-byte size class");
+
+// V8-style elements kinds. An array starts as packed small integers and
+// generalizes (never narrows) when a value its kind can't hold is stored:
+// SMI -> DOUBLE -> ELEMENTS. Numeric arrays thus stay plain int32_t/double
+// buffers that natives can scan directly.
+enum ElementsKind : uint8_t
 {
-    string name;
-    IdentifierNode(string n) : name(n) {}
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
-    {
-        return env->lookup(name);
-    }
+    PACKED_SMI,
+    PACKED_DOUBLE,
+    PACKED_ELEMENTS // Any Value; the only kind the collector traces
 };
 
-// --- Structures ---
-struct ArrayNode : ASTNode
+inline bool isSmi(double d)
 {
-    vector<shared_ptr<ASTNode>> elements;
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
-    {
-        auto arr = make_shared<Value>();
-        arr->type = V_LIST;
-        for (auto &el : elements)
-            arr->listVal.push_back(el->eval(env));
-        return arr;
-    }
-};
+    return d >= INT32_MIN && d <= INT32_MAX && (int32_t)d == d && !(d == 0 && signbit(d));
+}
 
-struct ObjectNode : ASTNode
+struct ListCell : HeapCell
 {
-    map<string, shared_ptr<ASTNode>> props;
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    ElementsKind kind = PACKED_SMI;
+    uint32_t length = 0;
+    uint32_t capacity = 0;
+    void *elements = nullptr; // int32_t[], double[] or Value[] by `kind`
+
+    ListCell() : HeapCell(V_LIST) {}
+    ~ListCell() { free(elements); }
+
+    int32_t *smis() const { return (int32_t *)elements; }
+    double *doubles() const { return (double *)elements; }
+    Value *values() const { return (Value *)elements; }
+
+    static ElementsKind kindFor(const Value &v)
     {
-        auto obj = make_shared<Value>();
-        obj->type = V_OBJ;
-        for (auto const &[key, valNode] : props)
-        {
-            obj->objVal[key] = valNode->eval(env);
-        }
-        return obj;
+        if (!v.isNumber())
+            return PACKED_ELEMENTS;
+        return isSmi(v.asNumber()) ? PACKED_SMI : PACKED_DOUBLE;
     }
-};
 
-// --- Operations ---
-struct BinaryOpNode : ASTNode
-{
-    string op;
-    shared_ptr<ASTNode> left, right;
-    BinaryOpNode(string o, shared_ptr<ASTNode> l, shared_ptr<ASTNode> r) : op(o), left(l), right(r) {}
+    static size_t elementSize(ElementsKind k) { return k == PACKED_SMI ? sizeof(int32_t) : 8; }
 
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    Value get(uint32_t i) const
     {
-        auto l = left->eval(env);
-        auto r = right->eval(env);
-        auto res = make_shared<Value>();
-
-        if (op == "+")
+        if (i >= length)
+            return Value();
+        switch (kind)
         {
-            if (l->type == V_STR || r->type == V_STR)
-            {
-                res->type = V_STR;
-                res->strVal = l->toString() + r->toString();
-            }
-            else
-            {
-                res->type = V_NUM;
-                res->numVal = l->numVal + r->numVal;
-            }
-        }
-        else if (op == "-")
-        {
-            res->type = V_NUM;
-            res->numVal = l->numVal - r->numVal;
+        case PACKED_SMI:
+            return Value::number(smis()[i]);
+        case PACKED_DOUBLE:
+            return Value::number(doubles()[i]);
+        default:
+            return values()[i];
         }
-        else if (op == "*")
+    }
+
+    // Store at i <= length; i == length appends
+    void set(uint32_t i, const Value &v)
+    {
+        ElementsKind needed = kindFor(v);
+        if (needed > kind)
+            transitionTo(needed);
+        if (i == length)
         {
-            res->type = V_NUM;
-            res->numVal = l->numVal * r->numVal;
+            if (length == UINT32_MAX)
+                throw runtime_error("Array too long");
+            reserve((size_t)length + 1);
+            length++;
         }
-        else if (op == "/")
+        switch (kind)
         {
-            res->type = V_NUM;
-            res->numVal = l->numVal / r->numVal;
+        case PACKED_SMI:
+            smis()[i] = (int32_t)v.asNumber();
+            break;
+        case PACKED_DOUBLE:
+            doubles()[i] = v.asNumber();
+            break;
+        default:
+            values()[i] = v;
+            break;
         }
-        else if (op == ">")
+    }
+
+    void push(const Value &v) { set(length, v); }
+
+    // Turn a fresh, empty array into n doubles for a native to fill in
+    double *allocateDoubles(uint32_t n)
+    {
+        kind = PACKED_DOUBLE;
+        reserve(n);
+        length = n;
+        return doubles();
+    }
+
+    // Grow geometrically so push is amortized O(1)
+    void reserve(size_t n)
+    {
+        if (n <= capacity)
+            return;
+        size_t grown = max<size_t>({n, (size_t)capacity * 2, 4});
+        resize(kind, min<size_t>(grown, UINT32_MAX));
+    }
+
+    void transitionTo(ElementsKind next)
+    {
+        size_t count = length;
+        if (next == PACKED_DOUBLE)
         {
-            res->type = V_BOOL;
-            res->boolVal = l->numVal > r->numVal;
+            // int32 -> double widens in place, walking back to front
+            resize(PACKED_DOUBLE, capacity);
+            for (size_t i = count; i-- > 0;)
+                doubles()[i] = smis()[i];
         }
-        else if (op == "<")
+        else
         {
-            res->type = V_BOOL;
-            res->boolVal = l->numVal < r->numVal;
+            ElementsKind from = kind;
+            resize(PACKED_ELEMENTS, capacity);
+            for (size_t i = count; i-- > 0;)
+                values()[i] = Value::number(from == PACKED_SMI ? smis()[i] : doubles()[i]);
         }
-        else if (op == "==")
+        kind = next;
+    }
+
+private:
+    // Reallocate for `newCapacity` elements of kind `k`; contents stay in the
+    // old element format until the caller converts them
+    void resize(ElementsKind k, size_t newCapacity)
+    {
+        size_t oldBytes = capacity * elementSize(kind);
+        size_t newBytes = newCapacity * elementSize(k);
+        if (newBytes > oldBytes)
         {
-            if (l->type == V_NUM)
-                res->boolVal = (l->numVal == r->numVal);
-            else if (l->type == V_STR)
-                res->boolVal = (l->strVal == r->strVal);
-            res->type = V_BOOL;
+            gcReportExternal(newBytes - oldBytes);
+            void *p = realloc(elements, newBytes);
+            if (!p)
+                throw bad_alloc();
+            elements = p;
         }
-        return res;
+        capacity = (uint32_t)newCapacity;
     }
 };
 
-// --- Statements ---
-struct BlockNode : ASTNode
+// Hidden class: the layout shared by every object that gained the same
+// properties in the same order. Adding a property follows (or creates) a
+// transition to a child shape, so equal layouts end up as the same Shape.
+// Keys are interned strings, compared by pointer.
+//
+// Each transition copies its parent's keys, so an object that keeps
+// gaining properties would cost quadratic memory in shapes that are never
+// freed. Past kMaxFastProperties (or on a key that isn't interned) it moves
+// to dictionary mode instead: a shape of its own, changed in place, whose
+// keys are compared by text.
+struct Shape
 {
-    vector<shared_ptr<ASTNode>> statements;
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    static constexpr int kLinearSearch = 8; // Up to this many keys, scan instead of hashing
+    static constexpr int kMaxFastProperties = 128;
+
+    vector<StringCell *> keys;                   // Property name for each slot offset
+    unordered_map<const StringCell *, int> offset; // Reverse of `keys`
+    unordered_map<const StringCell *, unique_ptr<Shape>> transitions;
+    bool dictionary = false;              // Owned by one ObjectCell; inline caches skip it
+    unordered_map<string_view, int> named; // Reverse of `keys` in dictionary mode
+
+    // Shape trees are per isolate, so shapes never cross threads
+    static Shape *root() { return currentRootShape(); }
+
+    int size() const { return (int)keys.size(); }
+
+    // Roughly what the shape holds on the C++ heap, for the collector's accounting
+    static constexpr size_t kEntryBytes = 32; // One hash map node, plus its bucket
+    size_t footprint() const
     {
-        shared_ptr<Value> lastVal = make_shared<Value>();
-        for (auto &stmt : statements)
+        return sizeof(Shape) + keys.capacity() * sizeof(StringCell *) +
+               (offset.size() + transitions.size() + named.size()) * kEntryBytes;
+    }
+
+    // Slot offset of `key`, or -1 if objects of this shape don't have it.
+    // `key` must be flat; outside dictionary mode, interned too.
+    int find(const StringCell *key) const
+    {
+        if (dictionary)
+            return findText(key->value);
+        if (size() <= kLinearSearch)
         {
-            lastVal = stmt->eval(env);
-            // In a real engine, we would handle 'return' signals here
+            for (int i = 0; i < size(); ++i)
+                if (keys[i] == key)
+                    return i;
+            return -1;
         }
-        return lastVal;
+        auto it = offset.find(key);
+        return it == offset.end() ? -1 : it->second;
     }
-};
 
-struct VarDeclNode : ASTNode
-{
-    string name;
-    shared_ptr<ASTNode> init;
-    VarDeclNode(string n, shared_ptr<ASTNode> i) : name(n), init(i) {}
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    int findText(string_view text) const
     {
-        auto val = init ? init->eval(env) : make_shared<Value>();
-        env->define(name, val);
-        return val;
+        auto it = named.find(text);
+        return it == named.end() ? -1 : it->second;
+    }
+
+    // Not for dictionary shapes, which ObjectCell::addProperty changes in place
+    Shape *withProperty(StringCell *key)
+    {
+        auto it = transitions.find(key);
+        if (it != transitions.end())
+            return it->second.get();
+        // The child, its copy of our keys and offsets, and our edge to it
+        gcReportPinned(sizeof(Shape) + (keys.size() + 1) * (sizeof(StringCell *) + kEntryBytes) + kEntryBytes);
+        auto next = make_unique<Shape>();
+        next->keys = keys;
+        next->keys.push_back(key);
+        next->offset = offset;
+        next->offset[key] = size();
+        return (transitions[key] = move(next)).get();
     }
 };
 
-struct IfNode : ASTNode
+struct ObjectCell : HeapCell
 {
-    shared_ptr<ASTNode> cond, thenBranch, elseBranch;
-    IfNode(shared_ptr<ASTNode> c, shared_ptr<ASTNode> t, shared_ptr<ASTNode> e)
-        : cond(c), thenBranch(t), elseBranch(e) {}
-
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    Shape *shape;
+    vector<Value> slots; // Property values, laid out by `shape`
+    unique_ptr<Shape> dictionary; // In dictionary mode, the shape `shape` points at
+    ObjectCell(Shape *s = Shape::root()) : HeapCell(V_OBJ), shape(s), slots(s->size())
     {
-        auto c = cond->eval(env);
-        bool truthy = false;
-        if (c->type == V_BOOL)
-            truthy = c->boolVal;
-        else if (c->type == V_NUM)
-            truthy = (c->numVal != 0);
+        gcNoteExternal(slots.capacity() * sizeof(Value));
+    }
 
-        if (truthy)
-            return thenBranch->eval(env);
-        else if (elseBranch)
-            return elseBranch->eval(env);
-        return make_shared<Value>();
+    // Adds `key`, which the object must not have yet. `key` must be flat,
+    // and stays alive with the object if it isn't interned.
+    void addProperty(StringCell *key, Value v)
+    {
+        if (!shape->dictionary && (!key->interned || shape->size() >= Shape::kMaxFastProperties))
+            toDictionary();
+        if (shape->dictionary)
+        {
+            gcReportExternal(sizeof(StringCell *) + Shape::kEntryBytes);
+            shape->named.emplace(key->value, shape->size());
+            shape->keys.push_back(key);
+        }
+        else
+            shape = shape->withProperty(key);
+        addSlot(move(v));
     }
-};
 
-struct WhileNode : ASTNode
-{
-    shared_ptr<ASTNode> cond, body;
-    WhileNode(shared_ptr<ASTNode> c, shared_ptr<ASTNode> b) : cond(c), body(b) {}
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
+    void addSlot(Value v)
     {
-        while (true)
+        if (slots.size() == slots.capacity())
         {
-            auto c = cond->eval(env);
-            if ((c->type == V_BOOL && !c->boolVal) || (c->type == V_NUM && c->numVal == 0))
-                break;
-            body->eval(env);
+            size_t grown = max<size_t>(4, slots.capacity() * 2);
+            gcReportExternal((grown - slots.capacity()) * sizeof(Value));
+            slots.reserve(grown);
         }
-        return make_shared<Value>();
+        slots.push_back(move(v));
+    }
+
+private:
+    void toDictionary()
+    {
+        gcReportExternal(sizeof(Shape) + shape->keys.size() * (sizeof(StringCell *) + Shape::kEntryBytes));
+        auto own = make_unique<Shape>();
+        own->dictionary = true;
+        own->keys = shape->keys;
+        for (int i = 0; i < own->size(); ++i)
+            own->named.emplace(own->keys[i]->value, i);
+        shape = own.get();
+        dictionary = move(own);
     }
 };
 
-struct FunctionDeclNode : ASTNode
+// User function
+struct FunctionCell : HeapCell
 {
-    string name;
     vector<string> params;
-    shared_ptr<ASTNode> body;
-    FunctionDeclNode(string n, vector<string> p, shared_ptr<ASTNode> b)
-        : name(n), params(p), body(b) {}
+    shared_ptr<ASTNode> body;          // AST Node for function body
+    Environment *closure = nullptr;    // Closure scope
+    shared_ptr<BytecodeFunction> code; // Compiled body (bytecode VM only)
+    int slotCount = 0;                 // Size of each invocation's Environment
+    bool isAsync = false;              // Calls return a promise (bytecode VM only)
+    FunctionCell() : HeapCell(V_FUNC) {}
+};
 
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
-    {
-        auto func = make_shared<Value>();
-        func->type = V_FUNC;
-        func->params = params;
-        func->body = body;
-        func->closure = env; // Capture scope!
-        env->define(name, func);
-        return func;
-    }
+// A native's arguments: a view of the caller's registers rather than a
+// copy. Only valid for the duration of the call.
+class Args
+{
+    const Value *first = nullptr;
+    size_t count = 0;
+
+public:
+    Args() = default;
+    Args(const Value *p, size_t n) : first(p), count(n) {}
+    Args(const vector<Value> &v) : first(v.data()), count(v.size()) {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Value &operator[](size_t i) const { return first[i]; }
+    const Value *begin() const { return first; }
+    const Value *end() const { return first + count; }
 };
 
-struct CallNode : ASTNode
+// Native function (print, setTimeout)
+struct NativeCell : HeapCell
 {
-    string callee;
-    vector<shared_ptr<ASTNode>> args;
-    CallNode(string c, vector<shared_ptr<ASTNode>> a) : callee(c), args(a) {}
+    function<Value(Args)> nativeFn;
+    HeapCell *bound = nullptr; // A cell the function works on, e.g. the promise a resolve() settles
+    NativeCell(function<Value(Args)> fn) : HeapCell(V_NATIVE), nativeFn(move(fn)) {}
+};
 
-    shared_ptr<Value> eval(shared_ptr<Environment> env) override
-    {
-        auto func = env->lookup(callee);
-        vector<shared_ptr<Value>> argVals;
-        for (auto &a : args)
-            argVals.push_back(a->eval(env));
+struct AsyncFrame;
 
-        if (func->type == V_NATIVE)
-        {
-            return func->nativeFn(argVals);
-        }
+// Something waiting on a promise: a then() handler, whose result settles
+// `derived`, or a suspended async function to resume with the value
+struct Reaction
+{
+    Value handler;                  // Callable, or null to pass the value through
+    PromiseCell *derived = nullptr;
+    AsyncFrame *frame = nullptr;
+};
+
+// The language has no throw, so a promise is only ever pending or
+// fulfilled. Reactions run as microtasks once it settles (section 11).
+struct PromiseCell : HeapCell
+{
+    bool settled = false;
+    Value result;
+    vector<Reaction> reactions; // Waiting while pending
+    PromiseCell() : HeapCell(V_PROMISE) {}
+};
 
-        if (func->type == V_FUNC)
+inline Value makeString(string s)
+{
+    gcReportExternal(s.capacity());
+    return Value(gcNew<StringCell>(move(s)));
+}
+
+inline const string &StringCell::flat()
+{
+    if (!isRope())
+        return value;
+    // Walk the tree with an explicit stack: loop-built ropes are as deep as
+    // the number of appends
+    gcReportExternal(length);
+    string out;
+    out.reserve(length);
+    vector<StringCell *> pending{right, left};
+    while (!pending.empty())
+    {
+        StringCell *cell = pending.back();
+        pending.pop_back();
+        if (cell->isRope())
         {
-            auto scope = make_shared<Environment>(func->closure);
-            for (size_t i = 0; i < func->params.size(); ++i)
-            {
-                if (i < argVals.size())
-                    scope->define(func->params[i], argVals[i]);
-            }
-            return func->body->eval(scope);
+            pending.push_back(cell->right);
+            pending.push_back(cell->left);
         }
-        throw runtime_error("Not a function: " + callee);
+        else
+            out += cell->value;
     }
-};
+    value = move(out);
+    left = right = nullptr;
+    return value;
+}
 
-// ==========================================
-// 4. PARSER (TURNS TOKENS -> AST)
-// ==========================================
+// Concatenations shorter than this are copied flat; a rope node isn't worth it
+constexpr size_t kMinRopeLength = 32;
 
-class Parser
+// l + r when either side is a string
+inline Value concatValues(const Value &l, const Value &r)
 {
-    string src;
-    size_t pos = 0;
+    StringCell *ls = l.is(V_STR) ? l.asString() : nullptr;
+    StringCell *rs = r.is(V_STR) ? r.asString() : nullptr;
+    string ltext = ls ? string() : l.toString();
+    string rtext = rs ? string() : r.toString();
+    if (ls && rs && ls->length == 0)
+        return r;
+    if (ls && rs && rs->length == 0)
+        return l;
 
-public:
-    Parser(string s) : src(s) {}
+    size_t total = (ls ? ls->length : ltext.size()) + (rs ? rs->length : rtext.size());
+    if (total < kMinRopeLength)
+        return makeString((ls ? ls->flat() : ltext) + (rs ? rs->flat() : rtext));
+    if (!ls)
+        ls = makeString(move(ltext)).asString();
+    if (!rs)
+        rs = makeString(move(rtext)).asString();
+    return Value(gcNew<StringCell>(ls, rs));
+}
+
+inline const string &Value::str() const
+{
+    static const string empty;
+    return is(V_STR) ? asString()->flat() : empty;
+}
+
+// l == r with a string on the left; non-strings on the right read as ""
+inline bool stringEquals(const Value &l, const Value &r)
+{
+    StringCell *ls = l.asString();
+    if (!r.is(V_STR))
+        return ls->length == 0;
+    StringCell *rs = r.asString();
+    if (ls == rs)
+        return true;
+    if ((ls->interned && rs->interned) || ls->length != rs->length)
+        return false;
+    return ls->flat() == rs->flat();
+}
+
+// Binary operators, shared by the tree-walker and the VM so the two can't
+// drift apart. Arithmetic and ordering read non-numbers as 0.
+enum BinaryOperator
+{
+    BIN_ADD,
+    BIN_SUB,
+    BIN_MUL,
+    BIN_DIV,
+    BIN_MOD,
+    BIN_GT,
+    BIN_LT,
+    BIN_GE,
+    BIN_LE,
+    BIN_EQ,
+    BIN_NE
+};
+
+const char *const binaryOperatorSymbols[] = {"+", "-", "*", "/", "%", ">", "<", ">=", "<=", "==", "!="};
+
+// == compares numbers numerically and strings by text; anything else on
+// the left is never equal
+inline bool looseEquals(const Value &l, const Value &r)
+{
+    if (l.isNumber())
+        return l.asNumber() == r.num();
+    if (l.is(V_STR))
+        return stringEquals(l, r);
+    return false;
+}
 
-    char peek(int offset = 0)
+template <BinaryOperator Op>
+inline Value applyBinary(const Value &l, const Value &r)
+{
+    if constexpr (Op == BIN_EQ)
+        return Value::boolean(looseEquals(l, r));
+    else if constexpr (Op == BIN_NE)
+        return Value::boolean(!looseEquals(l, r));
+    else if constexpr (Op == BIN_ADD)
     {
-        if (pos + offset >= src.size())
-            return 0;
-        return src[pos + offset];
+        if (l.isNumber() && r.isNumber())
+            return Value::number(l.asNumber() + r.asNumber());
+        if (l.is(V_STR) || r.is(V_STR))
+            return concatValues(l, r);
+        return Value::number(l.num() + r.num());
     }
+    else
+    {
+        // num() is a tag test in front of asNumber(): the number x number
+        // case costs one branch per operand
+        double a = l.num(), b = r.num();
+        if constexpr (Op == BIN_SUB)
+            return Value::number(a - b);
+        else if constexpr (Op == BIN_MUL)
+            return Value::number(a * b);
+        else if constexpr (Op == BIN_DIV)
+            return Value::number(a / b);
+        else if constexpr (Op == BIN_MOD)
+            return Value::number(fmod(a, b));
+        else if constexpr (Op == BIN_GT)
+            return Value::boolean(a > b);
+        else if constexpr (Op == BIN_LT)
+            return Value::boolean(a < b);
+        else if constexpr (Op == BIN_GE)
+            return Value::boolean(a >= b);
+        else
+            return Value::boolean(a <= b);
+    }
+}
 
-    char advance() { return src[pos++]; }
+// One StringCell per distinct text for literals and property keys, so they
+// compare by pointer and literals cost nothing to evaluate. Per isolate, and
+// a GC root: only the source code and property stores add names, and a key
+// that is merely looked up goes through find() so it isn't kept forever.
+class StringTable
+{
+    unordered_map<string_view, StringCell *> cells; // Keys view each cell's own text
 
-    void skipWhitespace()
+public:
+    // The interned cell for `text`, or null: never adds one
+    StringCell *find(string_view text) const
     {
-        while (pos < src.size() && isspace(src[pos]))
-            pos++;
+        auto it = cells.find(text);
+        return it == cells.end() ? nullptr : it->second;
     }
 
-    string parseToken()
+    StringCell *intern(string_view text)
     {
-        skipWhitespace();
-        if (pos >= src.size())
-            return "";
-
-        char c = peek();
-        if (isalpha(c))
-        {
-            string s;
-            while (isalnum(peek()))
-                s += advance();
-            return s;
-        }
-        if (isdigit(c))
-        {
-            string s;
-            while (isdigit(peek()) || peek() == '.')
-                s += advance();
-            return s;
-        }
-        if (c == '"')
-        {
-            advance();
-            string s;
-            while (peek() != '"')
-                s += advance();
-            advance();
-            return "\"" + s + "\"";
-        }
-        string op;
-        op += advance();
-        if ((op == "=" || op == "!" || op == "<" || op == ">") && peek() == '=')
-            op += advance();
-        return op;
+        auto it = cells.find(text);
+        if (it != cells.end())
+            return it->second;
+        StringCell *cell = makeString(string(text)).asString();
+        cell->interned = true;
+        cells.emplace(cell->value, cell);
+        return cell;
     }
 
-    // --- Recursive Descent ---
+    template <class F>
+    void forEach(F f) const
+    {
+        for (auto &entry : cells)
+            f(entry.second);
+    }
+};
 
-    shared_ptr<ASTNode> parseExpression()
+// The "%f" format to_string uses, with trailing zeros trimmed ("10." and
+// "0.5"), but without its locale lookup and two temporary strings
+inline void appendNumber(string &out, double d)
+{
+    char buf[320]; // "%f" of the largest double: 309 digits, the point and 6 decimals
+    char *end;
+    if (fabs(d) < 1e15 && d == trunc(d) && !(d == 0 && signbit(d)))
     {
-        return parseComparison();
+        end = to_chars(buf, buf + sizeof buf, (int64_t)d).ptr;
+        *end++ = '.';
     }
+    else
+    {
+        end = to_chars(buf, buf + sizeof buf, d, chars_format::fixed, 6).ptr;
+        while (end[-1] == '0')
+            --end;
+    }
+    out.append(buf, end);
+}
+
+inline void Value::appendTo(string &out) const
+{
+    if (isNumber())
+        appendNumber(out, asNumber());
+    else if (is(V_STR))
+        out += asString()->flat();
+    else
+        out += toString();
+}
 
-    shared_ptr<ASTNode> parseComparison()
+inline string Value::toString() const
+{
+    switch (type())
     {
-        auto left = parseAdditive();
-        skipWhitespace();
-        char c = peek();
-        if (c == '>' || c == '<' || c == '=')
-        {
-            string op = parseToken();
-            auto right = parseAdditive();
-            return make_shared<BinaryOpNode>(op, left, right);
-        }
-        return left;
+    case V_NUM:
+    {
+        string s;
+        appendNumber(s, asNumber());
+        return s;
+    }
+    case V_STR:
+        return asString()->flat();
+    case V_BOOL:
+        return asBool() ? "true" : "false";
+    case V_NULL:
+        return "null";
+    case V_LIST:
+        return "[Array]";
+    case V_OBJ:
+        return "[Object]";
+    case V_FUNC:
+    case V_NATIVE:
+        return "[Function]";
+    case V_PROMISE:
+        return "[Promise]";
+    default:
+        break;
     }
+    return "";
+}
 
-    shared_ptr<ASTNode> parseAdditive()
+// Inline cache for one property-access site. The first shape seen makes it
+// monomorphic, up to kEntries shapes polymorphic; past that the site goes
+// megamorphic and always does the shape lookup. A store entry also records
+// the shape the object transitions to when the store adds the property.
+struct PropertyCache
+{
+    static constexpr int kEntries = 4;
+    Shape *shapes[kEntries] = {};
+    Shape *targets[kEntries] = {};
+    int offsets[kEntries] = {};
+    int count = 0;
+    bool megamorphic = false;
+
+    int find(Shape *shape) const
     {
-        auto left = parseMultiplicative();
-        while (true)
+        for (int i = 0; i < count; ++i)
         {
-            skipWhitespace();
-            char c = peek();
-            if (c != '+' && c != '-')
-                break;
-            string op = parseToken();
-            auto right = parseMultiplicative();
-            left = make_shared<BinaryOpNode>(op, left, right);
+            if (shapes[i] == shape)
+                return i;
         }
-        return left;
+        return -1;
     }
 
-    shared_ptr<ASTNode> parseMultiplicative()
+    void record(Shape *shape, int offset, Shape *target)
     {
-        auto left = parsePrimary();
-        while (true)
+        if (count == kEntries)
         {
-            skipWhitespace();
-            char c = peek();
-            if (c != '*' && c != '/')
-                break;
-            string op = parseToken();
-            auto right = parsePrimary();
-            left = make_shared<BinaryOpNode>(op, left, right);
+            megamorphic = true;
+            return;
         }
-        return left;
+        shapes[count] = shape;
+        offsets[count] = offset;
+        targets[count] = target;
+        count++;
     }
+};
+
+inline ObjectCell *expectObject(const Value &obj, const StringCell *key)
+{
+    if (!obj.is(V_OBJ))
+        throw runtime_error("Cannot access property '" + key->value + "' of " + obj.toString());
+    return obj.asObject();
+}
+
+// arr.length and str.length, the only properties non-objects have
+inline Value getBuiltinProperty(const Value &obj, const StringCell *key)
+{
+    if (key->value == "length")
+    {
+        if (obj.is(V_LIST))
+            return Value::number(obj.asList()->length);
+        if (obj.is(V_STR))
+            return Value::number(obj.asString()->length);
+    }
+    return Value();
+}
+
+// obj.key; missing properties read as null
+inline Value getProperty(const Value &obj, const StringCell *key, PropertyCache &cache)
+{
+    if (obj.is(V_LIST) || obj.is(V_STR))
+        return getBuiltinProperty(obj, key);
+    ObjectCell *o = expectObject(obj, key);
+    int hit = cache.find(o->shape);
+    if (hit >= 0)
+        return cache.offsets[hit] < 0 ? Value() : o->slots[cache.offsets[hit]];
+
+    int offset = o->shape->find(key);
+    if (!cache.megamorphic && !o->shape->dictionary)
+        cache.record(o->shape, offset, o->shape);
+    return offset < 0 ? Value() : o->slots[offset];
+}
+
+// obj.key = val; adding a property moves the object to a child shape, or
+// grows its dictionary
+inline void setProperty(const Value &obj, StringCell *key, Value val, PropertyCache &cache)
+{
+    ObjectCell *o = expectObject(obj, key);
+    int hit = cache.find(o->shape);
+    if (hit >= 0)
+    {
+        o->shape = cache.targets[hit];
+        if (cache.offsets[hit] == (int)o->slots.size())
+            o->addSlot(move(val));
+        else
+            o->slots[cache.offsets[hit]] = move(val);
+        return;
+    }
+
+    Shape *before = o->shape;
+    int offset = before->find(key);
+    if (offset < 0)
+    {
+        offset = before->size();
+        o->addProperty(key, move(val));
+    }
+    else
+        o->slots[offset] = move(val);
+    if (!cache.megamorphic && !o->shape->dictionary)
+        cache.record(before, offset, o->shape);
+}
+
+// Array index as uint32, or -1 if `index` is not a valid one
+inline int64_t arrayIndex(const Value &index)
+{
+    if (!index.isNumber())
+        return -1;
+    double d = index.asNumber();
+    return d >= 0 && d < UINT32_MAX && d == (double)(uint32_t)d ? (int64_t)d : -1;
+}
+
+// obj[index]: array elements by number, object properties by string key
+inline Value getIndex(const Value &obj, const Value &index)
+{
+    if (obj.is(V_LIST))
+    {
+        int64_t i = arrayIndex(index);
+        return i < 0 ? Value() : obj.asList()->get((uint32_t)i);
+    }
+    if (obj.is(V_OBJ) && index.is(V_STR))
+    {
+        // Fast shapes' keys are all interned, so a key that isn't can't be on the object
+        StringCell *key = index.asString();
+        ObjectCell *o = obj.asObject();
+        int offset;
+        if (o->shape->dictionary)
+            offset = o->shape->findText(key->flat());
+        else
+        {
+            if (!key->interned)
+                key = findInternedString(key->flat());
+            offset = key ? o->shape->find(key) : -1;
+        }
+        return offset < 0 ? Value() : o->slots[offset];
+    }
+    throw runtime_error("Cannot index " + obj.toString() + " with " + index.toString());
+}
+
+// Padding one store may add to an array, beyond doubling it; arrays have no
+// holes, so a store far past the end would have to fill them all in
+constexpr uint32_t kMaxArrayPadding = 1 << 20;
+
+// obj[index] = val. Writing past the end of an array pads it with nulls.
+inline void setIndex(const Value &obj, const Value &index, const Value &val)
+{
+    if (obj.is(V_LIST))
+    {
+        int64_t i = arrayIndex(index);
+        if (i < 0)
+            throw runtime_error("Invalid array index: " + index.toString());
+        ListCell *list = obj.asList();
+        if (i > list->length)
+        {
+            if (i - list->length > max(list->length, kMaxArrayPadding))
+                throw runtime_error("Array index " + index.toString() + " is too far past the end (length " +
+                                    to_string(list->length) + ")");
+            list->reserve((size_t)i + 1);
+        }
+        while (list->length < (uint32_t)i)
+            list->push(Value());
+        list->set((uint32_t)i, val);
+        return;
+    }
+    if (obj.is(V_OBJ) && index.is(V_STR))
+    {
+        // Not interned, so computed keys don't pile up in the StringTable: a
+        // key that isn't interned already puts the object in dictionary mode
+        StringCell *key = index.asString();
+        key->flat();
+        if (!key->interned)
+            if (StringCell *known = findInternedString(key->value))
+                key = known;
+        ObjectCell *o = obj.asObject();
+        int offset = o->shape->find(key);
+        if (offset < 0)
+            o->addProperty(key, val);
+        else
+            o->slots[offset] = val;
+        return;
+    }
+    throw runtime_error("Cannot index " + obj.toString() + " with " + index.toString());
+}
+
+Value promiseThen(PromiseCell *promise, const Value &handler); // Section 11
+
+// receiver.key(args): arr.push(...) and promise.then(...) are built in,
+// objects call function-valued properties
+inline bool callBuiltinMethod(const Value &receiver, const StringCell *key, const Value *args, int count, Value &result)
+{
+    if (receiver.is(V_LIST) && key->value == "push")
+    {
+        ListCell *list = receiver.asList();
+        for (int i = 0; i < count; ++i)
+            list->push(args[i]);
+        result = Value::number(list->length);
+        return true;
+    }
+    if (receiver.is(V_PROMISE) && key->value == "then")
+    {
+        result = promiseThen(receiver.asPromise(), count ? args[0] : Value());
+        return true;
+    }
+    return false;
+}
+
+inline Value methodTarget(const Value &receiver, const StringCell *key)
+{
+    if (receiver.is(V_OBJ))
+    {
+        ObjectCell *o = receiver.asObject();
+        int offset = o->shape->find(key);
+        if (offset >= 0 && (o->slots[offset].is(V_FUNC) || o->slots[offset].is(V_NATIVE)))
+            return o->slots[offset];
+    }
+    throw runtime_error("Not a function: " + key->value);
+}
+
+// Layout of an object literal, worked out once when it is parsed so that
+// evaluating the literal only fills slots
+struct ObjectLiteral
+{
+    Shape *shape = Shape::root();
+    vector<int> slotOf; // Slot for each property expression, in source order
+
+    ObjectLiteral() = default;
+    ObjectLiteral(const vector<string> &names)
+    {
+        for (auto &name : names)
+        {
+            StringCell *key = internString(name);
+            int offset = shape->find(key);
+            if (offset < 0)
+            {
+                offset = shape->size();
+                shape = shape->withProperty(key);
+            }
+            slotOf.push_back(offset);
+        }
+    }
+
+    Value instantiate(const Value *values) const
+    {
+        auto obj = gcNew<ObjectCell>(shape);
+        for (size_t i = 0; i < slotOf.size(); ++i)
+            obj->slots[slotOf[i]] = values[i];
+        return Value(obj);
+    }
+};
+
+// ==========================================
+// 2. THE ENVIRONMENT (SCOPE)
+// ==========================================
+
+// Storage for one function invocation's variables. Names are gone by the time
+// code runs: the Resolver assigns every parameter and `var` a slot index.
+// Environments are heap cells so closures that capture them are traced.
+class Environment : public HeapCell
+{
+public:
+    vector<Value> slots;
+    Environment *parent;
+
+    Environment(Environment *p = nullptr, size_t slotCount = 0) : HeapCell(V_ENV), slots(slotCount), parent(p)
+    {
+        gcNoteExternal(slots.capacity() * sizeof(Value));
+    }
+
+    Value &at(int depth, int slot)
+    {
+        Environment *env = this;
+        while (depth-- > 0)
+            env = env->parent;
+        return env->slots[slot];
+    }
+};
+
+// Top-level bindings (script vars, functions and natives) stay name-indexed,
+// but every name gets a stable index up front so accesses skip the lookup.
+class GlobalScope
+{
+    map<string, int> index;
+    vector<string> names;
+    vector<Value> values;
+    vector<uint8_t> defined; // Bytes rather than bits so JIT code can test them
+
+public:
+    int slotFor(const string &name)
+    {
+        auto it = index.find(name);
+        if (it != index.end())
+            return it->second;
+        names.push_back(name);
+        values.emplace_back();
+        defined.push_back(false);
+        return index[name] = (int)names.size() - 1;
+    }
+
+    const string &nameOf(int slot) const { return names[slot]; }
+    size_t size() const { return names.size(); }
+    const vector<Value> &allValues() const { return values; }
+    bool isDefined(int slot) const { return defined[slot]; }
+    Value *valueSlots() { return values.data(); }
+    uint8_t *definedFlags() { return defined.data(); }
+
+    void define(int slot, Value val)
+    {
+        values[slot] = val;
+        defined[slot] = true;
+    }
+
+    void define(const string &name, Value val) { define(slotFor(name), val); }
+
+    const Value &get(int slot) const
+    {
+        if (!defined[slot])
+            throw runtime_error("Undefined variable: " + names[slot]);
+        return values[slot];
+    }
+
+    void set(int slot, Value val)
+    {
+        if (!defined[slot])
+            throw runtime_error("Cannot assign to undefined variable: " + names[slot]);
+        values[slot] = val;
+    }
+};
+
+// Where a name lives, decided once by the Resolver
+struct VarRef
+{
+    int depth = -1; // Function scopes to walk up from the current one; -1 = global
+    int slot = -1;  // Slot in that Environment, or index into `globals`
+    bool isGlobal() const { return depth < 0; }
+};
+
+// Scope-resolution pass run between Parser::parse() and execution. Function
+// scopes are hoisted like JS `var`: parameters, vars and nested function
+// declarations anywhere in a body share one slot table.
+class Resolver
+{
+    vector<map<string, int>> scopes; // Innermost function scope last
+    // Parallel to scopes: some inner function reaches into (or through) this
+    // scope, so its variables must live in a heap Environment
+    vector<bool> captured;
+    GlobalScope &globals;
+
+public:
+    Resolver(GlobalScope &g = currentGlobals()) : globals(g) {}
+
+    VarRef declare(const string &name)
+    {
+        if (scopes.empty())
+            return {-1, globals.slotFor(name)};
+        auto &scope = scopes.back();
+        auto it = scope.find(name);
+        if (it != scope.end())
+            return {0, it->second};
+        int slot = (int)scope.size();
+        scope[name] = slot;
+        return {0, slot};
+    }
+
+    VarRef lookup(const string &name)
+    {
+        for (int i = (int)scopes.size() - 1; i >= 0; --i)
+        {
+            auto it = scopes[i].find(name);
+            if (it == scopes[i].end())
+                continue;
+            // Every scope on the way out is walked through env->parent
+            if (i != (int)scopes.size() - 1)
+                fill(captured.begin() + i, captured.end(), true);
+            return {(int)scopes.size() - 1 - i, it->second};
+        }
+        return {-1, globals.slotFor(name)};
+    }
+
+    void beginFunction(const vector<string> &params)
+    {
+        scopes.emplace_back();
+        captured.push_back(false);
+        for (auto &p : params)
+            declare(p);
+    }
+
+    // Returns the number of slots the function's Environment needs
+    int endFunction()
+    {
+        int count = (int)scopes.back().size();
+        scopes.pop_back();
+        captured.pop_back();
+        return count;
+    }
+
+    void resolve(const shared_ptr<ASTNode> &node);
+    void resolveFunction(const vector<string> &params, const shared_ptr<ASTNode> &body, int &slotCount,
+                         bool &needsEnvironment);
+
+    static void resolveScript(const vector<shared_ptr<ASTNode>> &stmts);
+};
+
+// Constant folding and dead-branch elimination, run between parsing and
+// scope resolution (section 7)
+class Folder
+{
+    static constexpr size_t kMaxFoldedString = 4096; // Longer results stay as code
+
+public:
+    size_t replaced = 0; // Nodes swapped for something simpler
+
+    void fold(shared_ptr<ASTNode> &node);
+    // Folds each statement and drops constants whose value is never used
+    void foldStatements(vector<shared_ptr<ASTNode>> &stmts);
+
+    // A literal node for `v`, or nullptr if it shouldn't be baked in
+    static shared_ptr<ASTNode> constant(Value v);
+    // True if dropping `node` would lose a hoisted var or function
+    static bool declaresNames(const shared_ptr<ASTNode> &node);
+
+    static size_t foldScript(vector<shared_ptr<ASTNode>> &stmts);
+};
+
+// Variable access for the tree-walking evaluator
+inline Value loadVar(const VarRef &ref, Environment *env)
+{
+    if (ref.isGlobal())
+        return currentGlobals().get(ref.slot);
+    currentStats().countAccess(ref.depth);
+    return env->at(ref.depth, ref.slot);
+}
+
+inline void storeVar(const VarRef &ref, Environment *env, Value val, bool isDeclaration = false)
+{
+    if (!ref.isGlobal())
+    {
+        currentStats().countAccess(ref.depth);
+        env->at(ref.depth, ref.slot) = move(val);
+    }
+    else if (isDeclaration)
+        currentGlobals().define(ref.slot, move(val));
+    else
+        currentGlobals().set(ref.slot, move(val));
+}
+
+// ==========================================
+// 3. BYTECODE (INSTRUCTIONS & COMPILER STATE)
+// ==========================================
+
+// Accumulator machine in the style of V8's Ignition: most instructions read
+// an operand register and leave their result in the accumulator.
+enum OpCode : unsigned char
+{
+    OP_LDA_NULL,     // acc = null
+    OP_LDA_CONST,    // acc = constants[a]
+    OP_LDAR,         // acc = r[a]
+    OP_STAR,         // r[a] = acc
+    OP_LDA_LOCAL,    // acc = env.slots[a]
+    OP_STA_LOCAL,    // env.slots[a] = acc
+    OP_LDA_CONTEXT,  // acc = env.at(a, b)  (a = scopes to walk up)
+    OP_STA_CONTEXT,  // env.at(a, b) = acc
+    OP_LDA_GLOBAL,   // acc = globals.get(a)
+    OP_STA_GLOBAL,   // globals.set(a, acc)
+    OP_DEF_GLOBAL,   // globals.define(a, acc)
+    OP_ADD,          // acc = r[a] + acc
+    OP_SUB,          // acc = r[a] - acc
+    OP_MUL,          // acc = r[a] * acc
+    OP_DIV,          // acc = r[a] / acc
+    OP_MOD,          // acc = r[a] % acc
+    OP_GT,           // acc = r[a] > acc
+    OP_LT,           // acc = r[a] < acc
+    OP_GE,           // acc = r[a] >= acc
+    OP_LE,           // acc = r[a] <= acc
+    OP_EQ,           // acc = r[a] == acc
+    OP_NE,           // acc = r[a] != acc
+    OP_NEGATE,       // acc = -acc
+    OP_NOT,          // acc = !acc
+    OP_MAKE_ARRAY,   // acc = [r[a] .. r[a + b - 1]]
+    OP_MAKE_OBJECT,  // acc = literals[c] filled from r[a] .. r[a + b - 1]
+    OP_GET_PROP,     // acc = acc[constants[a]]  (b = inline cache)
+    OP_SET_PROP,     // r[a][constants[b]] = acc  (c = inline cache)
+    OP_GET_INDEX,    // acc = r[a][acc]
+    OP_SET_INDEX,    // r[a][r[b]] = acc
+    OP_MAKE_CLOSURE, // acc = function(functions[a]) capturing env
+    OP_JUMP,         // pc = a
+    OP_JUMP_IF_FALSE, // if (!acc.truthy()) pc = a
+    OP_JUMP_IF_TRUE, // if (acc.truthy()) pc = a
+    OP_CALL_METHOD,  // acc = r[a].constants[c](r[a + 1] .. r[a + b])
+    OP_CALL,         // acc = r[a](r[a + 1] .. r[a + b]); names[c] is the callee, for errors
+    OP_TAIL_CALL,    // OP_CALL whose callee takes over the current frame
+    OP_AWAIT,        // suspend until acc settles, then acc = its value
+    OP_RETURN        // return acc
+};
+
+struct Instruction
+{
+    OpCode op;
+    int a = 0;
+    int b = 0;
+    int c = 0;
+};
+
+// One entry of a function's source position table: the instructions from
+// `pc` up to the next entry's pc came from source at line:col
+struct SourcePosition
+{
+    uint32_t pc;
+    int line, col;
+};
+
+// Where a lazy function body sits in its script (see Parser::lazyFunctions)
+struct SourceSpan
+{
+    shared_ptr<const string> source; // The whole script, shared by its lazy functions
+    size_t offset = 0, length = 0;
+    int line = 1, col = 1;
+
+    // The span alone, indented so the lexer numbers it as it was in the script
+    string text() const { return string(col - 1, ' ') + source->substr(offset, length); }
+};
+
+// A background compile of one lazy function (section 15)
+struct CompileTask;
+
+// A top-level function that has been declared but not compiled yet
+struct LazyFunction
+{
+    SourceSpan span;
+    shared_ptr<CompileTask> task; // Null unless --compile-threads queued it
+};
+
+// One compiled function (or the top-level script): a flat instruction array
+// plus the pools its operands index into.
+struct BytecodeFunction
+{
+    string name;
+    vector<string> params;
+    vector<Instruction> code;
+    vector<Value> constants;
+    vector<string> names;
+    vector<shared_ptr<BytecodeFunction>> functions;
+    vector<ObjectLiteral> literals;
+    vector<PropertyCache> caches; // One per property-access site
+    vector<SourcePosition> positions; // Sorted by pc; only where the position changes
+    int line = 0, col = 0;            // Where the function is declared
+    int registerCount = 0;
+    int slotCount = 0; // Environment slots (parameters first)
+    // Nothing captures the slots, so they are registers r0 .. slotCount - 1
+    // and calls allocate no Environment
+    bool localsInRegisters = false;
+    bool isAsync = false; // Returns a promise; may contain OP_AWAIT
+    size_t gcEpoch = 0; // Last collection that traced the constant pool
+    // Set on a stub with only the name, params and position filled in; the
+    // rest is compiled before the first call (compileLazily)
+    shared_ptr<LazyFunction> lazy;
+
+    // Baseline JIT tier (section 10)
+    unique_ptr<JitCode, JitCodeDeleter> jit;
+    uint32_t calls = 0, backEdges = 0, deopts = 0;
+    bool jitDisabled = false; // Deopted too often, or no JIT on this target
+
+    // Source position of the instruction at `pc`; line 0 if unknown
+    SourcePosition positionAt(size_t pc) const
+    {
+        auto after = upper_bound(positions.begin(), positions.end(), pc,
+                                 [](size_t at, const SourcePosition &p) { return at < p.pc; });
+        return after == positions.begin() ? SourcePosition{0, 0, 0} : *(after - 1);
+    }
+};
+
+// Queues a lazy function for a background compile, or returns null when
+// there are no compile threads; see section 15
+shared_ptr<CompileTask> compileInBackground(const SourceSpan &span);
+// Fills in a lazy stub, from a background compile if one finished
+void compileLazily(BytecodeFunction &fn);
+
+// An async function parked at an `await`: what its VM frame held, moved to
+// the heap so the event loop keeps running until the awaited value settles
+struct AsyncFrame : HeapCell
+{
+    shared_ptr<BytecodeFunction> fn;
+    size_t pc; // Just past the OP_AWAIT
+    Environment *env;
+    PromiseCell *promise; // Settled when the function finally returns
+    vector<Value> registers;
+    AsyncFrame(shared_ptr<BytecodeFunction> f, size_t p, Environment *e, PromiseCell *pr, const Value *regs)
+        : HeapCell(V_ASYNC), fn(move(f)), pc(p), env(e), promise(pr), registers(regs, regs + fn->registerCount)
+    {
+        gcNoteExternal(registers.capacity() * sizeof(Value));
+    }
+};
+
+// What JIT code reads and writes, at fixed offsets from one base register.
+// The VM fills it in on every entry, so pointers that move between entries
+// (register file, globals) are always current.
+struct JitState
+{
+    Value acc;
+    Value *regs;
+    Value *locals; // Current Environment's slots
+    Value *globals;
+    uint8_t *defined; // Per global slot: 1 once defined
+    Environment *env;
+    const atomic<bool> *safepointPending; // Read as a byte
+};
+
+static_assert(sizeof(atomic<bool>) == 1, "JIT code polls the safepoint flag as a byte");
+
+// An executable mapping; entry() runs from `pc` and returns the pc of the
+// first op left to the interpreter
+struct JitCode
+{
+    void *memory = nullptr;
+    size_t size = 0;
+    uint32_t (*entry)(JitState *state, uint32_t pc) = nullptr;
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAVE_JIT 1
+#endif
+
+bool jitEnabled = false; // --jit
+bool traceJit = false;   // --trace-jit
+
+constexpr uint32_t kJitCallThreshold = 100;  // Calls before a function is compiled
+constexpr uint32_t kJitLoopThreshold = 1000; // Loop back-edges before OSR
+constexpr uint32_t kJitDeoptLimit = 64;      // Failed guards before the code is dropped
+constexpr uint32_t kJitDeoptFlag = 0x80000000u; // Set in a returned pc when a guard failed
+
+void jitCompile(BytecodeFunction &fn);
+
+class BytecodeCompiler
+{
+    map<string, int> nameIndex;
+    int nextReg = 0;
+    int line = 0, col = 0; // Position of the node being compiled
+
+    struct Loop
+    {
+        int start;          // `continue` jumps back here
+        vector<int> breaks; // Patched to the loop's exit
+    };
+    vector<Loop> loops; // Innermost last
+
+public:
+    shared_ptr<BytecodeFunction> fn = make_shared<BytecodeFunction>();
+
+    int emit(OpCode op, int a = 0, int b = 0, int c = 0)
+    {
+        auto &positions = fn->positions;
+        if (line && (positions.empty() || positions.back().line != line || positions.back().col != col))
+        {
+            if (!positions.empty() && positions.back().pc == fn->code.size())
+                positions.pop_back(); // Nothing was emitted at the previous position
+            positions.push_back({(uint32_t)fn->code.size(), line, col});
+        }
+        fn->code.push_back({op, a, b, c});
+        return (int)fn->code.size() - 1;
+    }
+
+    int here() { return (int)fn->code.size(); }
+
+    // Point a previously emitted jump at the next instruction
+    void patchJump(int at) { fn->code[at].a = here(); }
+
+    int constant(Value v)
+    {
+        fn->constants.push_back(v);
+        return (int)fn->constants.size() - 1;
+    }
+
+    int name(const string &n)
+    {
+        auto it = nameIndex.find(n);
+        if (it != nameIndex.end())
+            return it->second;
+        fn->names.push_back(n);
+        return nameIndex[n] = (int)fn->names.size() - 1;
+    }
+
+    int cache()
+    {
+        fn->caches.emplace_back();
+        return (int)fn->caches.size() - 1;
+    }
+
+    // Temporaries are allocated stack-wise; the high-water mark sizes the frame
+    int allocRegs(int count = 1)
+    {
+        int first = nextReg;
+        nextReg += count;
+        if (nextReg > fn->registerCount)
+            fn->registerCount = nextReg;
+        return first;
+    }
+
+    void freeRegs(int count = 1) { nextReg -= count; }
+
+    void beginLoop(int start) { loops.push_back({start, {}}); }
+
+    // Sends every `break` in the loop to the next instruction
+    void endLoop()
+    {
+        for (int at : loops.back().breaks)
+            patchJump(at);
+        loops.pop_back();
+    }
+
+    void emitBreak() { loops.back().breaks.push_back(emit(OP_JUMP)); }
+    void emitContinue() { emit(OP_JUMP, loops.back().start); }
+
+    void emitLoad(const VarRef &ref)
+    {
+        if (ref.isGlobal())
+            emit(OP_LDA_GLOBAL, ref.slot);
+        else if (ref.depth == 0)
+            emit(fn->localsInRegisters ? OP_LDAR : OP_LDA_LOCAL, ref.slot);
+        else
+            emit(OP_LDA_CONTEXT, ref.depth, ref.slot);
+    }
+
+    void emitStore(const VarRef &ref, bool isDeclaration = false)
+    {
+        if (ref.isGlobal())
+            emit(isDeclaration ? OP_DEF_GLOBAL : OP_STA_GLOBAL, ref.slot);
+        else if (ref.depth == 0)
+            emit(fn->localsInRegisters ? OP_STAR : OP_STA_LOCAL, ref.slot);
+        else
+            emit(OP_STA_CONTEXT, ref.depth, ref.slot);
+    }
+
+    void compile(const shared_ptr<ASTNode> &node);
+
+    static shared_ptr<BytecodeFunction> compileScript(const vector<shared_ptr<ASTNode>> &stmts);
+    static shared_ptr<BytecodeFunction> compileFunction(const string &name, const vector<string> &params,
+                                                        const shared_ptr<ASTNode> &body, int slotCount,
+                                                        bool needsEnvironment, bool isAsync);
+};
+
+// ==========================================
+// 4. THE HEAP (ARENAS & GARBAGE COLLECTION)
+// ==========================================
+
+struct HeapStats
+{
+    size_t collections = 0;
+    size_t bytesAllocated = 0; // Since startup, including string storage
+    size_t cellsAllocated = 0; // Since startup
+    size_t liveBytes = 0;      // Surviving the last collection, with what cells and shapes hold outside the heap
+    size_t liveCells = 0;
+    size_t freedCells = 0; // Since startup
+    size_t cellsByType[V_FREE] = {}; // Allocations since startup; V_ENV counts Environments
+    size_t arenas = 0;
+    double lastPauseMs = 0;
+    double totalPauseMs = 0;
+};
+
+// Names for cellsByType; null for the types that are never cells
+const char *const kCellTypeNames[V_FREE] = {nullptr,    nullptr,  "string",  nullptr,     "list",      "object",
+                                            "function", "native", "promise", "environment", "asyncFrame"};
+
+void markRoots(Isolate &isolate); // Defined with the Isolate, which owns the root set
+
+// Size-segregated arenas with bump-pointer allocation and a non-moving
+// mark-sweep collector. Each size class fills fresh arenas by bumping a
+// cursor; sweeping threads dead slots onto that class's free list, which is
+// drained before bumping again. Cells larger than the biggest class are
+// allocated individually.
+//
+// Collection only happens at safepoints (loop back-edges and calls in both
+// the VM and the tree-walker, and between top-level statements and tasks),
+// never inside allocate(), so C++ code may hold Values in locals between
+// safepoints without rooting them. Code that holds one across a safepoint,
+// as the tree-walker's evals do, roots it in a HandleScope.
+class Heap
+{
+    static constexpr size_t kGranule = 16;
+    static constexpr size_t kClasses = 16; // 16 .. 256-byte cells
+    static constexpr size_t kArenaSize = 64 * 1024;
+    static constexpr size_t kMinThreshold = 1 << 20;
+
+    struct FreeSlot : HeapCell
+    {
+        FreeSlot *next;
+        FreeSlot(FreeSlot *n) : HeapCell(V_FREE), next(n) {}
+    };
+
+    struct Arena
+    {
+        char *begin, *cursor, *end;
+    };
+
+    struct SizeClass
+    {
+        size_t cellSize = 0;
+        vector<Arena> arenas;
+        FreeSlot *freeList = nullptr;
+    };
+
+    SizeClass classes[kClasses];
+    vector<pair<HeapCell *, size_t>> largeCells;
+    vector<HeapCell *> grey;
+    size_t bytesSinceGC = 0;
+    size_t threshold = kMinThreshold;
+    size_t limit = 0;
+    size_t epoch = 0;
+    size_t pinnedBytes = 0; // Reported by reportPinned; every sweep counts it as live
+
+    // Collect again once the heap doubles. Under a limit, collect halfway to
+    // it, which leaves the other half for what is allocated before the
+    // next safepoint gets to run the collection.
+    void resetThreshold()
+    {
+        threshold = max(kMinThreshold, stats.liveBytes * 2);
+        if (limit)
+            threshold = min(threshold, limit > stats.liveBytes ? (limit - stats.liveBytes) / 2 : 0);
+    }
+
+    void checkLimit(size_t used) const
+    {
+        if (limit && used > limit)
+            throw runtime_error("Heap limit of " + to_string(limit / (1024 * 1024)) + " MB exceeded");
+    }
+
+    void runInterrupts()
+    {
+        unsigned pending = interruptsPending.exchange(0);
+        for (int kind = 0; kind < kInterruptKinds; ++kind)
+            if ((pending & (1u << kind)) && interruptHandlers[kind])
+                interruptHandlers[kind]();
+    }
+
+    static void destroy(HeapCell *cell)
+    {
+        switch (cell->type)
+        {
+        case V_STR:
+            static_cast<StringCell *>(cell)->~StringCell();
+            break;
+        case V_LIST:
+            static_cast<ListCell *>(cell)->~ListCell();
+            break;
+        case V_OBJ:
+            static_cast<ObjectCell *>(cell)->~ObjectCell();
+            break;
+        case V_FUNC:
+            static_cast<FunctionCell *>(cell)->~FunctionCell();
+            break;
+        case V_NATIVE:
+            static_cast<NativeCell *>(cell)->~NativeCell();
+            break;
+        case V_PROMISE:
+            static_cast<PromiseCell *>(cell)->~PromiseCell();
+            break;
+        case V_ENV:
+            static_cast<Environment *>(cell)->~Environment();
+            break;
+        case V_ASYNC:
+            static_cast<AsyncFrame *>(cell)->~AsyncFrame();
+            break;
+        default:
+            break;
+        }
+    }
+
+    // What a live cell keeps outside itself, so liveBytes is the real footprint
+    static size_t externalSize(HeapCell *cell)
+    {
+        switch (cell->type)
+        {
+        case V_STR:
+            return static_cast<StringCell *>(cell)->value.capacity();
+        case V_LIST:
+        {
+            auto list = static_cast<ListCell *>(cell);
+            return list->capacity * ListCell::elementSize(list->kind);
+        }
+        case V_OBJ:
+        {
+            auto obj = static_cast<ObjectCell *>(cell);
+            return obj->slots.capacity() * sizeof(Value) + (obj->dictionary ? obj->dictionary->footprint() : 0);
+        }
+        case V_ENV:
+            return static_cast<Environment *>(cell)->slots.capacity() * sizeof(Value);
+        case V_PROMISE:
+            return static_cast<PromiseCell *>(cell)->reactions.capacity() * sizeof(Reaction);
+        case V_ASYNC:
+            return static_cast<AsyncFrame *>(cell)->registers.capacity() * sizeof(Value);
+        default:
+            return 0;
+        }
+    }
+
+    void traceChildren(HeapCell *cell)
+    {
+        switch (cell->type)
+        {
+        case V_LIST:
+        {
+            auto list = static_cast<ListCell *>(cell);
+            if (list->kind == PACKED_ELEMENTS)
+                for (uint32_t i = 0; i < list->length; ++i)
+                    mark(list->values()[i]);
+            break;
+        }
+        case V_OBJ:
+        {
+            auto obj = static_cast<ObjectCell *>(cell);
+            for (auto &v : obj->slots)
+                mark(v);
+            if (obj->dictionary)
+                for (auto key : obj->dictionary->keys)
+                    mark(key); // Not all interned
+            break;
+        }
+        case V_FUNC:
+        {
+            auto func = static_cast<FunctionCell *>(cell);
+            mark(func->closure);
+            mark(func->code.get());
+            break;
+        }
+        case V_STR:
+        {
+            auto str = static_cast<StringCell *>(cell);
+            mark(str->left);
+            mark(str->right);
+            break;
+        }
+        case V_NATIVE:
+            mark(static_cast<NativeCell *>(cell)->bound);
+            break;
+        case V_PROMISE:
+        {
+            auto promise = static_cast<PromiseCell *>(cell);
+            mark(promise->result);
+            for (auto &r : promise->reactions)
+                mark(r);
+            break;
+        }
+        case V_ENV:
+        {
+            auto env = static_cast<Environment *>(cell);
+            for (auto &v : env->slots)
+                mark(v);
+            mark(env->parent);
+            break;
+        }
+        case V_ASYNC:
+        {
+            auto frame = static_cast<AsyncFrame *>(cell);
+            mark(frame->fn.get());
+            mark(frame->env);
+            mark(frame->promise);
+            for (auto &v : frame->registers)
+                mark(v);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    void sweep()
+    {
+        stats.liveCells = stats.liveBytes = 0;
+        for (auto &sc : classes)
+        {
+            sc.freeList = nullptr;
+            for (auto &arena : sc.arenas)
+            {
+                for (char *p = arena.begin; p < arena.cursor; p += sc.cellSize)
+                {
+                    auto cell = (HeapCell *)p;
+                    if (cell->marked)
+                    {
+                        cell->marked = false;
+                        stats.liveCells++;
+                        stats.liveBytes += sc.cellSize + externalSize(cell);
+                        continue;
+                    }
+                    if (cell->type != V_FREE)
+                    {
+                        destroy(cell);
+                        stats.freedCells++;
+                    }
+                    sc.freeList = new (p) FreeSlot(sc.freeList);
+                }
+            }
+        }
+
+        size_t kept = 0;
+        for (auto &[cell, size] : largeCells)
+        {
+            if (cell->marked)
+            {
+                cell->marked = false;
+                stats.liveCells++;
+                stats.liveBytes += size + externalSize(cell);
+                largeCells[kept++] = {cell, size};
+                continue;
+            }
+            destroy(cell);
+            ::operator delete(cell);
+            stats.freedCells++;
+        }
+        largeCells.resize(kept);
+        stats.liveBytes += pinnedBytes;
+    }
+
+public:
+    HeapStats stats;
+    // Why code was interrupted; each reason has its own handler
+    enum Interrupt
+    {
+        INTERRUPT_PROFILE,   // Take a CPU profile sample
+        INTERRUPT_TERMINATE, // Stop the running script
+        kInterruptKinds
+    };
+
+    Isolate *owner = nullptr;
+    vector<Value> handles; // Roots held by open HandleScopes, innermost last
+    // The next safepoint stops, to collect or to run interrupt handlers.
+    // Polled by JIT loops; set from other threads by requestInterrupt().
+    atomic<bool> safepointPending{false};
+    bool collectionPending = false;
+    atomic<unsigned> interruptsPending{0}; // A bit per Interrupt
+    static inline bool traceGC = false; // --trace-gc
+
+    Heap()
+    {
+        for (size_t i = 0; i < kClasses; ++i)
+            classes[i].cellSize = (i + 1) * kGranule;
+    }
+
+    ~Heap()
+    {
+        for (auto &sc : classes)
+        {
+            for (auto &arena : sc.arenas)
+            {
+                for (char *p = arena.begin; p < arena.cursor; p += sc.cellSize)
+                    destroy((HeapCell *)p);
+                ::operator delete(arena.begin);
+            }
+        }
+        for (auto &[cell, size] : largeCells)
+        {
+            destroy(cell);
+            ::operator delete(cell);
+        }
+    }
+
+    void *allocate(size_t size)
+    {
+        size_t index = (size + kGranule - 1) / kGranule - 1;
+        reportExternal(index >= kClasses ? size : classes[index].cellSize); // May throw, so first
+        stats.cellsAllocated++;
+        if (index >= kClasses)
+        {
+            void *p = ::operator new(size);
+            largeCells.push_back({(HeapCell *)p, size});
+            return p;
+        }
+
+        SizeClass &sc = classes[index];
+        if (sc.freeList)
+        {
+            FreeSlot *slot = sc.freeList;
+            sc.freeList = slot->next;
+            return slot;
+        }
+        if (sc.arenas.empty() || sc.arenas.back().cursor == sc.arenas.back().end)
+        {
+            char *begin = (char *)::operator new(kArenaSize);
+            sc.arenas.push_back({begin, begin, begin + (kArenaSize / sc.cellSize) * sc.cellSize});
+            stats.arenas++;
+        }
+        Arena &arena = sc.arenas.back();
+        void *p = arena.cursor;
+        arena.cursor += sc.cellSize;
+        return p;
+    }
+
+    // Counts towards the next collection, and throws instead if it would
+    // take the heap past its limit. Everything allocated since the last
+    // collection counts, garbage or not, since none of it can be freed
+    // before the next safepoint.
+    void reportExternal(size_t bytes)
+    {
+        checkLimit(stats.liveBytes + bytesSinceGC + bytes);
+        noteExternal(bytes);
+    }
+
+    void reportPinned(size_t bytes)
+    {
+        reportExternal(bytes);
+        pinnedBytes += bytes;
+    }
+
+    void noteExternal(size_t bytes)
+    {
+        bytesSinceGC += bytes;
+        if (bytesSinceGC >= threshold)
+            requestCollection();
+        stats.bytesAllocated += bytes;
+    }
+
+    void requestCollection()
+    {
+        collectionPending = true;
+        safepointPending = true;
+    }
+
+    // Run at the next safepoint after requestInterrupt(kind), on the heap's
+    // thread. A handler may throw to abandon the script.
+    function<void()> interruptHandlers[kInterruptKinds];
+
+    // Safe from any thread, and from a signal handler: code only stops at
+    // safepoints, where the VM's frames are consistent
+    void requestInterrupt(Interrupt kind)
+    {
+        interruptsPending.fetch_or(1u << kind);
+        safepointPending = true;
+    }
+
+    // Drops a request no safepoint has taken yet
+    void cancelInterrupt(Interrupt kind) { interruptsPending.fetch_and(~(1u << kind)); }
+
+    // The heap may not outgrow `bytes` (0 for no limit), out-of-cell storage
+    // and shapes included: an allocation that would pass it throws, and so
+    // does a collection that leaves more than that live
+    void setLimit(size_t bytes)
+    {
+        limit = bytes;
+        resetThreshold();
+    }
+
+    void safepoint()
+    {
+        if (!safepointPending.load(memory_order_relaxed))
+            return;
+        safepointPending = false;
+        if (interruptsPending.load())
+            runInterrupts();
+        if (collectionPending)
+            collect();
+    }
+
+    void mark(const Value &v)
+    {
+        if (v.isCell())
+            mark(v.asCell());
+    }
+
+    void mark(HeapCell *cell)
+    {
+        if (cell && !cell->marked)
+        {
+            cell->marked = true;
+            grey.push_back(cell);
+        }
+    }
+
+    void mark(const Reaction &r)
+    {
+        mark(r.handler);
+        mark(r.derived);
+        mark(r.frame);
+    }
+
+    // Compiled code is not a cell, but its constant pool holds Values
+    void mark(BytecodeFunction *fn)
+    {
+        if (!fn || fn->gcEpoch == epoch)
+            return;
+        fn->gcEpoch = epoch;
+        for (auto &v : fn->constants)
+            mark(v);
+        for (auto &inner : fn->functions)
+            mark(inner.get());
+    }
+
+    void collect()
+    {
+        auto start = chrono::steady_clock::now();
+        size_t before = stats.liveBytes + bytesSinceGC;
+        epoch++;
+
+        markRoots(*owner);
+        while (!grey.empty())
+        {
+            HeapCell *cell = grey.back();
+            grey.pop_back();
+            traceChildren(cell);
+        }
+        size_t freedBefore = stats.freedCells;
+        sweep();
+
+        bytesSinceGC = 0;
+        collectionPending = false;
+        resetThreshold();
+        stats.collections++;
+        stats.lastPauseMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        stats.totalPauseMs += stats.lastPauseMs;
+        if (traceGC)
+            cout << "[gc] #" << stats.collections << " " << before / 1024 << " KB -> " << stats.liveBytes / 1024
+                 << " KB, " << stats.freedCells - freedBefore << " cells freed, " << stats.lastPauseMs << " ms" << endl;
+        checkLimit(stats.liveBytes);
+    }
+};
+
+void *gcAllocate(size_t size) { return currentHeap().allocate(size); }
+void gcReportExternal(size_t bytes) { currentHeap().reportExternal(bytes); }
+void gcNoteExternal(size_t bytes) { currentHeap().noteExternal(bytes); }
+void gcReportPinned(size_t bytes) { currentHeap().reportPinned(bytes); }
+void gcCountAllocation(ValueType type) { currentHeap().stats.cellsByType[type]++; }
+
+// Keeps Values that C++ code holds across a safepoint alive until the scope
+// closes. Scopes nest, and each closes by dropping what it kept.
+class HandleScope
+{
+    vector<Value> &handles;
+    size_t base;
+
+public:
+    HandleScope() : handles(currentHeap().handles), base(handles.size()) {}
+    ~HandleScope() { handles.resize(base); }
+    HandleScope(const HandleScope &) = delete;
+    HandleScope &operator=(const HandleScope &) = delete;
+
+    Value keep(Value v)
+    {
+        handles.push_back(v);
+        return v;
+    }
+    template <class T>
+    T *keep(T *cell)
+    {
+        handles.push_back(Value(cell));
+        return cell;
+    }
+};
+
+// ==========================================
+// 5. ABSTRACT SYNTAX TREE (AST) NODES
+// ==========================================
+
+struct ASTNode
+{
+    int line = 0, col = 0; // Where the node's source starts; 0 if synthesized
+    virtual ~ASTNode() = default;
+    virtual Value eval(Environment *env) = 0;
+    // Emit code that leaves this node's value in the accumulator
+    virtual void compile(BytecodeCompiler &c) = 0;
+    // Scope resolution: declare hoisted names, then bind every reference
+    virtual void hoist(Resolver &r) {}
+    virtual void resolve(Resolver &r) = 0;
+    // Fold children in place, then return a simpler replacement for this
+    // node, or nullptr to keep it
+    virtual shared_ptr<ASTNode> fold(Folder &f) { return nullptr; }
+    // Literals report their value so the folder can evaluate around them
+    virtual bool constantValue(Value &out) const { return false; }
+    // return, break and continue: later statements in the block never run
+    virtual bool transfersControl() const { return false; }
+    // This node's value becomes the function's result; calls here are tail calls
+    virtual void markTailPosition() {}
+    // S-expression form for --print-ast
+    virtual void print(ostream &out) const = 0;
+};
+
+// Non-local exits in the tree-walker. The statement that exits records it
+// here and returns normally; blocks stop at a pending completion, loops
+// consume break and continue, and function calls consume the rest. A tail
+// call leaves its callee and arguments for the caller's loop to run, so
+// the native stack doesn't grow.
+enum CompletionType
+{
+    C_NORMAL,
+    C_RETURN,
+    C_BREAK,
+    C_CONTINUE,
+    C_TAIL_CALL
+};
+
+struct Completion
+{
+    CompletionType type = C_NORMAL;
+    FunctionCell *callee = nullptr; // C_TAIL_CALL only
+    vector<Value> args;
+};
+
+thread_local Completion completion;
+
+// Runs a tree-walker function in `scope`, looping on tail calls
+Value invokeAstFunction(FunctionCell *func, Environment *scope);
+Value invokeAstFunction(FunctionCell *func, const vector<Value> &args);
+
+inline ostream &printNode(ostream &out, const shared_ptr<ASTNode> &node)
+{
+    if (node)
+        node->print(out);
+    else
+        out << "null";
+    return out;
+}
+
+inline void printNodes(ostream &out, const vector<shared_ptr<ASTNode>> &nodes)
+{
+    for (auto &node : nodes)
+        printNode(out << " ", node);
+}
+
+// --- Literals ---
+struct NumberNode : ASTNode
+{
+    double val;
+    NumberNode(double v) : val(v) {}
+    Value eval(Environment *env) override
+    {
+        return Value::number(val);
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        c.emit(OP_LDA_CONST, c.constant(Value::number(val)));
+    }
+    void resolve(Resolver &r) override {}
+    bool constantValue(Value &out) const override
+    {
+        out = Value::number(val);
+        return true;
+    }
+    void print(ostream &out) const override { out << val; }
+};
+
+struct StringNode : ASTNode
+{
+    StringCell *val; // Interned
+    StringNode(string_view v) : val(internString(v)) {}
+    Value eval(Environment *env) override
+    {
+        return Value(val);
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        c.emit(OP_LDA_CONST, c.constant(Value(val)));
+    }
+    void resolve(Resolver &r) override {}
+    bool constantValue(Value &out) const override
+    {
+        out = Value(val);
+        return true;
+    }
+    void print(ostream &out) const override { out << '"' << val->value << '"'; }
+};
+
+// Booleans and null; only the folder creates these
+struct ConstantNode : ASTNode
+{
+    Value val;
+    ConstantNode(Value v) : val(v) {}
+    Value eval(Environment *env) override
+    {
+        return val;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        if (val.isNull())
+            c.emit(OP_LDA_NULL);
+        else
+            c.emit(OP_LDA_CONST, c.constant(val));
+    }
+    void resolve(Resolver &r) override {}
+    bool constantValue(Value &out) const override
+    {
+        out = val;
+        return true;
+    }
+    void print(ostream &out) const override { out << val.toString(); }
+};
+
+struct IdentifierNode : ASTNode
+{
+    string name;
+    VarRef ref;
+    IdentifierNode(string n) : name(n) {}
+    Value eval(Environment *env) override
+    {
+        return loadVar(ref, env);
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        c.emitLoad(ref);
+    }
+    void resolve(Resolver &r) override
+    {
+        ref = r.lookup(name);
+    }
+    void print(ostream &out) const override { out << name; }
+};
+
+// --- Structures ---
+struct ArrayNode : ASTNode
+{
+    vector<shared_ptr<ASTNode>> elements;
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        auto arr = handles.keep(gcNew<ListCell>());
+        for (auto &el : elements)
+            arr->push(el->eval(env));
+        return Value(arr);
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        int count = (int)elements.size();
+        int base = c.allocRegs(count);
+        for (int i = 0; i < count; ++i)
+        {
+            c.compile(elements[i]);
+            c.emit(OP_STAR, base + i);
+        }
+        c.emit(OP_MAKE_ARRAY, base, count);
+        c.freeRegs(count);
+    }
+    void resolve(Resolver &r) override
+    {
+        for (auto &el : elements)
+            r.resolve(el);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        for (auto &el : elements)
+            f.fold(el);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        out << "(array";
+        printNodes(out, elements);
+        out << ")";
+    }
+};
+
+struct ObjectNode : ASTNode
+{
+    vector<pair<string, shared_ptr<ASTNode>>> props;
+    ObjectLiteral layout;
+
+    ObjectNode(vector<pair<string, shared_ptr<ASTNode>>> p) : props(p)
+    {
+        vector<string> keys;
+        for (auto const &prop : props)
+            keys.push_back(prop.first);
+        layout = ObjectLiteral(keys);
+    }
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        vector<Value> values;
+        for (auto const &[key, valNode] : props)
+            values.push_back(handles.keep(valNode->eval(env)));
+        return layout.instantiate(values.data());
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        int count = (int)props.size();
+        int base = c.allocRegs(count);
+        for (int i = 0; i < count; ++i)
+        {
+            c.compile(props[i].second);
+            c.emit(OP_STAR, base + i);
+        }
+        c.fn->literals.push_back(layout);
+        c.emit(OP_MAKE_OBJECT, base, count, (int)c.fn->literals.size() - 1);
+        c.freeRegs(count);
+    }
+    void resolve(Resolver &r) override
+    {
+        for (auto const &[key, valNode] : props)
+            r.resolve(valNode);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        for (auto &[key, valNode] : props)
+            f.fold(valNode);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        out << "(object";
+        for (auto const &[key, valNode] : props)
+            printNode(out << " (" << key << " ", valNode) << ")";
+        out << ")";
+    }
+};
+
+// obj.name
+struct MemberNode : ASTNode
+{
+    shared_ptr<ASTNode> object;
+    string name;
+    StringCell *key; // Interned `name`
+    PropertyCache cache;
+    MemberNode(shared_ptr<ASTNode> o, string n) : object(o), name(n), key(internString(name)) {}
+
+    Value eval(Environment *env) override
+    {
+        return getProperty(object->eval(env), key, cache);
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(object);
+        c.emit(OP_GET_PROP, c.constant(Value(key)), c.cache());
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(object);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(object);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "(. ", object) << " " << name << ")";
+    }
+};
+
+// obj.name = value
+struct MemberAssignNode : ASTNode
+{
+    shared_ptr<ASTNode> object;
+    string name;
+    StringCell *key; // Interned `name`
+    shared_ptr<ASTNode> value;
+    PropertyCache cache;
+    MemberAssignNode(shared_ptr<ASTNode> o, string n, shared_ptr<ASTNode> v)
+        : object(o), name(n), key(internString(name)), value(v) {}
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        Value obj = handles.keep(object->eval(env));
+        Value val = value->eval(env);
+        setProperty(obj, key, val, cache);
+        return val;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        int obj = c.allocRegs();
+        c.compile(object);
+        c.emit(OP_STAR, obj);
+        c.compile(value);
+        c.emit(OP_SET_PROP, obj, c.constant(Value(key)), c.cache());
+        c.freeRegs();
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(object);
+        r.resolve(value);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(object);
+        f.fold(value);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "(.= ", object) << " " << name << " ";
+        printNode(out, value) << ")";
+    }
+};
+
+// obj[index]
+struct IndexNode : ASTNode
+{
+    shared_ptr<ASTNode> object, index;
+    IndexNode(shared_ptr<ASTNode> o, shared_ptr<ASTNode> i) : object(o), index(i) {}
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        Value obj = handles.keep(object->eval(env));
+        return getIndex(obj, index->eval(env));
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        int obj = c.allocRegs();
+        c.compile(object);
+        c.emit(OP_STAR, obj);
+        c.compile(index);
+        c.emit(OP_GET_INDEX, obj);
+        c.freeRegs();
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(object);
+        r.resolve(index);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(object);
+        f.fold(index);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "([] ", object) << " ";
+        printNode(out, index) << ")";
+    }
+};
+
+// obj[index] = value
+struct IndexAssignNode : ASTNode
+{
+    shared_ptr<ASTNode> object, index, value;
+    IndexAssignNode(shared_ptr<ASTNode> o, shared_ptr<ASTNode> i, shared_ptr<ASTNode> v) : object(o), index(i), value(v) {}
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        Value obj = handles.keep(object->eval(env));
+        Value idx = handles.keep(index->eval(env));
+        Value val = value->eval(env);
+        setIndex(obj, idx, val);
+        return val;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        int regs = c.allocRegs(2);
+        c.compile(object);
+        c.emit(OP_STAR, regs);
+        c.compile(index);
+        c.emit(OP_STAR, regs + 1);
+        c.compile(value);
+        c.emit(OP_SET_INDEX, regs, regs + 1);
+        c.freeRegs(2);
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(object);
+        r.resolve(index);
+        r.resolve(value);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(object);
+        f.fold(index);
+        f.fold(value);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "([]= ", object) << " ";
+        printNode(out, index) << " ";
+        printNode(out, value) << ")";
+    }
+};
+
+Value callFunction(const Value &callable, const vector<Value> &args); // Section 9
+
+// receiver.name(args)
+struct MethodCallNode : ASTNode
+{
+    shared_ptr<ASTNode> receiver;
+    StringCell *key; // Interned method name
+    vector<shared_ptr<ASTNode>> args;
+    MethodCallNode(shared_ptr<ASTNode> r, const string &name, vector<shared_ptr<ASTNode>> a)
+        : receiver(r), key(internString(name)), args(a) {}
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        Value self = handles.keep(receiver->eval(env));
+        vector<Value> argVals;
+        for (auto &a : args)
+            argVals.push_back(handles.keep(a->eval(env)));
+        Value result;
+        if (callBuiltinMethod(self, key, argVals.data(), (int)argVals.size(), result))
+        {
+            currentStats().nativeCalls++;
+            return result;
+        }
+        return callFunction(methodTarget(self, key), argVals);
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        int count = (int)args.size();
+        int base = c.allocRegs(count + 1);
+        c.compile(receiver);
+        c.emit(OP_STAR, base);
+        for (int i = 0; i < count; ++i)
+        {
+            c.compile(args[i]);
+            c.emit(OP_STAR, base + 1 + i);
+        }
+        c.emit(OP_CALL_METHOD, base, count, c.constant(Value(key)));
+        c.freeRegs(count + 1);
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(receiver);
+        for (auto &a : args)
+            r.resolve(a);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(receiver);
+        for (auto &a : args)
+            f.fold(a);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "(call-method ", receiver) << " " << key->value;
+        printNodes(out, args);
+        out << ")";
+    }
+};
+
+// --- Operations ---
+
+// Shared parts of every binary operator; eval() lives in BinaryOpNode<Op>
+// so each node dispatches straight to its operator
+struct BinaryNode : ASTNode
+{
+    BinaryOperator op;
+    shared_ptr<ASTNode> left, right;
+    BinaryNode(BinaryOperator o, shared_ptr<ASTNode> l, shared_ptr<ASTNode> r) : op(o), left(l), right(r) {}
+
+    void compile(BytecodeCompiler &c) override
+    {
+        static const OpCode opcodes[] = {OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD, OP_GT,
+                                         OP_LT, OP_GE, OP_LE, OP_EQ, OP_NE};
+        int lhs = c.allocRegs();
+        c.compile(left);
+        c.emit(OP_STAR, lhs);
+        c.compile(right);
+        c.emit(opcodes[op], lhs);
+        c.freeRegs();
+    }
+
+    void resolve(Resolver &r) override
+    {
+        r.resolve(left);
+        r.resolve(right);
+    }
+
+    // Literal operands need no environment, so eval() gives exactly the
+    // runtime result
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(left);
+        f.fold(right);
+        Value l, r;
+        if (!left->constantValue(l) || !right->constantValue(r))
+            return nullptr;
+        return Folder::constant(eval(nullptr));
+    }
+
+    void print(ostream &out) const override
+    {
+        printNode(out << "(" << binaryOperatorSymbols[op] << " ", left) << " ";
+        printNode(out, right) << ")";
+    }
+};
+
+template <BinaryOperator Op>
+struct BinaryOpNode final : BinaryNode
+{
+    BinaryOpNode(shared_ptr<ASTNode> l, shared_ptr<ASTNode> r) : BinaryNode(Op, l, r) {}
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        Value l = handles.keep(left->eval(env));
+        return applyBinary<Op>(l, right->eval(env));
+    }
+};
+
+shared_ptr<ASTNode> makeBinary(BinaryOperator op, shared_ptr<ASTNode> l, shared_ptr<ASTNode> r)
+{
+    switch (op)
+    {
+    case BIN_ADD: return make_shared<BinaryOpNode<BIN_ADD>>(l, r);
+    case BIN_SUB: return make_shared<BinaryOpNode<BIN_SUB>>(l, r);
+    case BIN_MUL: return make_shared<BinaryOpNode<BIN_MUL>>(l, r);
+    case BIN_DIV: return make_shared<BinaryOpNode<BIN_DIV>>(l, r);
+    case BIN_MOD: return make_shared<BinaryOpNode<BIN_MOD>>(l, r);
+    case BIN_GT: return make_shared<BinaryOpNode<BIN_GT>>(l, r);
+    case BIN_LT: return make_shared<BinaryOpNode<BIN_LT>>(l, r);
+    case BIN_GE: return make_shared<BinaryOpNode<BIN_GE>>(l, r);
+    case BIN_LE: return make_shared<BinaryOpNode<BIN_LE>>(l, r);
+    case BIN_EQ: return make_shared<BinaryOpNode<BIN_EQ>>(l, r);
+    case BIN_NE: return make_shared<BinaryOpNode<BIN_NE>>(l, r);
+    }
+    return nullptr;
+}
+
+// a && b, a || b: the right side only runs when the left doesn't decide,
+// and the result is whichever operand was evaluated last
+struct LogicalNode : ASTNode
+{
+    bool isAnd;
+    shared_ptr<ASTNode> left, right;
+    LogicalNode(bool a, shared_ptr<ASTNode> l, shared_ptr<ASTNode> r) : isAnd(a), left(l), right(r) {}
+
+    Value eval(Environment *env) override
+    {
+        Value l = left->eval(env);
+        if (l.truthy() != isAnd)
+            return l;
+        return right->eval(env);
+    }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(left);
+        int skip = c.emit(isAnd ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE);
+        c.compile(right);
+        c.patchJump(skip);
+    }
+
+    void resolve(Resolver &r) override
+    {
+        r.resolve(left);
+        r.resolve(right);
+    }
+
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(left);
+        f.fold(right);
+        Value l;
+        if (!left->constantValue(l))
+            return nullptr;
+        return l.truthy() != isAnd ? left : right;
+    }
+
+    void print(ostream &out) const override
+    {
+        printNode(out << (isAnd ? "(&& " : "(|| "), left) << " ";
+        printNode(out, right) << ")";
+    }
+};
+
+// -x and !x
+struct UnaryNode : ASTNode
+{
+    bool isNot;
+    shared_ptr<ASTNode> operand;
+    UnaryNode(bool n, shared_ptr<ASTNode> o) : isNot(n), operand(o) {}
+
+    Value eval(Environment *env) override
+    {
+        Value v = operand->eval(env);
+        return isNot ? Value::boolean(!v.truthy()) : Value::number(-v.num());
+    }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(operand);
+        c.emit(isNot ? OP_NOT : OP_NEGATE);
+    }
+
+    void resolve(Resolver &r) override
+    {
+        r.resolve(operand);
+    }
+
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(operand);
+        Value v;
+        if (!operand->constantValue(v))
+            return nullptr;
+        return Folder::constant(eval(nullptr));
+    }
+
+    void print(ostream &out) const override
+    {
+        printNode(out << (isNot ? "(! " : "(- "), operand) << ")";
+    }
+};
+
+// await expr: only parsed inside async functions, which the tree-walker
+// refuses to call, since it has no frame to suspend
+struct AwaitNode : ASTNode
+{
+    shared_ptr<ASTNode> operand;
+    AwaitNode(shared_ptr<ASTNode> o) : operand(o) {}
+
+    Value eval(Environment *env) override
+    {
+        throw runtime_error("async functions need the bytecode VM");
+    }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(operand);
+        c.emit(OP_AWAIT);
+    }
+
+    void resolve(Resolver &r) override
+    {
+        r.resolve(operand);
+    }
+
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(operand);
+        return nullptr;
+    }
+
+    void print(ostream &out) const override
+    {
+        printNode(out << "(await ", operand) << ")";
+    }
+};
+
+// --- Statements ---
+struct BlockNode : ASTNode
+{
+    vector<shared_ptr<ASTNode>> statements;
+    Value eval(Environment *env) override
+    {
+        Value lastVal;
+        for (auto &stmt : statements)
+        {
+            lastVal = stmt->eval(env);
+            if (completion.type != C_NORMAL)
+                break;
+        }
+        return lastVal;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        if (statements.empty())
+            c.emit(OP_LDA_NULL);
+        for (auto &stmt : statements)
+            c.compile(stmt);
+    }
+    void hoist(Resolver &r) override
+    {
+        for (auto &stmt : statements)
+        {
+            if (stmt)
+                stmt->hoist(r);
+        }
+    }
+    void resolve(Resolver &r) override
+    {
+        for (auto &stmt : statements)
+            r.resolve(stmt);
+    }
+    void markTailPosition() override
+    {
+        if (!statements.empty() && statements.back())
+            statements.back()->markTailPosition();
+    }
+    // Blocks don't open a scope, so one statement can stand alone
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.foldStatements(statements);
+        if (statements.empty())
+            return make_shared<ConstantNode>(Value());
+        if (statements.size() == 1 && statements[0])
+            return statements[0];
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        out << "(block";
+        printNodes(out, statements);
+        out << ")";
+    }
+};
+
+struct VarDeclNode : ASTNode
+{
+    string name;
+    shared_ptr<ASTNode> init;
+    VarRef ref;
+    VarDeclNode(string n, shared_ptr<ASTNode> i) : name(n), init(i) {}
+    Value eval(Environment *env) override
+    {
+        Value val = init ? init->eval(env) : Value();
+        storeVar(ref, env, val, true);
+        return val;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        if (init)
+            c.compile(init);
+        else
+            c.emit(OP_LDA_NULL);
+        c.emitStore(ref, true);
+    }
+    void hoist(Resolver &r) override
+    {
+        r.declare(name);
+    }
+    void resolve(Resolver &r) override
+    {
+        if (init)
+            r.resolve(init);
+        ref = r.declare(name);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        if (init)
+            f.fold(init);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        out << "(var " << name;
+        if (init)
+            printNode(out << " ", init);
+        out << ")";
+    }
+};
+
+struct AssignNode : ASTNode
+{
+    string name;
+    shared_ptr<ASTNode> value;
+    VarRef ref;
+    AssignNode(string n, shared_ptr<ASTNode> v) : name(n), value(v) {}
+    Value eval(Environment *env) override
+    {
+        Value val = value->eval(env);
+        storeVar(ref, env, val);
+        return val;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(value);
+        c.emitStore(ref);
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(value);
+        ref = r.lookup(name);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(value);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "(= " << name << " ", value) << ")";
+    }
+};
+
+struct IfNode : ASTNode
+{
+    shared_ptr<ASTNode> cond, thenBranch, elseBranch;
+    IfNode(shared_ptr<ASTNode> c, shared_ptr<ASTNode> t, shared_ptr<ASTNode> e)
+        : cond(c), thenBranch(t), elseBranch(e) {}
+
+    Value eval(Environment *env) override
+    {
+        if (cond->eval(env).truthy())
+            return thenBranch->eval(env);
+        else if (elseBranch)
+            return elseBranch->eval(env);
+        return Value();
+    }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(cond);
+        int toElse = c.emit(OP_JUMP_IF_FALSE);
+        c.compile(thenBranch);
+        int toEnd = c.emit(OP_JUMP);
+        c.patchJump(toElse);
+        if (elseBranch)
+            c.compile(elseBranch);
+        else
+            c.emit(OP_LDA_NULL);
+        c.patchJump(toEnd);
+    }
+
+    void hoist(Resolver &r) override
+    {
+        thenBranch->hoist(r);
+        if (elseBranch)
+            elseBranch->hoist(r);
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(cond);
+        r.resolve(thenBranch);
+        r.resolve(elseBranch);
+    }
+
+    void markTailPosition() override
+    {
+        thenBranch->markTailPosition();
+        if (elseBranch)
+            elseBranch->markTailPosition();
+    }
+
+    // A constant condition keeps one branch, unless the other one hoists
+    // declarations that the rest of the function relies on
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(cond);
+        f.fold(thenBranch);
+        if (elseBranch)
+            f.fold(elseBranch);
+        Value c;
+        if (!cond->constantValue(c))
+            return nullptr;
+        auto &taken = c.truthy() ? thenBranch : elseBranch;
+        auto &dropped = c.truthy() ? elseBranch : thenBranch;
+        if (Folder::declaresNames(dropped))
+            return nullptr;
+        return taken ? taken : make_shared<ConstantNode>(Value());
+    }
+
+    void print(ostream &out) const override
+    {
+        printNode(out << "(if ", cond) << " ";
+        printNode(out, thenBranch);
+        if (elseBranch)
+            printNode(out << " ", elseBranch);
+        out << ")";
+    }
+};
+
+struct WhileNode : ASTNode
+{
+    shared_ptr<ASTNode> cond, body;
+    WhileNode(shared_ptr<ASTNode> c, shared_ptr<ASTNode> b) : cond(c), body(b) {}
+    Value eval(Environment *env) override
+    {
+        while (cond->eval(env).truthy())
+        {
+            currentHeap().safepoint(); // Back-edge, while no break or return is in flight
+            Value val = body->eval(env);
+            if (completion.type == C_BREAK || completion.type == C_CONTINUE)
+            {
+                bool isBreak = completion.type == C_BREAK;
+                completion.type = C_NORMAL;
+                if (isBreak)
+                    break;
+            }
+            else if (completion.type != C_NORMAL)
+                return val; // return or tail call: keep unwinding
+        }
+        return Value();
+    }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        int loop = c.here();
+        c.beginLoop(loop);
+        c.compile(cond);
+        int exit = c.emit(OP_JUMP_IF_FALSE);
+        c.compile(body);
+        c.emit(OP_JUMP, loop);
+        c.patchJump(exit);
+        c.endLoop();
+        c.emit(OP_LDA_NULL);
+    }
+
+    void hoist(Resolver &r) override
+    {
+        body->hoist(r);
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(cond);
+        r.resolve(body);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(cond);
+        f.fold(body);
+        Value c;
+        if (cond->constantValue(c) && !c.truthy() && !Folder::declaresNames(body))
+            return make_shared<ConstantNode>(Value());
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        printNode(out << "(while ", cond) << " ";
+        printNode(out, body) << ")";
+    }
+};
+
+struct FunctionDeclNode : ASTNode
+{
+    string name;
+    vector<string> params;
+    shared_ptr<ASTNode> body; // Null if the parser dropped it (lazy)
+    SourceSpan skipped;       // The whole declaration, when body is null
+    VarRef ref;
+    int slotCount = 0;
+    bool needsEnvironment = true; // Decided by the Resolver
+    bool isAsync;
+    FunctionDeclNode(string n, vector<string> p, shared_ptr<ASTNode> b, bool async = false)
+        : name(n), params(p), body(b), isAsync(async)
+    {
+        if (body)
+            body->markTailPosition();
+    }
+
+    Value eval(Environment *env) override
+    {
+        auto func = gcNew<FunctionCell>();
+        Value result(func);
+        func->params = params;
+        func->body = body;
+        func->closure = env; // Capture scope!
+        func->slotCount = slotCount;
+        func->isAsync = isAsync;
+        storeVar(ref, env, result, true);
+        return result;
+    }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        shared_ptr<BytecodeFunction> fn;
+        if (body)
+            fn = BytecodeCompiler::compileFunction(name, params, body, slotCount, needsEnvironment, isAsync);
+        else
+        {
+            fn = make_shared<BytecodeFunction>();
+            fn->name = name;
+            fn->params = params;
+            fn->isAsync = isAsync;
+            fn->lazy = make_shared<LazyFunction>(LazyFunction{skipped, compileInBackground(skipped)});
+        }
+        fn->line = line;
+        fn->col = col;
+        c.fn->functions.push_back(fn);
+        c.emit(OP_MAKE_CLOSURE, (int)c.fn->functions.size() - 1);
+        c.emitStore(ref, true);
+    }
+
+    void hoist(Resolver &r) override
+    {
+        r.declare(name);
+    }
+    void resolve(Resolver &r) override
+    {
+        ref = r.declare(name);
+        if (body)
+            r.resolveFunction(params, body, slotCount, needsEnvironment);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(body);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        out << (isAsync ? "(async-function " : "(function ") << name << " (";
+        for (size_t i = 0; i < params.size(); ++i)
+            out << (i ? " " : "") << params[i];
+        if (body)
+            printNode(out << ") ", body) << ")";
+        else
+            out << ") (lazy))";
+    }
+};
+
+struct CallNode : ASTNode
+{
+    string callee;
+    vector<shared_ptr<ASTNode>> args;
+    VarRef ref;
+    bool isTail = false;
+    CallNode(string c, vector<shared_ptr<ASTNode>> a) : callee(c), args(a) {}
+
+    Value eval(Environment *env) override
+    {
+        HandleScope handles;
+        Value callable = handles.keep(loadVar(ref, env));
+        RuntimeStats &stats = currentStats();
+        if (callable.is(V_FUNC) && !isTail)
+        {
+            // Arguments go straight into the callee's slots
+            stats.userCalls++;
+            FunctionCell *func = callable.asFunction();
+            auto scope = handles.keep(gcNew<Environment>(func->closure, func->slotCount));
+            for (size_t i = 0; i < args.size(); ++i)
+            {
+                Value val = args[i]->eval(env);
+                if (i < func->params.size())
+                    scope->slots[i] = val;
+            }
+            return invokeAstFunction(func, scope);
+        }
+
+        vector<Value> argVals;
+        for (auto &a : args)
+            argVals.push_back(handles.keep(a->eval(env)));
+
+        if (callable.is(V_NATIVE))
+        {
+            stats.nativeCalls++;
+            return callable.asNative()->nativeFn(argVals);
+        }
+
+        if (callable.is(V_FUNC))
+        {
+            stats.userCalls++;
+            completion.type = C_TAIL_CALL;
+            completion.callee = callable.asFunction();
+            completion.args = move(argVals);
+            return Value();
+        }
+        throw runtime_error("Not a function: " + callee);
+    }
+
+    void markTailPosition() override { isTail = true; }
+
+    void compile(BytecodeCompiler &c) override
+    {
+        int count = (int)args.size();
+        int base = c.allocRegs(count + 1);
+        c.emitLoad(ref);
+        c.emit(OP_STAR, base);
+        for (int i = 0; i < count; ++i)
+        {
+            c.compile(args[i]);
+            c.emit(OP_STAR, base + 1 + i);
+        }
+        // An async frame has to stay around to settle its promise
+        c.emit(isTail && !c.fn->isAsync ? OP_TAIL_CALL : OP_CALL, base, count, c.name(callee));
+        c.freeRegs(count + 1);
+    }
+
+    void resolve(Resolver &r) override
+    {
+        ref = r.lookup(callee);
+        for (auto &a : args)
+            r.resolve(a);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        for (auto &a : args)
+            f.fold(a);
+        return nullptr;
+    }
+    void print(ostream &out) const override
+    {
+        out << (isTail ? "(tail-call " : "(call ") << callee;
+        printNodes(out, args);
+        out << ")";
+    }
+};
+
+struct ReturnNode : ASTNode
+{
+    shared_ptr<ASTNode> value; // nullptr for a bare `return`
+    ReturnNode(shared_ptr<ASTNode> v) : value(v)
+    {
+        if (value)
+            value->markTailPosition();
+    }
+
+    Value eval(Environment *env) override
+    {
+        Value val = value ? value->eval(env) : Value();
+        if (completion.type == C_NORMAL) // Unless the value was a tail call
+            completion.type = C_RETURN;
+        return val;
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        c.compile(value);
+        c.emit(OP_RETURN);
+    }
+    void resolve(Resolver &r) override
+    {
+        r.resolve(value);
+    }
+    shared_ptr<ASTNode> fold(Folder &f) override
+    {
+        f.fold(value);
+        return nullptr;
+    }
+    bool transfersControl() const override { return true; }
+    void print(ostream &out) const override
+    {
+        out << "(return";
+        if (value)
+            printNode(out << " ", value);
+        out << ")";
+    }
+};
+
+// break and continue
+struct LoopExitNode : ASTNode
+{
+    bool isBreak;
+    LoopExitNode(bool b) : isBreak(b) {}
+
+    Value eval(Environment *env) override
+    {
+        completion.type = isBreak ? C_BREAK : C_CONTINUE;
+        return Value();
+    }
+    void compile(BytecodeCompiler &c) override
+    {
+        if (isBreak)
+            c.emitBreak();
+        else
+            c.emitContinue();
+    }
+    void resolve(Resolver &r) override {}
+    bool transfersControl() const override { return true; }
+    void print(ostream &out) const override { out << (isBreak ? "(break)" : "(continue)"); }
+};
+
+// The tree-walker recurses on the C++ stack, so deep script recursion has
+// to throw before the thread's stack runs out
+#if defined(_WIN32)
+constexpr size_t kAstStackLimit = 512 * 1024; // Of the default 1 MB
+#else
+constexpr size_t kAstStackLimit = 4 * 1024 * 1024; // Of the usual 8 MB
+#endif
+thread_local char *astStackBase = nullptr; // Where the outermost call started
+
+Value invokeAstFunction(FunctionCell *func, Environment *scope)
+{
+    char here;
+    struct Outermost
+    {
+        bool active;
+        ~Outermost()
+        {
+            if (active)
+                astStackBase = nullptr;
+        }
+    } outermost{!astStackBase};
+    if (outermost.active)
+        astStackBase = &here;
+    else if ((size_t)(astStackBase - &here) > kAstStackLimit)
+        throw runtime_error("Maximum call stack size exceeded");
+
+    while (true)
+    {
+        if (func->isAsync)
+            throw runtime_error("async functions need the bytecode VM");
+        HandleScope handles;
+        handles.keep(func);
+        handles.keep(scope);
+        currentHeap().safepoint(); // Function entry
+        Value result = func->body->eval(scope);
+
+        CompletionType type = completion.type;
+        completion.type = C_NORMAL;
+        if (type != C_TAIL_CALL)
+            return result;
+        func = completion.callee;
+        scope = gcNew<Environment>(func->closure, func->slotCount);
+        for (size_t i = 0; i < func->params.size() && i < completion.args.size(); ++i)
+            scope->slots[i] = completion.args[i];
+        completion.args.clear();
+    }
+}
+
+// `args` are the caller's to root; callFunction does
+Value invokeAstFunction(FunctionCell *func, const vector<Value> &args)
+{
+    auto scope = gcNew<Environment>(func->closure, func->slotCount);
+    for (size_t i = 0; i < func->params.size() && i < args.size(); ++i)
+        scope->slots[i] = args[i];
+    return invokeAstFunction(func, scope);
+}
+
+// ==========================================
+// 6. PARSER (TURNS TOKENS -> AST)
+// ==========================================
+
+enum TokenType
+{
+    T_IDENT,
+    T_NUMBER,
+    T_STRING,
+    // Keywords
+    T_VAR,
+    T_IF,
+    T_ELSE,
+    T_WHILE,
+    T_FUNCTION,
+    T_ASYNC,
+    T_AWAIT,
+    T_RETURN,
+    T_BREAK,
+    T_CONTINUE,
+    // Operators
+    T_PLUS,
+    T_MINUS,
+    T_STAR,
+    T_SLASH,
+    T_PERCENT,
+    T_ASSIGN,
+    T_EQ,
+    T_NE,
+    T_GT,
+    T_GE,
+    T_LT,
+    T_LE,
+    T_NOT,
+    T_AND,
+    T_OR,
+    // Punctuation
+    T_LPAREN,
+    T_RPAREN,
+    T_LBRACE,
+    T_RBRACE,
+    T_LBRACKET,
+    T_RBRACKET,
+    T_COMMA,
+    T_DOT,
+    T_COLON,
+    T_SEMI,
+    T_END
+};
+
+// `text` points into the Parser's source; string literals exclude the quotes
+struct Token
+{
+    TokenType type;
+    string_view text;
+    int line, col;
+};
+
+// Splits the whole source into tokens in one linear pass
+class Lexer
+{
+    string_view src;
+    size_t pos = 0;
+    int line = 1;
+    size_t lineStart = 0;
+
+    static TokenType keyword(string_view word)
+    {
+        // Dispatch on length first so most identifiers cost one compare
+        switch (word.size())
+        {
+        case 2: return word == "if" ? T_IF : T_IDENT;
+        case 3: return word == "var" ? T_VAR : T_IDENT;
+        case 4: return word == "else" ? T_ELSE : T_IDENT;
+        case 5:
+            return word == "while" ? T_WHILE : word == "break" ? T_BREAK
+                 : word == "async" ? T_ASYNC : word == "await" ? T_AWAIT : T_IDENT;
+        case 6: return word == "return" ? T_RETURN : T_IDENT;
+        case 8: return word == "function" ? T_FUNCTION : word == "continue" ? T_CONTINUE : T_IDENT;
+        default: return T_IDENT;
+        }
+    }
+
+    // ASCII-only and inline: <cctype> goes through the locale on every call
+    static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+    static bool isSpace(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\f' || c == '\v'; }
+    static bool isIdentStart(char c) { return ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c == '_' || c == '$'; }
+    static bool isIdentPart(char c) { return isIdentStart(c) || isDigit(c); }
+
+    [[noreturn]] void error(const string &msg, int col)
+    {
+        throw runtime_error("Syntax error at " + to_string(line) + ":" + to_string(col) + ": " + msg);
+    }
+
+public:
+    Lexer(string_view s, int firstLine = 1) : src(s), line(firstLine) {}
+
+    vector<Token> tokenize()
+    {
+        vector<Token> tokens;
+        tokens.reserve(src.size() / 2 + 1); // Generous: one regrow costs more than the slack
+        while (true)
+        {
+            while (pos < src.size() && isSpace(src[pos]))
+            {
+                if (src[pos] == '\n')
+                {
+                    ++line;
+                    lineStart = pos + 1;
+                }
+                ++pos;
+            }
+            int col = (int)(pos - lineStart) + 1;
+            if (pos >= src.size())
+            {
+                tokens.push_back({T_END, {}, line, col});
+                return tokens;
+            }
+
+            size_t start = pos;
+            char c = src[pos];
+            TokenType type;
+            if (isIdentStart(c))
+            {
+                while (pos < src.size() && isIdentPart(src[pos]))
+                    ++pos;
+                type = keyword(src.substr(start, pos - start));
+            }
+            else if (isDigit(c))
+            {
+                while (pos < src.size() && (isDigit(src[pos]) || src[pos] == '.'))
+                    ++pos;
+                type = T_NUMBER;
+            }
+            else if (c == '"')
+            {
+                size_t close = src.find('"', pos + 1);
+                if (close == string_view::npos)
+                    error("unterminated string", col);
+                for (size_t i = pos + 1; i < close; ++i)
+                    if (src[i] == '\n')
+                    {
+                        ++line;
+                        lineStart = i + 1;
+                    }
+                tokens.push_back({T_STRING, src.substr(pos + 1, close - pos - 1), line, col});
+                pos = close + 1;
+                continue;
+            }
+            else
+            {
+                bool eq = pos + 1 < src.size() && src[pos + 1] == '=';
+                ++pos;
+                switch (c)
+                {
+                case '+': type = T_PLUS; break;
+                case '-': type = T_MINUS; break;
+                case '*': type = T_STAR; break;
+                case '/': type = T_SLASH; break;
+                case '%': type = T_PERCENT; break;
+                case '&':
+                case '|':
+                    if (pos >= src.size() || src[pos] != c)
+                        error(string("unexpected character '") + c + "'", col);
+                    ++pos;
+                    type = c == '&' ? T_AND : T_OR;
+                    break;
+                case '(': type = T_LPAREN; break;
+                case ')': type = T_RPAREN; break;
+                case '{': type = T_LBRACE; break;
+                case '}': type = T_RBRACE; break;
+                case '[': type = T_LBRACKET; break;
+                case ']': type = T_RBRACKET; break;
+                case ',': type = T_COMMA; break;
+                case '.': type = T_DOT; break;
+                case ':': type = T_COLON; break;
+                case ';': type = T_SEMI; break;
+                case '=': type = eq ? T_EQ : T_ASSIGN; break;
+                case '!': type = eq ? T_NE : T_NOT; break;
+                case '>': type = eq ? T_GE : T_GT; break;
+                case '<': type = eq ? T_LE : T_LT; break;
+                default:
+                    error(string("unexpected character '") + c + "'", col);
+                }
+                if (eq && (c == '=' || c == '!' || c == '>' || c == '<'))
+                    ++pos;
+            }
+            tokens.push_back({type, src.substr(start, pos - start), line, col});
+        }
+    }
+};
+
+class Parser
+{
+    string_view src; // Borrowed: tokens point into it until parsing is done
+    chrono::steady_clock::time_point started; // Before lexing, for RuntimeStats::parseMs
+    vector<Token> tokens;
+    size_t pos = 0;
+    int functionDepth = 0; // Where `return` is allowed
+    int loopDepth = 0;     // Where `break`/`continue` are allowed; reset per function
+    bool inAsync = false;  // Where `await` is allowed
+    mutable bool endReached = false; // The last error was running out of input
+    shared_ptr<const string> ownedSource; // Copied once some body is dropped
+
+public:
+    // Check the bodies of top-level functions for syntax errors but drop
+    // their trees, and leave them to be parsed again on their first call
+    bool lazyFunctions = false;
+
+    // `firstLine` numbers positions when `s` is a piece of a longer input
+    Parser(string_view s, int firstLine = 1)
+        : src(s), started(chrono::steady_clock::now()), tokens(Lexer(src, firstLine).tokenize()) {}
+
+    ~Parser()
+    {
+        RuntimeStats &stats = currentStats();
+        stats.parses++;
+        stats.parseMs += chrono::duration<double, milli>(chrono::steady_clock::now() - started).count();
+    }
+
+    const Token &peek(int offset = 0) const { return tokens[min(pos + offset, tokens.size() - 1)]; }
+    bool check(TokenType type) const { return peek().type == type; }
+
+    const Token &advance()
+    {
+        const Token &t = tokens[pos];
+        if (t.type != T_END)
+            ++pos;
+        return t;
+    }
+
+    bool match(TokenType type)
+    {
+        if (!check(type))
+            return false;
+        advance();
+        return true;
+    }
+
+    [[noreturn]] void error(const Token &t, const string &msg) const
+    {
+        endReached = t.type == T_END;
+        string found = t.type == T_END ? "end of input" : "'" + string(t.text) + "'";
+        throw runtime_error("Syntax error at " + to_string(t.line) + ":" + to_string(t.col) + ": " + msg + ", found " + found);
+    }
+
+    const Token &expect(TokenType type, const char *what)
+    {
+        if (!check(type))
+            error(peek(), string("expected ") + what);
+        return advance();
+    }
+
+    // Tag a node with the token it starts at, unless a nested parse already did
+    template <class Node>
+    static shared_ptr<Node> located(shared_ptr<Node> node, const Token &at)
+    {
+        if (node && !node->line)
+        {
+            node->line = at.line;
+            node->col = at.col;
+        }
+        return node;
+    }
+
+    // --- Recursive Descent ---
+
+    shared_ptr<ASTNode> parseExpression()
+    {
+        auto left = parseLogicalOr();
+        if (!check(T_ASSIGN))
+            return left;
+        const Token &eq = advance();
+        if (auto target = dynamic_pointer_cast<IdentifierNode>(left))
+            return located(make_shared<AssignNode>(target->name, parseExpression()), eq);
+        if (auto member = dynamic_pointer_cast<MemberNode>(left))
+            return located(make_shared<MemberAssignNode>(member->object, member->name, parseExpression()), eq);
+        if (auto indexed = dynamic_pointer_cast<IndexNode>(left))
+            return located(make_shared<IndexAssignNode>(indexed->object, indexed->index, parseExpression()), eq);
+        error(eq, "invalid assignment target");
+    }
+
+    shared_ptr<ASTNode> parseLogicalOr()
+    {
+        auto left = parseLogicalAnd();
+        while (check(T_OR))
+        {
+            const Token &op = advance();
+            left = located(make_shared<LogicalNode>(false, left, parseLogicalAnd()), op);
+        }
+        return left;
+    }
+
+    shared_ptr<ASTNode> parseLogicalAnd()
+    {
+        auto left = parseEquality();
+        while (check(T_AND))
+        {
+            const Token &op = advance();
+            left = located(make_shared<LogicalNode>(true, left, parseEquality()), op);
+        }
+        return left;
+    }
+
+    struct OperatorToken
+    {
+        TokenType token;
+        BinaryOperator op;
+    };
+
+    // One left-associative precedence level
+    template <size_t N>
+    shared_ptr<ASTNode> parseBinaryLevel(shared_ptr<ASTNode> (Parser::*operand)(), const OperatorToken (&ops)[N])
+    {
+        auto left = (this->*operand)();
+        while (true)
+        {
+            const OperatorToken *found = nullptr;
+            for (auto &o : ops)
+                if (check(o.token))
+                    found = &o;
+            if (!found)
+                return left;
+            const Token &op = advance();
+            left = located(makeBinary(found->op, left, (this->*operand)()), op);
+        }
+    }
+
+    shared_ptr<ASTNode> parseEquality()
+    {
+        static const OperatorToken ops[] = {{T_EQ, BIN_EQ}, {T_NE, BIN_NE}};
+        return parseBinaryLevel(&Parser::parseRelational, ops);
+    }
+
+    shared_ptr<ASTNode> parseRelational()
+    {
+        static const OperatorToken ops[] = {{T_GT, BIN_GT}, {T_LT, BIN_LT}, {T_GE, BIN_GE}, {T_LE, BIN_LE}};
+        return parseBinaryLevel(&Parser::parseAdditive, ops);
+    }
+
+    shared_ptr<ASTNode> parseAdditive()
+    {
+        static const OperatorToken ops[] = {{T_PLUS, BIN_ADD}, {T_MINUS, BIN_SUB}};
+        return parseBinaryLevel(&Parser::parseMultiplicative, ops);
+    }
+
+    shared_ptr<ASTNode> parseMultiplicative()
+    {
+        static const OperatorToken ops[] = {{T_STAR, BIN_MUL}, {T_SLASH, BIN_DIV}, {T_PERCENT, BIN_MOD}};
+        return parseBinaryLevel(&Parser::parseUnary, ops);
+    }
+
+    shared_ptr<ASTNode> parseUnary()
+    {
+        if (check(T_AWAIT))
+        {
+            const Token &t = advance();
+            if (!inAsync)
+                error(t, "'await' outside an async function");
+            return located(make_shared<AwaitNode>(parseUnary()), t);
+        }
+        if (check(T_MINUS) || check(T_NOT))
+        {
+            const Token &op = advance();
+            return located(make_shared<UnaryNode>(op.type == T_NOT, parseUnary()), op);
+        }
+        return parsePrimary();
+    }
+
+    shared_ptr<ASTNode> parsePrimary()
+    {
+        const Token &t = advance();
+        shared_ptr<ASTNode> node;
+
+        switch (t.type)
+        {
+        case T_NUMBER:
+        {
+            double d = 0;
+            if (from_chars(t.text.data(), t.text.data() + t.text.size(), d).ec != errc())
+                error(t, "malformed number");
+            node = make_shared<NumberNode>(d);
+            break;
+        }
+        case T_STRING:
+            node = make_shared<StringNode>(t.text);
+            break;
+        case T_LPAREN:
+            node = parseExpression();
+            expect(T_RPAREN, "')'");
+            break;
+        case T_LBRACKET:
+        {
+            auto arr = make_shared<ArrayNode>();
+            while (!check(T_RBRACKET) && !check(T_END))
+            {
+                arr->elements.push_back(parseExpression());
+                if (!match(T_COMMA))
+                    break;
+            }
+            expect(T_RBRACKET, "']'");
+            node = arr;
+            break;
+        }
+        case T_LBRACE:
+        {
+            vector<pair<string, shared_ptr<ASTNode>>> props;
+            while (!check(T_RBRACE) && !check(T_END))
+            {
+                const Token &key = advance();
+                if (key.type != T_IDENT && key.type != T_STRING && key.type != T_NUMBER)
+                    error(key, "expected property name");
+                expect(T_COLON, "':'");
+                props.push_back({string(key.text), parseExpression()});
+                if (!match(T_COMMA))
+                    break;
+            }
+            expect(T_RBRACE, "'}'");
+            node = make_shared<ObjectNode>(props);
+            break;
+        }
+        case T_IDENT:
+        {
+            string name(t.text);
+            if (match(T_LPAREN)) // Function Call
+                node = make_shared<CallNode>(name, parseArguments());
+            else
+                node = make_shared<IdentifierNode>(name);
+            break;
+        }
+        default:
+            error(t, "expected an expression");
+        }
+
+        located(node, t);
+
+        // Postfix: obj.key, obj.a.b, arr[i], obj.method(args)
+        while (true)
+        {
+            if (check(T_DOT))
+            {
+                const Token &dot = advance();
+                string name(expect(T_IDENT, "property name").text);
+                if (match(T_LPAREN))
+                    node = located(make_shared<MethodCallNode>(node, name, parseArguments()), dot);
+                else
+                    node = located(make_shared<MemberNode>(node, name), dot);
+            }
+            else if (check(T_LBRACKET))
+            {
+                const Token &bracket = advance();
+                auto index = parseExpression();
+                expect(T_RBRACKET, "']'");
+                node = located(make_shared<IndexNode>(node, index), bracket);
+            }
+            else
+                break;
+        }
+
+        return node;
+    }
+
+    // Call arguments after the opening '('
+    vector<shared_ptr<ASTNode>> parseArguments()
+    {
+        vector<shared_ptr<ASTNode>> args;
+        while (!check(T_RPAREN) && !check(T_END))
+        {
+            args.push_back(parseExpression());
+            if (!match(T_COMMA))
+                break;
+        }
+        expect(T_RPAREN, "')'");
+        return args;
+    }
+
+    shared_ptr<ASTNode> parseBlock()
+    {
+        auto block = located(make_shared<BlockNode>(), expect(T_LBRACE, "'{'"));
+        while (!check(T_RBRACE) && !check(T_END))
+        {
+            block->statements.push_back(parseStatement());
+            match(T_SEMI);
+        }
+        expect(T_RBRACE, "'}'");
+        return block;
+    }
+
+    // After `function`
+    shared_ptr<ASTNode> parseFunction(bool isAsync)
+    {
+        const Token &start = tokens[pos - (isAsync ? 2 : 1)]; // `function`, or the `async` before it
+        string name(expect(T_IDENT, "function name").text);
+        expect(T_LPAREN, "'('");
+        vector<string> params;
+        while (!check(T_RPAREN) && !check(T_END))
+        {
+            params.emplace_back(expect(T_IDENT, "parameter name").text);
+            if (!match(T_COMMA))
+                break;
+        }
+        expect(T_RPAREN, "')'");
+        int outerLoops = loopDepth;
+        bool outerAsync = inAsync;
+        loopDepth = 0;
+        inAsync = isAsync;
+        ++functionDepth;
+        auto body = parseBlock();
+        --functionDepth;
+        loopDepth = outerLoops;
+        inAsync = outerAsync;
+        if (lazyFunctions && functionDepth == 0)
+        {
+            // The body was parsed for its syntax errors; only a call needs the tree
+            if (!ownedSource)
+                ownedSource = make_shared<const string>(src);
+            const Token &last = tokens[pos - 1]; // The closing '}'
+            size_t offset = start.text.data() - src.data();
+            auto node = make_shared<FunctionDeclNode>(name, params, nullptr, isAsync);
+            node->skipped = {ownedSource, offset, (size_t)(last.text.data() + 1 - src.data()) - offset,
+                             start.line, start.col};
+            return node;
+        }
+        return make_shared<FunctionDeclNode>(name, params, body, isAsync);
+    }
+
+    shared_ptr<ASTNode> parseStatement()
+    {
+        const Token &start = peek();
+        return located(parseStatementBody(), start);
+    }
+
+    shared_ptr<ASTNode> parseStatementBody()
+    {
+        if (match(T_VAR))
+        {
+            string name(expect(T_IDENT, "variable name").text);
+            expect(T_ASSIGN, "'='");
+            auto val = parseExpression();
+            match(T_SEMI);
+            return make_shared<VarDeclNode>(name, val);
+        }
+        else if (match(T_IF))
+        {
+            expect(T_LPAREN, "'('");
+            auto cond = parseExpression();
+            expect(T_RPAREN, "')'");
+            auto thenB = parseBlock(); // Assumes { }
+            shared_ptr<ASTNode> elseB = nullptr;
+            if (match(T_ELSE))
+                elseB = check(T_IF) ? parseStatement() : parseBlock();
+            return make_shared<IfNode>(cond, thenB, elseB);
+        }
+        else if (match(T_WHILE))
+        {
+            expect(T_LPAREN, "'('");
+            auto cond = parseExpression();
+            expect(T_RPAREN, "')'");
+            ++loopDepth;
+            auto body = parseBlock();
+            --loopDepth;
+            return make_shared<WhileNode>(cond, body);
+        }
+        else if (match(T_FUNCTION))
+            return parseFunction(false);
+        else if (match(T_ASYNC))
+        {
+            expect(T_FUNCTION, "'function'");
+            return parseFunction(true);
+        }
+        else if (check(T_RETURN))
+        {
+            const Token &ret = advance();
+            if (!functionDepth)
+                error(ret, "'return' outside a function");
+            // A value must start on the same line, as with JS's ASI
+            shared_ptr<ASTNode> value;
+            if (!check(T_SEMI) && !check(T_RBRACE) && !check(T_END) && peek().line == ret.line)
+                value = parseExpression();
+            return make_shared<ReturnNode>(value);
+        }
+        else if (check(T_BREAK) || check(T_CONTINUE))
+        {
+            const Token &t = advance();
+            if (!loopDepth)
+                error(t, "'" + string(t.text) + "' outside a loop");
+            return make_shared<LoopExitNode>(t.type == T_BREAK);
+        }
+
+        // Not a keyword: an expression or assignment
+        return parseExpression();
+    }
+
+    vector<shared_ptr<ASTNode>> parse()
+    {
+        vector<shared_ptr<ASTNode>> stmts;
+        while (!check(T_END))
+        {
+            stmts.push_back(parseStatement());
+            match(T_SEMI);
+        }
+        return stmts;
+    }
+
+    // For input that is still arriving: the leading statements no further
+    // text can change. A statement the input stops in the middle of is held
+    // back, and so is a last one without a `;`, since an `else` or an
+    // operator on the next line would still extend it. `consumed` is the
+    // offset of the first statement held back.
+    vector<shared_ptr<ASTNode>> parseComplete(size_t &consumed)
+    {
+        vector<shared_ptr<ASTNode>> stmts;
+        consumed = 0;
+        while (!check(T_END))
+        {
+            try
+            {
+                stmts.push_back(parseStatement());
+            }
+            catch (runtime_error &)
+            {
+                if (!endReached)
+                    throw;
+                return stmts;
+            }
+            if (!match(T_SEMI) && check(T_END))
+            {
+                stmts.pop_back();
+                return stmts;
+            }
+            // Just past the last token taken; a string's text excludes its closing quote
+            const Token &last = tokens[pos - 1];
+            consumed = (size_t)(last.text.data() - src.data()) + last.text.size() + (last.type == T_STRING);
+        }
+        return stmts;
+    }
+};
+
+// ==========================================
+// 7. CONSTANT FOLDING
+// ==========================================
+
+void Folder::fold(shared_ptr<ASTNode> &node)
+{
+    if (!node)
+        return;
+    if (auto simpler = node->fold(*this))
+    {
+        if (!simpler->line)
+        {
+            simpler->line = node->line;
+            simpler->col = node->col;
+        }
+        node = simpler;
+        replaced++;
+    }
+}
+
+void Folder::foldStatements(vector<shared_ptr<ASTNode>> &stmts)
+{
+    for (auto &stmt : stmts)
+        fold(stmt);
+    // Only the last statement's value is observable, and nothing after a
+    // return, break or continue runs (but its declarations are still hoisted)
+    Value unused;
+    size_t kept = 0;
+    bool reachable = true;
+    for (size_t i = 0; i < stmts.size(); ++i)
+    {
+        bool isLast = i + 1 == stmts.size();
+        bool dead = reachable ? !isLast && (!stmts[i] || stmts[i]->constantValue(unused)) : !declaresNames(stmts[i]);
+        if (dead)
+        {
+            replaced++;
+            continue;
+        }
+        if (stmts[i] && stmts[i]->transfersControl())
+            reachable = false;
+        stmts[kept++] = stmts[i];
+    }
+    stmts.resize(kept);
+}
+
+shared_ptr<ASTNode> Folder::constant(Value v)
+{
+    if (v.isNumber())
+        return make_shared<NumberNode>(v.asNumber());
+    if (v.is(V_STR))
+    {
+        if (v.asString()->length > kMaxFoldedString)
+            return nullptr;
+        return make_shared<StringNode>(v.asString()->flat());
+    }
+    if (v.isNull() || v.isBool())
+        return make_shared<ConstantNode>(v);
+    return nullptr;
+}
+
+bool Folder::declaresNames(const shared_ptr<ASTNode> &node)
+{
+    if (!node)
+        return false;
+    Resolver r;
+    r.beginFunction({});
+    node->hoist(r);
+    return r.endFunction() > 0;
+}
+
+size_t Folder::foldScript(vector<shared_ptr<ASTNode>> &stmts)
+{
+    Folder f;
+    f.foldStatements(stmts);
+    return f.replaced;
+}
+
+// ==========================================
+// 8. SCOPE RESOLUTION
+// ==========================================
+
+void Resolver::resolve(const shared_ptr<ASTNode> &node)
+{
+    if (node)
+        node->resolve(*this);
+}
+
+void Resolver::resolveFunction(const vector<string> &params, const shared_ptr<ASTNode> &body, int &slotCount,
+                               bool &needsEnvironment)
+{
+    beginFunction(params);
+    body->hoist(*this);
+    body->resolve(*this);
+    needsEnvironment = captured.back();
+    slotCount = endFunction();
+}
+
+void Resolver::resolveScript(const vector<shared_ptr<ASTNode>> &stmts)
+{
+    Resolver r;
+    for (auto &stmt : stmts)
+        r.resolve(stmt);
+}
+
+// ==========================================
+// 9. BYTECODE COMPILER & VM
+// ==========================================
+
+void BytecodeCompiler::compile(const shared_ptr<ASTNode> &node)
+{
+    if (!node)
+    {
+        emit(OP_LDA_NULL);
+        return;
+    }
+    if (!node->line)
+    {
+        node->compile(*this);
+        return;
+    }
+    int outerLine = line, outerCol = col;
+    line = node->line;
+    col = node->col;
+    node->compile(*this);
+    line = outerLine;
+    col = outerCol;
+}
+
+shared_ptr<BytecodeFunction> BytecodeCompiler::compileScript(const vector<shared_ptr<ASTNode>> &stmts)
+{
+    BytecodeCompiler c;
+    c.fn->name = "<script>";
+    c.emit(OP_LDA_NULL);
+    for (auto &stmt : stmts)
+    {
+        if (stmt)
+            c.compile(stmt);
+    }
+    c.emit(OP_RETURN);
+    return c.fn;
+}
+
+shared_ptr<BytecodeFunction> BytecodeCompiler::compileFunction(const string &name, const vector<string> &params,
+                                                              const shared_ptr<ASTNode> &body, int slotCount,
+                                                              bool needsEnvironment, bool isAsync)
+{
+    BytecodeCompiler c;
+    c.fn->name = name;
+    c.fn->params = params;
+    c.fn->slotCount = slotCount;
+    c.fn->isAsync = isAsync;
+    if (!needsEnvironment)
+    {
+        c.fn->localsInRegisters = true;
+        c.allocRegs(slotCount); // Temporaries start above the locals
+    }
+    c.compile(body);
+    c.emit(OP_RETURN);
+    return c.fn;
+}
+
+void disassemble(const BytecodeFunction &fn)
+{
+    static const char *opNames[] = {
+        "LdaNull", "LdaConst", "Ldar", "Star", "LdaLocal", "StaLocal", "LdaContext", "StaContext",
+        "LdaGlobal", "StaGlobal", "DefGlobal",
+        "Add", "Sub", "Mul", "Div", "Mod", "TestGreater", "TestLess", "TestGreaterOrEqual",
+        "TestLessOrEqual", "TestEqual", "TestNotEqual", "Negate", "LogicalNot",
+        "MakeArray", "MakeObject", "GetProp", "SetProp", "GetIndex", "SetIndex", "MakeClosure",
+        "Jump", "JumpIfFalse", "JumpIfTrue", "CallMethod", "Call", "TailCall", "Await", "Return"};
+
+    if (fn.lazy)
+    {
+        cout << "[bytecode] " << fn.name << " (lazy)" << endl;
+        return;
+    }
+    cout << "[bytecode] " << fn.name << " (" << fn.registerCount << " registers)" << endl;
+    for (size_t i = 0; i < fn.code.size(); ++i)
+    {
+        const Instruction &ins = fn.code[i];
+        cout << "  " << i << ": " << opNames[ins.op];
+        switch (ins.op)
+        {
+        case OP_LDA_CONST:
+            cout << " [" << fn.constants[ins.a].toString() << "]";
+            break;
+        case OP_LDAR:
+        case OP_STAR:
+        case OP_GET_INDEX:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_MOD:
+        case OP_GT:
+        case OP_LT:
+        case OP_GE:
+        case OP_LE:
+        case OP_EQ:
+        case OP_NE:
+            cout << " r" << ins.a;
+            break;
+        case OP_LDA_LOCAL:
+        case OP_STA_LOCAL:
+            cout << " [" << ins.a << "]";
+            break;
+        case OP_LDA_CONTEXT:
+        case OP_STA_CONTEXT:
+            cout << " [" << ins.a << ", " << ins.b << "]";
+            break;
+        case OP_LDA_GLOBAL:
+        case OP_STA_GLOBAL:
+        case OP_DEF_GLOBAL:
+            cout << " " << currentGlobals().nameOf(ins.a);
+            break;
+        case OP_MAKE_ARRAY:
+            cout << " r" << ins.a << ", #" << ins.b;
+            break;
+        case OP_MAKE_OBJECT:
+            cout << " r" << ins.a << ", #" << ins.b << " {";
+            for (size_t k = 0; k < fn.literals[ins.c].slotOf.size(); ++k)
+                cout << (k ? ", " : "") << fn.literals[ins.c].shape->keys[fn.literals[ins.c].slotOf[k]]->value;
+            cout << "}";
+            break;
+        case OP_GET_PROP:
+            cout << " " << fn.constants[ins.a].str() << " [ic " << ins.b << "]";
+            break;
+        case OP_SET_PROP:
+            cout << " r" << ins.a << ", " << fn.constants[ins.b].str() << " [ic " << ins.c << "]";
+            break;
+        case OP_SET_INDEX:
+            cout << " r" << ins.a << ", r" << ins.b;
+            break;
+        case OP_MAKE_CLOSURE:
+            cout << " " << fn.functions[ins.a]->name;
+            break;
+        case OP_CALL_METHOD:
+            cout << " r" << ins.a << ", #" << ins.b << " (" << fn.constants[ins.c].str() << ")";
+            break;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            cout << " @" << ins.a;
+            break;
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            cout << " r" << ins.a << ", #" << ins.b << " (" << fn.names[ins.c] << ")";
+            break;
+        default:
+            break;
+        }
+        cout << endl;
+    }
+    for (auto &inner : fn.functions)
+        disassemble(*inner);
+}
+
+// Promise plumbing the VM drives; see section 11
+void resolvePromise(PromiseCell *promise, Value value);
+void awaitValue(const Value &value, AsyncFrame *frame);
+
+class VM
+{
+    struct Frame
+    {
+        shared_ptr<BytecodeFunction> fn;
+        size_t pc;
+        size_t base; // First register of this frame in `stack`
+        Environment *env;
+        PromiseCell *promise = nullptr; // An async call's result, settled on return
+    };
+
+    // Reserved up front so register pointers (and the Args handed to
+    // natives) stay valid while frames are pushed
+    static constexpr size_t kMaxStack = 1 << 20;
+
+    Heap &heap;
+    GlobalScope &globals;
+    RuntimeStats &stats;
+    vector<Value> stack;
+    vector<Frame> frames;
+    Value acc;
+
+    // First register above every live frame
+    size_t stackTop() const { return frames.empty() ? 0 : frames.back().base + frames.back().fn->registerCount; }
+
+    // Frames called from bytecode start at their arguments, which the caller
+    // left in its topmost registers, so nothing is copied. Locals kept in
+    // registers start out null, including any extra arguments' registers.
+    void pushFrame(const shared_ptr<BytecodeFunction> &fn, Environment *env, size_t base, int argc = 0)
+    {
+        size_t top = base + fn->registerCount;
+        if (top > stack.capacity())
+            throw runtime_error("Maximum call stack size exceeded");
+        if (stack.size() < top)
+            stack.resize(top);
+        if (fn->localsInRegisters)
+        {
+            size_t params = min((size_t)argc, fn->params.size());
+            fill(stack.begin() + base + params, stack.begin() + base + fn->slotCount, Value());
+        }
+        frames.push_back({fn, 0, base, env});
+    }
+
+    // Clears the frame's registers from `keep` up so they don't pin garbage
+    void popFrame(size_t keep = 0)
+    {
+        Frame &f = frames.back();
+        for (size_t i = keep; i < (size_t)f.fn->registerCount; ++i)
+            stack[f.base + i] = Value();
+        frames.pop_back();
+    }
+
+    // Runs the dispatch loop until the frame at `entryDepth` returns
+    Value run(size_t entryDepth)
+    {
+        try
+        {
+            return dispatch(entryDepth);
+        }
+        catch (...)
+        {
+            while (frames.size() > entryDepth - 1)
+                popFrame();
+            throw;
+        }
+    }
+
+    Value dispatch(size_t entryDepth);
+
+    // Runs the frame's machine code from `pc` until it reaches an op it
+    // leaves to the interpreter; returns that op's pc. Out of line to keep
+    // dispatch()'s register allocation unaffected when the JIT is off.
+    NOINLINE size_t enterJit(Frame &f, Value *regs, size_t pc)
+    {
+        BytecodeFunction &fn = *f.fn;
+        JitState state{acc, regs, f.env ? f.env->slots.data() : nullptr, globals.valueSlots(),
+                       globals.definedFlags(), f.env, &heap.safepointPending};
+        uint32_t exit = fn.jit->entry(&state, (uint32_t)pc);
+        acc = state.acc;
+        if (!(exit & kJitDeoptFlag))
+            return exit;
+
+        exit &= ~kJitDeoptFlag;
+        if (traceJit)
+            cout << "[jit] deopt " << fn.name << " @" << exit << endl;
+        if (++fn.deopts >= kJitDeoptLimit)
+        {
+            if (traceJit)
+                cout << "[jit] discarding code for " << fn.name << endl;
+            fn.jit.reset();
+            fn.jitDisabled = true;
+        }
+        return exit;
+    }
+
+    static bool isHot(BytecodeFunction &fn, uint32_t &counter, uint32_t threshold)
+    {
+        return jitEnabled && !fn.jit && !fn.jitDisabled && ++counter >= threshold;
+    }
+
+public:
+    VM(Heap &h, GlobalScope &g, RuntimeStats &s) : heap(h), globals(g), stats(s) { stack.reserve(kMaxStack); }
+
+    // Calls f(fn, pc) for every frame, outermost first. At a safepoint each
+    // pc is current: a return address, or where the innermost frame stopped.
+    template <class F>
+    void walkFrames(F &&f) const
+    {
+        for (auto &frame : frames)
+            f(frame.fn, frame.pc);
+    }
+
+    void markRoots()
+    {
+        heap.mark(acc);
+        for (auto &v : stack)
+            heap.mark(v);
+        for (auto &f : frames)
+        {
+            heap.mark(f.env);
+            heap.mark(f.fn.get());
+            heap.mark(f.promise);
+        }
+    }
+
+    Value execute(const shared_ptr<BytecodeFunction> &script, Environment *env)
+    {
+        acc = Value();
+        pushFrame(script, env, stackTop());
+        return run(frames.size());
+    }
+
+    // Entry point for calls from native code (e.g. the event loop)
+    Value call(FunctionCell *func, const vector<Value> &args)
+    {
+        if (func->code->lazy)
+            compileLazily(*func->code);
+        size_t base = stackTop();
+        if (func->code->localsInRegisters)
+        {
+            if (base + args.size() > stack.capacity())
+                throw runtime_error("Maximum call stack size exceeded");
+            if (stack.size() < base + args.size())
+                stack.resize(base + args.size());
+            copy(args.begin(), args.end(), stack.begin() + base);
+            pushFrame(func->code, nullptr, base, (int)args.size());
+        }
+        else
+        {
+            auto scope = gcNew<Environment>(func->closure, func->code->slotCount);
+            for (size_t i = 0; i < func->params.size() && i < args.size(); ++i)
+                scope->slots[i] = args[i];
+            pushFrame(func->code, scope, base);
+        }
+        if (func->code->isAsync)
+            frames.back().promise = gcNew<PromiseCell>();
+        return run(frames.size());
+    }
+
+    // Continue an async function from its `await`, with `value` as the
+    // result of the await expression
+    Value resume(AsyncFrame *suspended, Value value)
+    {
+        size_t base = stackTop();
+        pushFrame(suspended->fn, suspended->env, base);
+        copy(suspended->registers.begin(), suspended->registers.end(), stack.begin() + base);
+        suspended->registers.clear();
+        frames.back().pc = suspended->pc;
+        frames.back().promise = suspended->promise;
+        acc = value;
+        return run(frames.size());
+    }
+};
+
+Value VM::dispatch(size_t entryDepth)
+{
+    Frame *frame = &frames.back();
+    const Instruction *code = frame->fn->code.data();
+    Value *regs = &stack[frame->base];
+    size_t pc = frame->pc;
+    JitCode *jit = frame->fn->jit.get();
+
+    while (true)
+    {
+        if (jit)
+        {
+            pc = enterJit(*frame, regs, pc);
+            jit = frame->fn->jit.get(); // Gone if it deopted too often
+        }
+        const Instruction &ins = code[pc++];
+        switch (ins.op)
+        {
+        case OP_LDA_NULL:
+            acc = Value();
+            break;
+        case OP_LDA_CONST:
+            acc = frame->fn->constants[ins.a];
+            break;
+        case OP_LDAR:
+            acc = regs[ins.a];
+            break;
+        case OP_STAR:
+            regs[ins.a] = acc;
+            break;
+        case OP_LDA_LOCAL:
+            stats.countAccess(0);
+            acc = frame->env->slots[ins.a];
+            break;
+        case OP_STA_LOCAL:
+            stats.countAccess(0);
+            frame->env->slots[ins.a] = acc;
+            break;
+        case OP_LDA_CONTEXT:
+            stats.countAccess(ins.a);
+            acc = frame->env->at(ins.a, ins.b);
+            break;
+        case OP_STA_CONTEXT:
+            stats.countAccess(ins.a);
+            frame->env->at(ins.a, ins.b) = acc;
+            break;
+        case OP_LDA_GLOBAL:
+            acc = globals.get(ins.a);
+            break;
+        case OP_STA_GLOBAL:
+            globals.set(ins.a, acc);
+            break;
+        case OP_DEF_GLOBAL:
+            globals.define(ins.a, acc);
+            break;
+        case OP_ADD:
+            acc = applyBinary<BIN_ADD>(regs[ins.a], acc);
+            break;
+        case OP_SUB:
+            acc = applyBinary<BIN_SUB>(regs[ins.a], acc);
+            break;
+        case OP_MUL:
+            acc = applyBinary<BIN_MUL>(regs[ins.a], acc);
+            break;
+        case OP_DIV:
+            acc = applyBinary<BIN_DIV>(regs[ins.a], acc);
+            break;
+        case OP_MOD:
+            acc = applyBinary<BIN_MOD>(regs[ins.a], acc);
+            break;
+        case OP_GT:
+            acc = applyBinary<BIN_GT>(regs[ins.a], acc);
+            break;
+        case OP_LT:
+            acc = applyBinary<BIN_LT>(regs[ins.a], acc);
+            break;
+        case OP_GE:
+            acc = applyBinary<BIN_GE>(regs[ins.a], acc);
+            break;
+        case OP_LE:
+            acc = applyBinary<BIN_LE>(regs[ins.a], acc);
+            break;
+        case OP_EQ:
+            acc = applyBinary<BIN_EQ>(regs[ins.a], acc);
+            break;
+        case OP_NE:
+            acc = applyBinary<BIN_NE>(regs[ins.a], acc);
+            break;
+        case OP_NEGATE:
+            acc = Value::number(-acc.num());
+            break;
+        case OP_NOT:
+            acc = Value::boolean(!acc.truthy());
+            break;
+        case OP_MAKE_ARRAY:
+        {
+            auto arr = gcNew<ListCell>();
+            arr->reserve(ins.b);
+            for (int i = 0; i < ins.b; ++i)
+                arr->push(regs[ins.a + i]);
+            acc = Value(arr);
+            break;
+        }
+        case OP_MAKE_OBJECT:
+            acc = frame->fn->literals[ins.c].instantiate(regs + ins.a);
+            break;
+        case OP_GET_PROP:
+            acc = getProperty(acc, frame->fn->constants[ins.a].asString(), frame->fn->caches[ins.b]);
+            break;
+        case OP_SET_PROP:
+            setProperty(regs[ins.a], frame->fn->constants[ins.b].asString(), acc, frame->fn->caches[ins.c]);
+            break;
+        case OP_GET_INDEX:
+            acc = getIndex(regs[ins.a], acc);
+            break;
+        case OP_SET_INDEX:
+            setIndex(regs[ins.a], regs[ins.b], acc);
+            break;
+        case OP_MAKE_CLOSURE:
+        {
+            auto &proto = frame->fn->functions[ins.a];
+            auto func = gcNew<FunctionCell>();
+            func->params = proto->params;
+            func->code = proto;
+            func->closure = frame->env; // Capture scope!
+            func->slotCount = proto->slotCount;
+            acc = Value(func);
+            break;
+        }
+        case OP_JUMP:
+            if ((size_t)ins.a < pc)
+            {
+                frame->pc = pc; // Where an interrupt finds this frame
+                heap.safepoint(); // Loop back-edge
+                if (isHot(*frame->fn, frame->fn->backEdges, kJitLoopThreshold))
+                {
+                    jitCompile(*frame->fn); // OSR: the next iteration enters machine code
+                    jit = frame->fn->jit.get();
+                }
+            }
+            pc = ins.a;
+            break;
+        case OP_JUMP_IF_FALSE:
+            if (!acc.truthy())
+                pc = ins.a;
+            break;
+        case OP_JUMP_IF_TRUE:
+            if (acc.truthy())
+                pc = ins.a;
+            break;
+        case OP_CALL_METHOD:
+        {
+            // Builtins finish here; otherwise the callee replaces the
+            // receiver in r[a] and this becomes a plain call
+            StringCell *key = frame->fn->constants[ins.c].asString();
+            if (callBuiltinMethod(regs[ins.a], key, regs + ins.a + 1, ins.b, acc))
+            {
+                stats.nativeCalls++;
+                break;
+            }
+            regs[ins.a] = methodTarget(regs[ins.a], key);
+        }
+            [[fallthrough]];
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            const Value &callable = regs[ins.a];
+            const Value *args = regs + ins.a + 1;
+            if (callable.is(V_NATIVE))
+            {
+                stats.nativeCalls++;
+                frame->pc = pc;
+                acc = callable.asNative()->nativeFn(Args(args, ins.b));
+                frame = &frames.back(); // Natives may re-enter the VM and grow both stacks
+                regs = &stack[frame->base];
+                break;
+            }
+            if (!callable.is(V_FUNC) || !callable.asFunction()->code)
+                throw runtime_error("Not a function: " + frame->fn->names[ins.c]);
+
+            stats.userCalls++;
+            FunctionCell *func = callable.asFunction();
+            if (func->code->lazy)
+            {
+                frame->pc = pc; // Errors in the body are reported from the call
+                compileLazily(*func->code);
+            }
+            Environment *scope = nullptr;
+            if (!func->code->localsInRegisters)
+            {
+                // The code's count: the closure may have been made before the body was compiled
+                scope = gcNew<Environment>(func->closure, func->code->slotCount);
+                for (size_t i = 0; i < func->params.size() && (int)i < ins.b; ++i)
+                    scope->slots[i] = args[i];
+            }
+            frame->pc = pc;
+            size_t base = frame->base + ins.a + 1;
+            if (ins.op == OP_TAIL_CALL)
+            {
+                // The callee takes over our frame and returns to our caller
+                base = frame->base;
+                for (int i = 0; i < ins.b; ++i)
+                    stack[base + i] = args[i];
+                popFrame(ins.b);
+            }
+            pushFrame(func->code, scope, base, ins.b);
+            frame = &frames.back();
+            if (frame->fn->isAsync)
+                frame->promise = gcNew<PromiseCell>();
+            code = frame->fn->code.data();
+            regs = &stack[frame->base];
+            pc = 0;
+            heap.safepoint(); // Function entry
+            if (isHot(*frame->fn, frame->fn->calls, kJitCallThreshold))
+                jitCompile(*frame->fn);
+            jit = frame->fn->jit.get();
+            break;
+        }
+        case OP_AWAIT:
+        {
+            // Park the frame on the heap and hand the caller its promise
+            auto suspended = gcNew<AsyncFrame>(frame->fn, pc, frame->env, frame->promise, regs);
+            awaitValue(acc, suspended);
+            acc = Value(frame->promise);
+            frame->promise = nullptr; // Still pending: leave without settling it
+        }
+            [[fallthrough]];
+        case OP_RETURN:
+        {
+            if (frame->promise)
+            {
+                resolvePromise(frame->promise, acc);
+                acc = Value(frame->promise);
+            }
+            popFrame();
+            if (frames.size() < entryDepth)
+                return acc;
+            frame = &frames.back();
+            code = frame->fn->code.data();
+            regs = &stack[frame->base];
+            pc = frame->pc;
+            jit = frame->fn->jit.get();
+            break;
+        }
+        }
+    }
+}
+
+bool useAstInterpreter = false; // --ast: run the tree-walking evaluator instead
+bool printBytecode = false;     // --print-bytecode
+bool printAst = false;          // --print-ast: the tree before and after folding
+bool foldConstants = true;      // --no-fold turns the folding pass off
+bool lazyParsing = true;        // --no-lazy parses every function body up front
+
+void dumpAst(const string &title, const vector<shared_ptr<ASTNode>> &stmts)
+{
+    cout << "[ast] " << title << endl;
+    for (auto &stmt : stmts)
+        printNode(cout << "  ", stmt) << endl;
+}
+
+// Invoke a script or native function value from C++ (timers, natives)
+Value callFunction(const Value &callable, const vector<Value> &args)
+{
+    // The caller's copies may be all that is left of them (a popped timer, a
+    // native's arguments), and the call reaches safepoints
+    HandleScope handles;
+    handles.keep(callable);
+    for (auto &a : args)
+        handles.keep(a);
+    if (callable.is(V_NATIVE))
+    {
+        currentStats().nativeCalls++;
+        return callable.asNative()->nativeFn(args);
+    }
+
+    currentStats().userCalls++;
+    FunctionCell *func = callable.asFunction();
+    if (func->code)
+        return currentVM().call(func, args);
+    return invokeAstFunction(func, args);
+}
+
+// ==========================================
+// 10. BASELINE JIT (X86-64)
+// ==========================================
+
+// A template JIT: every bytecode becomes a fixed machine-code sequence that
+// works directly on the VM's register file, environment and globals, so
+// nothing has to be reconstructed when control moves back to the
+// interpreter. Code can be entered at any bytecode pc through a jump table,
+// which is how hot loops are entered mid-function (OSR).
+//
+// Only ops that cannot allocate, call or throw are compiled. Anything else
+// returns its pc and the interpreter runs it before re-entering. Arithmetic
+// and comparisons assume numbers behind tag guards; a failed guard returns
+// to the interpreter at that op with kJitDeoptFlag set, and a function that
+// deopts kJitDeoptLimit times loses its machine code for good.
+
+void JitCodeDeleter::operator()(JitCode *code) const
+{
+#if defined(_WIN32)
+    VirtualFree(code->memory, 0, MEM_RELEASE);
+#elif defined(HAVE_JIT)
+    munmap(code->memory, code->size);
+#endif
+    delete code;
+}
+
+#ifdef HAVE_JIT
+
+// Just the encodings the compiler below needs. Registers are numbered as in
+// the ModRM byte; xmm operands are limited to xmm0..xmm7.
+class X64Assembler
+{
+public:
+    enum Reg
+    {
+        RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+        R8, R9, R10, R11, R12, R13, R14, R15
+    };
+    enum Cond
+    {
+        C_AE = 0x3, C_E = 0x4, C_NE = 0x5, C_A = 0x7, C_P = 0xA, C_NP = 0xB
+    };
+
+    vector<uint8_t> buf;
+
+    size_t here() const { return buf.size(); }
+    void byte(uint8_t b) { buf.push_back(b); }
+
+    void u32(uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i)
+            byte(uint8_t(v >> (8 * i)));
+    }
+
+    void u64(uint64_t v)
+    {
+        for (int i = 0; i < 8; ++i)
+            byte(uint8_t(v >> (8 * i)));
+    }
+
+    void patch32(size_t at, int32_t v) { memcpy(&buf[at], &v, 4); }
+
+    // Points the rel32 at `at` to `target`
+    void bind(size_t at, size_t target) { patch32(at, int32_t(target - (at + 4))); }
+
+    void rex(bool w, int reg, int base)
+    {
+        uint8_t r = uint8_t(0x40 | (w << 3) | ((reg & 8) >> 1) | ((base & 8) >> 3));
+        if (r != 0x40)
+            byte(r);
+    }
+
+    // [base + disp32]
+    void mem(int reg, int base, int32_t disp)
+    {
+        byte(uint8_t(0x80 | ((reg & 7) << 3) | (base & 7)));
+        if ((base & 7) == RSP)
+            byte(0x24); // SIB needed for rsp/r12 bases
+        u32(uint32_t(disp));
+    }
+
+    void regReg(int reg, int rm) { byte(uint8_t(0xC0 | ((reg & 7) << 3) | (rm & 7))); }
+
+    void load(Reg dst, Reg base, int32_t disp)
+    {
+        rex(true, dst, base);
+        byte(0x8B);
+        mem(dst, base, disp);
+    }
+
+    void store(Reg base, int32_t disp, Reg src)
+    {
+        rex(true, src, base);
+        byte(0x89);
+        mem(src, base, disp);
+    }
+
+    // movzx dst32, byte [base + disp]
+    void loadByte(Reg dst, Reg base, int32_t disp)
+    {
+        rex(false, dst, base);
+        byte(0x0F);
+        byte(0xB6);
+        mem(dst, base, disp);
+    }
+
+    void storeByte(Reg base, int32_t disp, uint8_t imm)
+    {
+        rex(false, 0, base);
+        byte(0xC6);
+        mem(0, base, disp);
+        byte(imm);
+    }
+
+    void movImm64(Reg dst, uint64_t imm)
+    {
+        rex(true, 0, dst);
+        byte(uint8_t(0xB8 + (dst & 7)));
+        u64(imm);
+    }
+
+    void movImm32(Reg dst, uint32_t imm)
+    {
+        rex(false, 0, dst);
+        byte(uint8_t(0xB8 + (dst & 7)));
+        u32(imm);
+    }
+
+    // 64-bit `op dst, src` for the r/m,reg forms (mov, add, and, cmp, test)
+    void alu(uint8_t opcode, Reg dst, Reg src)
+    {
+        rex(true, src, dst);
+        byte(opcode);
+        regReg(src, dst);
+    }
+    void mov(Reg dst, Reg src) { alu(0x89, dst, src); }
+    void add(Reg dst, Reg src) { alu(0x01, dst, src); }
+    void andr(Reg dst, Reg src) { alu(0x21, dst, src); }
+    void cmp(Reg dst, Reg src) { alu(0x39, dst, src); }
+    void xorr(Reg dst, Reg src) { alu(0x31, dst, src); }
+    void test(Reg dst, Reg src) { alu(0x85, dst, src); }
+
+    void mov32(Reg dst, Reg src)
+    {
+        rex(false, src, dst);
+        byte(0x89);
+        regReg(src, dst);
+    }
+
+    void movqToXmm(int xmm, Reg src)
+    {
+        byte(0x66);
+        rex(true, xmm, src);
+        byte(0x0F);
+        byte(0x6E);
+        regReg(xmm, src);
+    }
+
+    void movqFromXmm(Reg dst, int xmm)
+    {
+        byte(0x66);
+        rex(true, xmm, dst);
+        byte(0x0F);
+        byte(0x7E);
+        regReg(xmm, dst);
+    }
+
+    // Scalar double ops: F2 0F 58 addsd, 5C subsd, 59 mulsd, 5E divsd; 66 0F 2E ucomisd
+    void sse(uint8_t prefix, uint8_t opcode, int dst, int src)
+    {
+        byte(prefix);
+        byte(0x0F);
+        byte(opcode);
+        regReg(dst, src);
+    }
+
+    // setcc into al/cl/dl/bl
+    void setcc(Cond cc, Reg r)
+    {
+        byte(0x0F);
+        byte(uint8_t(0x90 | cc));
+        regReg(0, r);
+    }
+
+    void andByte(Reg dst, Reg src)
+    {
+        byte(0x20);
+        regReg(src, dst);
+    }
+
+    void orByte(Reg dst, Reg src)
+    {
+        byte(0x08);
+        regReg(src, dst);
+    }
+
+    void movzxByte(Reg dst, Reg src)
+    {
+        byte(0x0F);
+        byte(0xB6);
+        regReg(dst, src);
+    }
+
+    void push(Reg r)
+    {
+        rex(false, 0, r);
+        byte(uint8_t(0x50 + (r & 7)));
+    }
+
+    void pop(Reg r)
+    {
+        rex(false, 0, r);
+        byte(uint8_t(0x58 + (r & 7)));
+    }
+
+    void adjustRsp(bool grow, uint8_t n)
+    {
+        byte(0x48);
+        byte(0x83);
+        byte(grow ? 0xEC : 0xC4);
+        byte(n);
+    }
+
+    void callReg(Reg r)
+    {
+        rex(false, 0, r);
+        byte(0xFF);
+        regReg(2, r);
+    }
+
+    void jmpReg(Reg r)
+    {
+        rex(false, 0, r);
+        byte(0xFF);
+        regReg(4, r);
+    }
+
+    // Both return the offset of the rel32 to bind later
+    size_t jmp()
+    {
+        byte(0xE9);
+        u32(0);
+        return here() - 4;
+    }
+
+    size_t jcc(Cond cc)
+    {
+        byte(0x0F);
+        byte(uint8_t(0x80 | cc));
+        u32(0);
+        return here() - 4;
+    }
+};
+
+// Called from machine code for LDA_CONTEXT/STA_CONTEXT
+static Value *jitContextSlot(Environment *env, int depth, int slot) noexcept
+{
+    return &env->at(depth, slot);
+}
+
+class JitCompiler
+{
+    using A = X64Assembler;
+
+    X64Assembler a;
+    const BytecodeFunction &fn;
+    vector<size_t> labels;                 // Machine-code offset of each bytecode
+    vector<pair<size_t, size_t>> branches; // rel32 -> bytecode target
+    vector<pair<size_t, uint32_t>> exits;  // rel32 -> stub returning this code
+    vector<size_t> toEpilogue;             // rel32s that jump to the epilogue
+
+    static constexpr uint64_t QNAN = Value::QNAN;
+
+    static int32_t slotOffset(int index) { return int32_t(index * sizeof(Value)); }
+
+    void loadAcc(A::Reg r) { a.load(r, A::R12, offsetof(JitState, acc)); }
+    void storeAcc(A::Reg r) { a.store(A::R12, offsetof(JitState, acc), r); }
+
+    // Straight back to the interpreter at `pc`
+    void exitTo(uint32_t pc)
+    {
+        a.movImm32(A::RAX, pc);
+        toEpilogue.push_back(a.jmp());
+    }
+
+    // Leaves for the interpreter at `pc` if `cc` holds
+    void exitIf(A::Cond cc, uint32_t code) { exits.push_back({a.jcc(cc), code}); }
+
+    // Deopts unless `r` holds a number; rdx must hold QNAN
+    void guardNumber(A::Reg r, uint32_t pc)
+    {
+        a.mov(A::RCX, r);
+        a.andr(A::RCX, A::RDX);
+        a.cmp(A::RCX, A::RDX);
+        exitIf(A::C_E, pc | kJitDeoptFlag);
+    }
+
+    // xmm0 = r[a], xmm1 = acc, both checked to be numbers
+    void loadOperands(int reg, uint32_t pc)
+    {
+        a.load(A::RAX, A::RBX, slotOffset(reg));
+        loadAcc(A::R8);
+        a.movImm64(A::RDX, QNAN);
+        guardNumber(A::RAX, pc);
+        guardNumber(A::R8, pc);
+        a.movqToXmm(0, A::RAX);
+        a.movqToXmm(1, A::R8);
+    }
+
+    void arithmetic(uint8_t opcode, int reg, uint32_t pc)
+    {
+        loadOperands(reg, pc);
+        a.sse(0xF2, opcode, 0, 1);
+        a.movqFromXmm(A::RAX, 0);
+        storeAcc(A::RAX);
+    }
+
+    // acc = FALSE_BITS + al
+    void storeBoolean()
+    {
+        a.movzxByte(A::RAX, A::RAX);
+        a.movImm64(A::RCX, Value::FALSE_BITS);
+        a.add(A::RAX, A::RCX);
+        storeAcc(A::RAX);
+    }
+
+    void contextSlot(const Instruction &ins)
+    {
+#ifdef _WIN32
+        a.load(A::RCX, A::R12, offsetof(JitState, env));
+        a.movImm32(A::RDX, uint32_t(ins.a));
+        a.movImm32(A::R8, uint32_t(ins.b));
+#else
+        a.load(A::RDI, A::R12, offsetof(JitState, env));
+        a.movImm32(A::RSI, uint32_t(ins.a));
+        a.movImm32(A::RDX, uint32_t(ins.b));
+#endif
+        a.movImm64(A::RAX, uint64_t(uintptr_t(&jitContextSlot)));
+        a.callReg(A::RAX);
+    }
+
+    // Deopts (well, exits: the interpreter throws) if the global is undefined
+    void guardDefined(int slot, uint32_t pc)
+    {
+        a.loadByte(A::RAX, A::R15, slot);
+        a.test(A::RAX, A::RAX);
+        exitIf(A::C_E, pc);
+    }
+
+    // Numbers are falsy only as +-0 (2x the bits is zero); anything else
+    // is truthy only as `true`
+    void branchOnTruthiness(bool jumpIfTrue, int target)
+    {
+        loadAcc(A::RAX);
+        a.movImm64(A::RDX, QNAN);
+        a.mov(A::RCX, A::RAX);
+        a.andr(A::RCX, A::RDX);
+        a.cmp(A::RCX, A::RDX);
+        size_t notNumber = a.jcc(A::C_E);
+        a.add(A::RAX, A::RAX);
+        branches.push_back({a.jcc(jumpIfTrue ? A::C_NE : A::C_E), size_t(target)});
+        size_t done = a.jmp();
+        a.bind(notNumber, a.here());
+        a.movImm64(A::RCX, Value::TRUE_BITS);
+        a.cmp(A::RAX, A::RCX);
+        branches.push_back({a.jcc(jumpIfTrue ? A::C_E : A::C_NE), size_t(target)});
+        a.bind(done, a.here());
+    }
+
+    void emit(const Instruction &ins, uint32_t pc)
+    {
+        switch (ins.op)
+        {
+        case OP_LDA_NULL:
+            a.movImm64(A::RAX, Value::NULL_BITS);
+            storeAcc(A::RAX);
+            break;
+        case OP_LDA_CONST:
+            a.movImm64(A::RAX, fn.constants[ins.a].bits);
+            storeAcc(A::RAX);
+            break;
+        case OP_LDAR:
+            a.load(A::RAX, A::RBX, slotOffset(ins.a));
+            storeAcc(A::RAX);
+            break;
+        case OP_STAR:
+            loadAcc(A::RAX);
+            a.store(A::RBX, slotOffset(ins.a), A::RAX);
+            break;
+        case OP_LDA_LOCAL:
+            a.load(A::RAX, A::R13, slotOffset(ins.a));
+            storeAcc(A::RAX);
+            break;
+        case OP_STA_LOCAL:
+            loadAcc(A::RAX);
+            a.store(A::R13, slotOffset(ins.a), A::RAX);
+            break;
+        case OP_LDA_CONTEXT:
+            contextSlot(ins);
+            a.load(A::RCX, A::RAX, 0);
+            storeAcc(A::RCX);
+            break;
+        case OP_STA_CONTEXT:
+            contextSlot(ins);
+            loadAcc(A::RCX);
+            a.store(A::RAX, 0, A::RCX);
+            break;
+        case OP_LDA_GLOBAL:
+            guardDefined(ins.a, pc);
+            a.load(A::RAX, A::R14, slotOffset(ins.a));
+            storeAcc(A::RAX);
+            break;
+        case OP_STA_GLOBAL:
+            guardDefined(ins.a, pc);
+            loadAcc(A::RAX);
+            a.store(A::R14, slotOffset(ins.a), A::RAX);
+            break;
+        case OP_DEF_GLOBAL:
+            loadAcc(A::RAX);
+            a.store(A::R14, slotOffset(ins.a), A::RAX);
+            a.storeByte(A::R15, ins.a, 1);
+            break;
+        case OP_ADD:
+            arithmetic(0x58, ins.a, pc);
+            break;
+        case OP_SUB:
+            arithmetic(0x5C, ins.a, pc);
+            break;
+        case OP_MUL:
+            arithmetic(0x59, ins.a, pc);
+            break;
+        case OP_DIV:
+            arithmetic(0x5E, ins.a, pc);
+            break;
+        case OP_GT:
+            loadOperands(ins.a, pc);
+            a.sse(0x66, 0x2E, 0, 1);
+            a.setcc(A::C_A, A::RAX); // False when unordered
+            storeBoolean();
+            break;
+        case OP_LT:
+            loadOperands(ins.a, pc);
+            a.sse(0x66, 0x2E, 1, 0);
+            a.setcc(A::C_A, A::RAX);
+            storeBoolean();
+            break;
+        case OP_GE:
+            loadOperands(ins.a, pc);
+            a.sse(0x66, 0x2E, 0, 1);
+            a.setcc(A::C_AE, A::RAX);
+            storeBoolean();
+            break;
+        case OP_LE:
+            loadOperands(ins.a, pc);
+            a.sse(0x66, 0x2E, 1, 0);
+            a.setcc(A::C_AE, A::RAX);
+            storeBoolean();
+            break;
+        case OP_EQ:
+            // Only the number case; strings and the rest deopt
+            loadOperands(ins.a, pc);
+            a.sse(0x66, 0x2E, 0, 1);
+            a.setcc(A::C_E, A::RAX);
+            a.setcc(A::C_NP, A::RCX);
+            a.andByte(A::RAX, A::RCX);
+            storeBoolean();
+            break;
+        case OP_NE:
+            loadOperands(ins.a, pc);
+            a.sse(0x66, 0x2E, 0, 1);
+            a.setcc(A::C_NE, A::RAX);
+            a.setcc(A::C_P, A::RCX);
+            a.orByte(A::RAX, A::RCX);
+            storeBoolean();
+            break;
+        case OP_NEGATE:
+            loadAcc(A::RAX);
+            a.movImm64(A::RDX, QNAN);
+            guardNumber(A::RAX, pc);
+            a.movImm64(A::RCX, 0x8000000000000000ULL);
+            a.xorr(A::RAX, A::RCX);
+            storeAcc(A::RAX);
+            break;
+        case OP_JUMP:
+            if ((uint32_t)ins.a <= pc)
+            {
+                // Loop back-edge: hand over to the interpreter's safepoint
+                // when the heap wants a collection
+                a.load(A::RAX, A::R12, offsetof(JitState, safepointPending));
+                a.loadByte(A::RAX, A::RAX, 0);
+                a.test(A::RAX, A::RAX);
+                exitIf(A::C_NE, pc);
+            }
+            branches.push_back({a.jmp(), size_t(ins.a)});
+            break;
+        case OP_JUMP_IF_FALSE:
+            branchOnTruthiness(false, ins.a);
+            break;
+        case OP_JUMP_IF_TRUE:
+            branchOnTruthiness(true, ins.a);
+            break;
+        default:
+            exitTo(pc); // Allocates, calls or may throw: the interpreter's job
+            break;
+        }
+    }
+
+public:
+    explicit JitCompiler(const BytecodeFunction &f) : fn(f) {}
+
+    // Machine code with the signature of JitCode::entry
+    vector<uint8_t> compile()
+    {
+        // Prologue: save callee-saved registers, keep the stack 16-byte
+        // aligned for the helper call (with Win64 shadow space) and load the
+        // pinned bases: r12 = state, rbx = regs, r13 = locals,
+        // r14 = global values, r15 = global defined flags
+        a.push(A::RBX);
+        a.push(A::R12);
+        a.push(A::R13);
+        a.push(A::R14);
+        a.push(A::R15);
+        a.adjustRsp(true, 32);
+#ifdef _WIN32
+        a.mov(A::R12, A::RCX);
+        a.mov32(A::RAX, A::RDX);
+#else
+        a.mov(A::R12, A::RDI);
+        a.mov32(A::RAX, A::RSI);
+#endif
+        a.load(A::RBX, A::R12, offsetof(JitState, regs));
+        a.load(A::R13, A::R12, offsetof(JitState, locals));
+        a.load(A::R14, A::R12, offsetof(JitState, globals));
+        a.load(A::R15, A::R12, offsetof(JitState, defined));
+
+        // Dispatch on the entry pc: lea rcx, [rip + table];
+        // movsxd rdx, [rcx + rax*4]; add rdx, rcx; jmp rdx
+        a.byte(0x48);
+        a.byte(0x8D);
+        a.byte(0x0D);
+        size_t tableRef = a.here();
+        a.u32(0);
+        a.byte(0x48);
+        a.byte(0x63);
+        a.byte(0x14);
+        a.byte(0x81);
+        a.add(A::RDX, A::RCX);
+        a.jmpReg(A::RDX);
+
+        for (size_t pc = 0; pc < fn.code.size(); ++pc)
+        {
+            labels.push_back(a.here());
+            emit(fn.code[pc], uint32_t(pc));
+        }
+        labels.push_back(a.here());
+        exitTo(uint32_t(fn.code.size())); // Never reached: scripts end in RETURN
+
+        for (auto &[at, code] : exits)
+        {
+            a.bind(at, a.here());
+            exitTo(code);
+        }
+
+        size_t epilogue = a.here();
+        a.adjustRsp(false, 32);
+        a.pop(A::R15);
+        a.pop(A::R14);
+        a.pop(A::R13);
+        a.pop(A::R12);
+        a.pop(A::RBX);
+        a.byte(0xC3); // ret
+
+        while (a.here() % 4)
+            a.byte(0xCC);
+        size_t table = a.here();
+        a.bind(tableRef, table);
+        for (size_t pc = 0; pc < fn.code.size(); ++pc)
+            a.u32(uint32_t(int32_t(labels[pc] - table)));
+
+        for (auto &[at, target] : branches)
+            a.bind(at, labels[target]);
+        for (size_t at : toEpilogue)
+            a.bind(at, epilogue);
+        return move(a.buf);
+    }
+};
+
+// Maps `bytes` as executable code; nullptr if the OS refuses
+static JitCode *installCode(const vector<uint8_t> &bytes)
+{
+    size_t size = bytes.size();
+#ifdef _WIN32
+    void *memory = VirtualAlloc(nullptr, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!memory)
+        return nullptr;
+    memcpy(memory, bytes.data(), size);
+    DWORD old;
+    if (!VirtualProtect(memory, size, PAGE_EXECUTE_READ, &old))
+    {
+        VirtualFree(memory, 0, MEM_RELEASE);
+        return nullptr;
+    }
+#else
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        return nullptr;
+    memcpy(memory, bytes.data(), size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, size);
+        return nullptr;
+    }
+#endif
+    auto code = new JitCode;
+    code->memory = memory;
+    code->size = size;
+    code->entry = reinterpret_cast<uint32_t (*)(JitState *, uint32_t)>(memory);
+    return code;
+}
+
+void jitCompile(BytecodeFunction &fn)
+{
+    vector<uint8_t> bytes = JitCompiler(fn).compile();
+    fn.jit.reset(installCode(bytes));
+    if (!fn.jit)
+        fn.jitDisabled = true;
+    if (traceJit)
+        cout << "[jit] " << (fn.jit ? "compiled " : "failed to map code for ") << fn.name << ": "
+             << fn.code.size() << " bytecodes -> " << bytes.size() << " bytes" << endl;
+}
+
+#else
+
+// No code generator for this target: everything stays interpreted
+void jitCompile(BytecodeFunction &fn) { fn.jitDisabled = true; }
+
+#endif
+
+// ==========================================
+// 11. EVENT LOOP (ASYNC SIMULATION)
+// ==========================================
+
+// Timers run on the monotonic clock so wall-clock adjustments can't fire
+// them early or stall them
+using TimerClock = chrono::steady_clock;
+
+struct Task
+{
+    TimerClock::time_point executeTime;
+    unsigned long long seq; // Scheduling order, so equal deadlines run FIFO
+    Value callback;         // Script function to run; traced as a GC root
+
+    // Min-heap comparator (smallest time first)
+    bool operator>(const Task &other) const
+    {
+        if (executeTime != other.executeTime)
+            return executeTime > other.executeTime;
+        return seq > other.seq;
+    }
+};
+
+// Pending setTimeout callbacks as a binary min-heap: O(log n) to schedule
+// or take the next timer, O(1) to find the next deadline
+class TimerQueue
+{
+    vector<Task> tasks;
+    unsigned long long nextSeq = 0;
+
+public:
+    bool empty() const { return tasks.empty(); }
+    size_t size() const { return tasks.size(); }
+    const vector<Task> &pending() const { return tasks; }
+
+    void schedule(double delayMs, Value callback)
+    {
+        auto delay = chrono::duration_cast<TimerClock::duration>(chrono::duration<double, milli>(max(delayMs, 0.0)));
+        tasks.push_back({TimerClock::now() + delay, nextSeq++, callback});
+        push_heap(tasks.begin(), tasks.end(), greater<Task>());
+    }
+
+    TimerClock::time_point nextDeadline() const { return tasks.front().executeTime; }
+
+    Task pop()
+    {
+        pop_heap(tasks.begin(), tasks.end(), greater<Task>());
+        Task t = tasks.back();
+        tasks.pop_back();
+        return t;
+    }
+};
+
+// A reaction whose promise has settled, and the value it settled with
+struct Microtask
+{
+    Reaction reaction;
+    Value value;
+};
+
+// Promise reactions, run FIFO once the current macrotask (the script or a
+// timer) finishes and before the next one starts, so everything a
+// settlement sets off happens before any timer fires
+class MicrotaskQueue
+{
+    deque<Microtask> jobs;
+
+public:
+    bool empty() const { return jobs.empty(); }
+    size_t size() const { return jobs.size(); }
+    const deque<Microtask> &pending() const { return jobs; }
+
+    void push(const Reaction &reaction, Value value) { jobs.push_back({reaction, value}); }
+
+    // The next job stays queued (and so traced) until it is finished with
+    const Microtask &front() const { return jobs.front(); }
+    void pop() { jobs.pop_front(); }
+};
+
+void subscribePromise(PromiseCell *promise, const Reaction &reaction)
+{
+    if (promise->settled)
+        currentMicrotasks().push(reaction, promise->result);
+    else
+        promise->reactions.push_back(reaction);
+}
+
+// A promise value is adopted rather than stored: this promise settles
+// with whatever that one settles with
+void resolvePromise(PromiseCell *promise, Value value)
+{
+    if (promise->settled)
+        return;
+    if (value.is(V_PROMISE))
+    {
+        if (value.asPromise() == promise)
+            throw runtime_error("A promise cannot be resolved with itself");
+        subscribePromise(value.asPromise(), {Value(), promise, nullptr});
+        return;
+    }
+    promise->settled = true;
+    promise->result = value;
+    for (auto &r : promise->reactions)
+        currentMicrotasks().push(r, value);
+    vector<Reaction>().swap(promise->reactions);
+}
+
+Value promiseThen(PromiseCell *promise, const Value &handler)
+{
+    auto derived = gcNew<PromiseCell>();
+    bool callable = handler.is(V_FUNC) || handler.is(V_NATIVE);
+    subscribePromise(promise, {callable ? handler : Value(), derived, nullptr});
+    return Value(derived);
+}
+
+// Awaiting a non-promise still suspends, and resumes with the value itself
+void awaitValue(const Value &value, AsyncFrame *frame)
+{
+    Reaction resume{Value(), nullptr, frame};
+    if (value.is(V_PROMISE))
+        subscribePromise(value.asPromise(), resume);
+    else
+        currentMicrotasks().push(resume, value);
+}
+
+// Milliseconds until `t`, rounded up so a wait never wakes just short of it
+inline int millisecondsUntil(TimerClock::time_point t)
+{
+    auto left = t - TimerClock::now();
+    if (left <= TimerClock::duration::zero())
+        return 0;
+    auto ms = chrono::ceil<chrono::milliseconds>(left).count();
+    return (int)min<decltype(ms)>(ms, INT32_MAX);
+}
+
+#ifdef HAVE_EPOLL
+
+// Sockets and file reads the event loop waits on alongside its timers.
+// Sockets are non-blocking and watched by one epoll set. Regular files
+// can't be (epoll refuses them), so file reads, and DNS lookups, run on a
+// helper thread that hands its results back through an eventfd in the same
+// set. Every completion is a macrotask on the loop thread: it settles a
+// promise, or for a listening socket calls the handler. There is no
+// rejection, so failures settle with null.
+class IoPoller
+{
+    enum OpKind
+    {
+        IO_ACCEPT,  // Listening socket; calls `handler` with each connection
+        IO_READ,    // Next chunk, or null at end of stream
+        IO_WRITE,   // All of `buffer`; settles with the byte count
+        IO_CONNECT, // Settles with the connected socket
+        IO_FETCH,   // HTTP GET over its own socket: connect, send, read to EOF
+        IO_FILE     // Whole file, read on the helper thread
+    };
+
+    struct Op
+    {
+        OpKind kind;
+        PromiseCell *promise = nullptr;
+        Value handler;
+        string buffer;           // Bytes to send, then (fetch) the response so far
+        size_t sent = 0;
+        bool connecting = false; // Waiting for a non-blocking connect()
+        bool paused = false;     // Accept: out of descriptors, unwatched until acceptRetryAt
+    };
+
+    // A descriptor's pending input and output sides, each at most one op
+    struct Watch
+    {
+        unique_ptr<Op> in, out;
+        uint32_t events = 0; // Currently registered with epoll
+    };
+
+    struct BlockingJob
+    {
+        uint64_t id;
+        function<bool(string &)> work; // Runs on the helper thread
+    };
+
+    struct Finished
+    {
+        uint64_t id;
+        bool ok;
+        string result;
+    };
+
+    static constexpr size_t kReadChunk = 64 * 1024;
+    static constexpr auto kAcceptRetry = chrono::milliseconds(100);
+
+    int epfd = -1;
+    int wakeFd = -1;
+    unordered_map<int, Watch> watches;
+    unordered_set<int> sockets; // Open sockets handed to scripts
+    TimerClock::time_point acceptRetryAt = TimerClock::time_point::max(); // When paused accepts resume
+
+    // The helper thread, started on first use
+    thread helper;
+    mutex jobLock; // Guards jobs, finished and stopping
+    condition_variable jobReady;
+    deque<BlockingJob> jobs;
+    vector<Finished> finished;
+    bool stopping = false;
+    uint64_t nextJobId = 0;
+    unordered_map<uint64_t, unique_ptr<Op>> waiting; // Loop side of each blocking job
+
+    void open()
+    {
+        if (epfd >= 0)
+            return;
+        epfd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epfd < 0 || wakeFd < 0)
+            throw runtime_error(string("Cannot start the I/O poller: ") + strerror(errno));
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.fd = wakeFd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    // Register interest in exactly what the fd's pending ops need
+    void update(int fd)
+    {
+        auto it = watches.find(fd);
+        if (it == watches.end())
+            return;
+        Watch &w = it->second;
+        bool reading = w.in && !w.in->paused;
+        uint32_t want = (reading ? (uint32_t)(EPOLLIN | EPOLLRDHUP) : 0u) | (w.out ? (uint32_t)EPOLLOUT : 0u);
+        bool idle = !w.in && !w.out; // A paused accept keeps its entry
+        if (want != w.events)
+        {
+            epoll_event ev{};
+            ev.events = want;
+            ev.data.fd = fd;
+            epoll_ctl(epfd, !w.events ? EPOLL_CTL_ADD : want ? EPOLL_CTL_MOD : EPOLL_CTL_DEL, fd, &ev);
+            w.events = want;
+        }
+        if (idle)
+            watches.erase(it);
+    }
+
+    // The listener stays readable while accept() fails for want of
+    // descriptors, so stop watching it for a while rather than spin
+    void pauseAccept(int fd, Op &op)
+    {
+        op.paused = true;
+        acceptRetryAt = min(acceptRetryAt, TimerClock::now() + kAcceptRetry);
+        update(fd);
+    }
+
+    void resumeAccepts()
+    {
+        acceptRetryAt = TimerClock::time_point::max();
+        vector<int> paused;
+        for (auto &[fd, w] : watches)
+            if (w.in && w.in->paused)
+                paused.push_back(fd);
+        for (int fd : paused)
+        {
+            watches[fd].in->paused = false;
+            update(fd);
+        }
+    }
+
+    unique_ptr<Op> &slot(int fd, bool output)
+    {
+        unique_ptr<Op> &side = output ? watches[fd].out : watches[fd].in;
+        if (side)
+            throw runtime_error(string("Socket already has a ") + (output ? "write" : "read") + " pending");
+        return side;
+    }
+
+    static unique_ptr<Op> newOp(OpKind kind)
+    {
+        auto op = make_unique<Op>();
+        op->kind = kind;
+        op->promise = gcNew<PromiseCell>();
+        return op;
+    }
+
+    void runBlocking(unique_ptr<Op> op, function<bool(string &)> work)
+    {
+        open();
+        uint64_t id = nextJobId++;
+        waiting[id] = move(op);
+        {
+            lock_guard<mutex> lock(jobLock);
+            jobs.push_back({id, move(work)});
+        }
+        jobReady.notify_one();
+        if (!helper.joinable())
+            helper = thread([this] { helperLoop(); });
+    }
+
+    void helperLoop()
+    {
+        unique_lock<mutex> lock(jobLock);
+        while (true)
+        {
+            jobReady.wait(lock, [this] { return stopping || !jobs.empty(); });
+            if (stopping)
+                return;
+            BlockingJob job = move(jobs.front());
+            jobs.pop_front();
+            lock.unlock();
+            string result;
+            bool ok = job.work(result);
+            lock.lock();
+            finished.push_back({job.id, ok, move(result)});
+            uint64_t one = 1;
+            ssize_t ignored = ::write(wakeFd, &one, sizeof one); // Only fails if the counter is saturated
+            (void)ignored;
+        }
+    }
+
+    // Start a non-blocking connect for `op` to the address a lookup produced
+    void startConnect(unique_ptr<Op> op, const string &address)
+    {
+        auto addr = (const sockaddr *)address.data();
+        int fd = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0 || (::connect(fd, addr, (socklen_t)address.size()) < 0 && errno != EINPROGRESS))
+        {
+            if (fd >= 0)
+                ::close(fd);
+            resolvePromise(op->promise, Value());
+            return;
+        }
+        op->connecting = true;
+        sockets.insert(fd);
+        watches[fd].out = move(op);
+        update(fd);
+    }
+
+    // Settle an op on `fd` and drop it; `closeFd` for ops that own the socket
+    void complete(int fd, unique_ptr<Op> &side, Value result, bool closeFd = false)
+    {
+        unique_ptr<Op> op = move(side);
+        update(fd);
+        if (closeFd)
+            close(fd);
+        resolvePromise(op->promise, result);
+    }
+
+    // HTTP/1.0, so the body is never chunked and ends with the connection.
+    // Bare LF line ends are accepted too; script strings have no escapes.
+    static Value parseResponse(const string &response)
+    {
+        size_t lineEnd = response.find('\n');
+        size_t headersEnd = response.find("\r\n\r\n"), separator = 4;
+        if (response.find("\n\n") < headersEnd)
+            headersEnd = response.find("\n\n"), separator = 2;
+        if (response.compare(0, 5, "HTTP/") != 0 || headersEnd == string::npos)
+            return Value();
+        size_t space = response.find(' ');
+        int status = 0;
+        if (space < lineEnd)
+            from_chars(response.data() + space + 1, response.data() + lineEnd, status);
+        ObjectLiteral layout({"status", "body"});
+        Value fields[] = {Value::number(status), makeString(response.substr(headersEnd + separator))};
+        return layout.instantiate(fields);
+    }
+
+    void onWritable(int fd)
+    {
+        unique_ptr<Op> &side = watches[fd].out;
+        Op &op = *side;
+        if (op.connecting)
+        {
+            int err = 0;
+            socklen_t len = sizeof err;
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err)
+                return complete(fd, side, Value(), true);
+            op.connecting = false;
+            if (op.kind == IO_CONNECT)
+                return complete(fd, side, Value::number(fd));
+        }
+        while (op.sent < op.buffer.size())
+        {
+            ssize_t n = send(fd, op.buffer.data() + op.sent, op.buffer.size() - op.sent, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+            if (n < 0)
+                return complete(fd, side, Value(), op.kind == IO_FETCH);
+            op.sent += n;
+        }
+        if (op.kind == IO_WRITE)
+            return complete(fd, side, Value::number((double)op.sent));
+
+        // A fetch has sent its request; the response is read to EOF
+        op.buffer.clear();
+        watches[fd].in = move(side);
+        update(fd);
+    }
+
+    void onReadable(int fd)
+    {
+        unique_ptr<Op> &side = watches[fd].in;
+        Op &op = *side;
+        char chunk[kReadChunk];
+        if (op.kind == IO_ACCEPT)
+        {
+            // The handler may close the listener, so accept the whole
+            // backlog first and look the op up again before every call
+            vector<int> accepted;
+            while (true)
+            {
+                int conn = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (conn >= 0)
+                    accepted.push_back(conn);
+                else if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                else
+                {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK)
+                        pauseAccept(fd, op); // EMFILE, ENFILE and the like
+                    break;
+                }
+            }
+            size_t next = 0;
+            try
+            {
+                while (next < accepted.size())
+                {
+                    int c = accepted[next++];
+                    auto it = watches.find(fd);
+                    if (it == watches.end() || !it->second.in)
+                    {
+                        ::close(c); // Never handed to the script
+                        continue;
+                    }
+                    sockets.insert(c);
+                    Value handler = it->second.in->handler;
+                    callFunction(handler, {Value::number(c)});
+                }
+            }
+            catch (...)
+            {
+                for (; next < accepted.size(); ++next)
+                    ::close(accepted[next]);
+                throw;
+            }
+            return;
+        }
+        while (true)
+        {
+            ssize_t n = recv(fd, chunk, sizeof chunk, 0);
+            if (n < 0 && (errno == EAGAIN || errno == EINTR))
+                return;
+            if (op.kind == IO_READ)
+                return complete(fd, side, n > 0 ? makeString(string(chunk, n)) : Value());
+            if (n <= 0)
+                return complete(fd, side, n == 0 ? parseResponse(op.buffer) : Value(), true);
+            op.buffer.append(chunk, n);
+        }
+    }
+
+    void onHelperDone()
+    {
+        uint64_t count;
+        while (::read(wakeFd, &count, sizeof count) > 0)
+            ;
+        vector<Finished> done;
+        {
+            lock_guard<mutex> lock(jobLock);
+            done.swap(finished);
+        }
+        for (auto &f : done)
+        {
+            unique_ptr<Op> op = move(waiting[f.id]);
+            waiting.erase(f.id);
+            if (!f.ok)
+                resolvePromise(op->promise, Value());
+            else if (op->kind == IO_FILE)
+                resolvePromise(op->promise, makeString(move(f.result)));
+            else
+                startConnect(move(op), f.result);
+        }
+    }
+
+    static function<bool(string &)> lookup(string host, string port)
+    {
+        return [host = move(host), port = move(port)](string &address)
+        {
+            addrinfo hints{}, *found = nullptr;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0 || !found)
+                return false;
+            address.assign((const char *)found->ai_addr, found->ai_addrlen);
+            freeaddrinfo(found);
+            return true;
+        };
+    }
+
+    Value connectTo(unique_ptr<Op> op, string host, int port)
+    {
+        Value promise(op->promise);
+        runBlocking(move(op), lookup(move(host), to_string(port)));
+        return promise;
+    }
+
+    void checkSocket(int fd) const
+    {
+        if (!sockets.count(fd))
+            throw runtime_error("Not an open socket: " + to_string(fd));
+    }
+
+public:
+    IoPoller() = default;
+    IoPoller(const IoPoller &) = delete;
+    IoPoller &operator=(const IoPoller &) = delete;
+
+    ~IoPoller()
+    {
+        if (helper.joinable())
+        {
+            {
+                lock_guard<mutex> lock(jobLock);
+                stopping = true;
+            }
+            jobReady.notify_one();
+            helper.join();
+        }
+        for (int fd : sockets)
+            ::close(fd);
+        if (epfd >= 0)
+        {
+            ::close(epfd);
+            ::close(wakeFd);
+        }
+    }
+
+    // Anything still to complete keeps the event loop running. Idle open
+    // sockets don't; a listening one always has its accept pending.
+    bool active() const { return !watches.empty() || !waiting.empty(); }
+
+    // Wait up to `timeoutMs` (-1: no limit) and run whatever completed,
+    // calling `afterTask` after each completion
+    void poll(int timeoutMs, const function<void()> &afterTask)
+    {
+        if (acceptRetryAt != TimerClock::time_point::max())
+        {
+            int retryMs = millisecondsUntil(acceptRetryAt);
+            if (timeoutMs < 0 || retryMs < timeoutMs)
+                timeoutMs = retryMs;
+        }
+        epoll_event events[256];
+        int n = epoll_wait(epfd, events, 256, timeoutMs);
+        if (TimerClock::now() >= acceptRetryAt)
+            resumeAccepts();
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == wakeFd)
+            {
+                onHelperDone();
+                afterTask();
+                continue;
+            }
+            // Hangups and errors surface through the read or write itself
+            bool readable = events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+            bool writable = events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR);
+            auto it = watches.find(fd);
+            if (it != watches.end() && it->second.out && writable)
+            {
+                onWritable(fd);
+                afterTask();
+            }
+            it = watches.find(fd);
+            if (it != watches.end() && it->second.in && readable)
+            {
+                onReadable(fd);
+                afterTask();
+            }
+        }
+    }
+
+    void markRoots(Heap &heap)
+    {
+        auto markOp = [&](const unique_ptr<Op> &op)
+        {
+            if (op)
+            {
+                heap.mark(op->promise);
+                heap.mark(op->handler);
+            }
+        };
+        for (auto &[fd, w] : watches)
+        {
+            markOp(w.in);
+            markOp(w.out);
+        }
+        for (auto &[id, op] : waiting)
+            markOp(op);
+    }
+
+    Value readFile(string path)
+    {
+        unique_ptr<Op> op = newOp(IO_FILE);
+        Value promise(op->promise);
+        runBlocking(move(op), [path = move(path)](string &contents)
+        {
+            ifstream in(path, ios::binary);
+            if (!in)
+                return false;
+            contents.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+            return true;
+        });
+        return promise;
+    }
+
+    // Dual-stack where IPv6 exists, so "localhost" reaches it either way
+    int listen(int port, const Value &handler)
+    {
+        open();
+        int on = 1, off = 0;
+        int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        sockaddr_storage addr{};
+        socklen_t addrLen;
+        if (fd >= 0)
+        {
+            auto v6 = (sockaddr_in6 *)&addr;
+            v6->sin6_family = AF_INET6;
+            v6->sin6_port = htons((uint16_t)port);
+            v6->sin6_addr = in6addr_any;
+            addrLen = sizeof *v6;
+            setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof off);
+        }
+        else
+        {
+            fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            auto v4 = (sockaddr_in *)&addr;
+            v4->sin_family = AF_INET;
+            v4->sin_port = htons((uint16_t)port);
+            v4->sin_addr.s_addr = htonl(INADDR_ANY);
+            addrLen = sizeof *v4;
+        }
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) < 0 ||
+            bind(fd, (sockaddr *)&addr, addrLen) < 0 || ::listen(fd, SOMAXCONN) < 0)
+        {
+            string reason = strerror(errno);
+            if (fd >= 0)
+                ::close(fd);
+            throw runtime_error("Cannot listen on port " + to_string(port) + ": " + reason);
+        }
+        sockets.insert(fd);
+        auto op = make_unique<Op>();
+        op->kind = IO_ACCEPT;
+        op->handler = handler;
+        watches[fd].in = move(op);
+        update(fd);
+        return fd;
+    }
+
+    Value connect(string host, int port) { return connectTo(newOp(IO_CONNECT), move(host), port); }
+
+    // http://host[:port]/path
+    Value fetch(const string &url)
+    {
+        const string scheme = "http://";
+        if (url.compare(0, scheme.size(), scheme) != 0)
+            throw runtime_error("fetch only supports http:// URLs: " + url);
+        size_t hostStart = scheme.size();
+        size_t pathStart = min(url.find('/', hostStart), url.size());
+        string authority = url.substr(hostStart, pathStart - hostStart);
+        string path = pathStart < url.size() ? url.substr(pathStart) : "/";
+        string host = authority;
+        int port = 80;
+        size_t colon = authority.rfind(':');
+        if (colon != string::npos)
+        {
+            host = authority.substr(0, colon);
+            port = atoi(authority.c_str() + colon + 1);
+        }
+        unique_ptr<Op> op = newOp(IO_FETCH);
+        op->buffer = "GET " + path + " HTTP/1.0\r\nHost: " + authority + "\r\nConnection: close\r\n\r\n";
+        return connectTo(move(op), host, port);
+    }
+
+    Value read(int fd)
+    {
+        checkSocket(fd);
+        open();
+        unique_ptr<Op> &side = slot(fd, false);
+        side = newOp(IO_READ);
+        Value promise(side->promise);
+        update(fd);
+        return promise;
+    }
+
+    Value write(int fd, string data)
+    {
+        checkSocket(fd);
+        open();
+        unique_ptr<Op> &side = slot(fd, true);
+        side = newOp(IO_WRITE);
+        side->buffer = move(data);
+        Value promise(side->promise);
+        update(fd);
+        return promise;
+    }
+
+    // Pending reads and writes on the socket settle with null
+    void close(int fd)
+    {
+        checkSocket(fd);
+        auto it = watches.find(fd);
+        if (it != watches.end())
+        {
+            Watch w = move(it->second);
+            watches.erase(it);
+            if (w.events)
+                epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+            for (Op *op : {w.in.get(), w.out.get()})
+                if (op && op->promise)
+                    resolvePromise(op->promise, Value());
+        }
+        sockets.erase(fd);
+        ::close(fd);
+    }
+};
+
+#else
+
+// No epoll on this target: the loop only has timers to wait on
+class IoPoller
+{
+public:
+    bool active() const { return false; }
+    void poll(int, const function<void()> &) {}
+    void markRoots(Heap &) {}
+};
+
+#endif
+
+// ==========================================
+// 12. NATIVE ARRAY KERNELS (SIMD)
+// ==========================================
+
+// Kernels behind the sum/dot/scale/minmax natives. AVX2 is chosen at run
+// time on x86-64; NEON is part of the AArch64 baseline so it is chosen at
+// compile time. Vector sums add in a different order than the scalar loop,
+// so results can differ in the last bits.
+struct ArrayKernels
+{
+    const char *name;
+    double (*sum)(const double *, size_t);
+    double (*sumSmi)(const int32_t *, size_t);
+    double (*dot)(const double *, const double *, size_t);
+    void (*scale)(const double *, double, double *, size_t);
+    void (*minmax)(const double *, size_t, double &, double &); // n > 0
+    void (*minmaxSmi)(const int32_t *, size_t, int32_t &, int32_t &); // n > 0
+};
+
+bool disableSimd = false; // --no-simd: force the scalar kernels
+
+double sumScalar(const double *p, size_t n)
+{
+    double s = 0;
+    for (size_t i = 0; i < n; ++i)
+        s += p[i];
+    return s;
+}
+
+double sumSmiScalar(const int32_t *p, size_t n)
+{
+    double s = 0;
+    for (size_t i = 0; i < n; ++i)
+        s += p[i];
+    return s;
+}
+
+double dotScalar(const double *a, const double *b, size_t n)
+{
+    double s = 0;
+    for (size_t i = 0; i < n; ++i)
+        s += a[i] * b[i];
+    return s;
+}
+
+void scaleScalar(const double *p, double k, double *out, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+        out[i] = p[i] * k;
+}
+
+template <class T>
+void minmaxScalar(const T *p, size_t n, T &lo, T &hi)
+{
+    lo = hi = p[0];
+    for (size_t i = 1; i < n; ++i)
+    {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+}
+
+const ArrayKernels scalarKernels = {"scalar", sumScalar, sumSmiScalar, dotScalar, scaleScalar,
+                                    minmaxScalar<double>, minmaxScalar<int32_t>};
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_AVX2_KERNELS 1
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+AVX2_TARGET double horizontalSum(__m256d v)
+{
+    __m128d lo = _mm256_castpd256_pd128(v), hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+AVX2_TARGET double sumAvx2(const double *p, size_t n)
+{
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        a0 = _mm256_add_pd(a0, _mm256_loadu_pd(p + i));
+        a1 = _mm256_add_pd(a1, _mm256_loadu_pd(p + i + 4));
+    }
+    double s = horizontalSum(_mm256_add_pd(a0, a1));
+    for (; i < n; ++i)
+        s += p[i];
+    return s;
+}
+
+AVX2_TARGET double sumSmiAvx2(const int32_t *p, size_t n)
+{
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        a0 = _mm256_add_pd(a0, _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(p + i))));
+        a1 = _mm256_add_pd(a1, _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)(p + i + 4))));
+    }
+    double s = horizontalSum(_mm256_add_pd(a0, a1));
+    for (; i < n; ++i)
+        s += p[i];
+    return s;
+}
+
+AVX2_TARGET double dotAvx2(const double *a, const double *b, size_t n)
+{
+    __m256d a0 = _mm256_setzero_pd(), a1 = _mm256_setzero_pd();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        a0 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i), a0);
+        a1 = _mm256_fmadd_pd(_mm256_loadu_pd(a + i + 4), _mm256_loadu_pd(b + i + 4), a1);
+    }
+    double s = horizontalSum(_mm256_add_pd(a0, a1));
+    for (; i < n; ++i)
+        s += a[i] * b[i];
+    return s;
+}
+
+AVX2_TARGET void scaleAvx2(const double *p, double k, double *out, size_t n)
+{
+    __m256d kv = _mm256_set1_pd(k);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm256_storeu_pd(out + i, _mm256_mul_pd(_mm256_loadu_pd(p + i), kv));
+    for (; i < n; ++i)
+        out[i] = p[i] * k;
+}
+
+AVX2_TARGET void minmaxAvx2(const double *p, size_t n, double &lo, double &hi)
+{
+    size_t i = 0;
+    lo = hi = p[0];
+    if (n >= 4)
+    {
+        __m256d vlo = _mm256_loadu_pd(p), vhi = vlo;
+        for (i = 4; i + 4 <= n; i += 4)
+        {
+            __m256d v = _mm256_loadu_pd(p + i);
+            vlo = _mm256_min_pd(vlo, v);
+            vhi = _mm256_max_pd(vhi, v);
+        }
+        double l[4], h[4];
+        _mm256_storeu_pd(l, vlo);
+        _mm256_storeu_pd(h, vhi);
+        minmaxScalar(l, 4, lo, hi);
+        double ignored;
+        minmaxScalar(h, 4, ignored, hi);
+    }
+    for (; i < n; ++i)
+    {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+}
+
+AVX2_TARGET void minmaxSmiAvx2(const int32_t *p, size_t n, int32_t &lo, int32_t &hi)
+{
+    size_t i = 0;
+    lo = hi = p[0];
+    if (n >= 8)
+    {
+        __m256i vlo = _mm256_loadu_si256((const __m256i *)p), vhi = vlo;
+        for (i = 8; i + 8 <= n; i += 8)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+            vlo = _mm256_min_epi32(vlo, v);
+            vhi = _mm256_max_epi32(vhi, v);
+        }
+        int32_t l[8], h[8];
+        _mm256_storeu_si256((__m256i *)l, vlo);
+        _mm256_storeu_si256((__m256i *)h, vhi);
+        minmaxScalar(l, 8, lo, hi);
+        int32_t ignored;
+        minmaxScalar(h, 8, ignored, hi);
+    }
+    for (; i < n; ++i)
+    {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+}
+
+const ArrayKernels avx2Kernels = {"avx2", sumAvx2, sumSmiAvx2, dotAvx2, scaleAvx2, minmaxAvx2, minmaxSmiAvx2};
+#endif
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define HAVE_NEON_KERNELS 1
+
+double sumNeon(const double *p, size_t n)
+{
+    float64x2_t a0 = vdupq_n_f64(0), a1 = vdupq_n_f64(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        a0 = vaddq_f64(a0, vld1q_f64(p + i));
+        a1 = vaddq_f64(a1, vld1q_f64(p + i + 2));
+    }
+    double s = vaddvq_f64(vaddq_f64(a0, a1));
+    for (; i < n; ++i)
+        s += p[i];
+    return s;
+}
+
+double sumSmiNeon(const int32_t *p, size_t n)
+{
+    float64x2_t a0 = vdupq_n_f64(0), a1 = vdupq_n_f64(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        int32x4_t v = vld1q_s32(p + i);
+        a0 = vaddq_f64(a0, vcvtq_f64_s64(vmovl_s32(vget_low_s32(v))));
+        a1 = vaddq_f64(a1, vcvtq_f64_s64(vmovl_s32(vget_high_s32(v))));
+    }
+    double s = vaddvq_f64(vaddq_f64(a0, a1));
+    for (; i < n; ++i)
+        s += p[i];
+    return s;
+}
+
+double dotNeon(const double *a, const double *b, size_t n)
+{
+    float64x2_t a0 = vdupq_n_f64(0), a1 = vdupq_n_f64(0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        a0 = vfmaq_f64(a0, vld1q_f64(a + i), vld1q_f64(b + i));
+        a1 = vfmaq_f64(a1, vld1q_f64(a + i + 2), vld1q_f64(b + i + 2));
+    }
+    double s = vaddvq_f64(vaddq_f64(a0, a1));
+    for (; i < n; ++i)
+        s += a[i] * b[i];
+    return s;
+}
+
+void scaleNeon(const double *p, double k, double *out, size_t n)
+{
+    float64x2_t kv = vdupq_n_f64(k);
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+        vst1q_f64(out + i, vmulq_f64(vld1q_f64(p + i), kv));
+    for (; i < n; ++i)
+        out[i] = p[i] * k;
+}
+
+void minmaxNeon(const double *p, size_t n, double &lo, double &hi)
+{
+    size_t i = 0;
+    lo = hi = p[0];
+    if (n >= 2)
+    {
+        float64x2_t vlo = vld1q_f64(p), vhi = vlo;
+        for (i = 2; i + 2 <= n; i += 2)
+        {
+            float64x2_t v = vld1q_f64(p + i);
+            vlo = vminq_f64(vlo, v);
+            vhi = vmaxq_f64(vhi, v);
+        }
+        lo = vminvq_f64(vlo);
+        hi = vmaxvq_f64(vhi);
+    }
+    for (; i < n; ++i)
+    {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+}
+
+void minmaxSmiNeon(const int32_t *p, size_t n, int32_t &lo, int32_t &hi)
+{
+    size_t i = 0;
+    lo = hi = p[0];
+    if (n >= 4)
+    {
+        int32x4_t vlo = vld1q_s32(p), vhi = vlo;
+        for (i = 4; i + 4 <= n; i += 4)
+        {
+            int32x4_t v = vld1q_s32(p + i);
+            vlo = vminq_s32(vlo, v);
+            vhi = vmaxq_s32(vhi, v);
+        }
+        lo = vminvq_s32(vlo);
+        hi = vmaxvq_s32(vhi);
+    }
+    for (; i < n; ++i)
+    {
+        lo = p[i] < lo ? p[i] : lo;
+        hi = p[i] > hi ? p[i] : hi;
+    }
+}
+
+const ArrayKernels neonKernels = {"neon", sumNeon, sumSmiNeon, dotNeon, scaleNeon, minmaxNeon, minmaxSmiNeon};
+#endif
+
+// Picked once, on first use
+const ArrayKernels &arrayKernels()
+{
+    static const ArrayKernels *chosen = []
+    {
+        if (disableSimd)
+            return &scalarKernels;
+#ifdef HAVE_AVX2_KERNELS
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+            return &avx2Kernels;
+#endif
+#ifdef HAVE_NEON_KERNELS
+        return &neonKernels;
+#endif
+        return &scalarKernels;
+    }();
+    return *chosen;
+}
+
+// An array's elements as doubles: the buffer itself for PACKED_DOUBLE,
+// otherwise a widened copy
+struct DoubleView
+{
+    const double *data = nullptr;
+    size_t size = 0;
+    vector<double> scratch;
+
+    explicit DoubleView(const ListCell *list) : size(list->length)
+    {
+        if (list->kind == PACKED_DOUBLE)
+        {
+            data = list->doubles();
+            return;
+        }
+        scratch.resize(size);
+        for (size_t i = 0; i < size; ++i)
+            scratch[i] = list->kind == PACKED_SMI ? list->smis()[i] : list->values()[i].num();
+        data = scratch.data();
+    }
+};
+
+ListCell *expectArray(Args args, size_t i, const char *fn)
+{
+    if (i >= args.size() || !args[i].is(V_LIST))
+        throw runtime_error(string(fn) + ": argument " + to_string(i + 1) + " must be an array");
+    return args[i].asList();
+}
+
+// sum(arr)
+Value nativeSum(Args args)
+{
+    ListCell *list = expectArray(args, 0, "sum");
+    if (list->kind == PACKED_SMI)
+        return Value::number(arrayKernels().sumSmi(list->smis(), list->length));
+    DoubleView v(list);
+    return Value::number(arrayKernels().sum(v.data, v.size));
+}
+
+// dot(a, b)
+Value nativeDot(Args args)
+{
+    ListCell *a = expectArray(args, 0, "dot"), *b = expectArray(args, 1, "dot");
+    if (a->length != b->length)
+        throw runtime_error("dot: arrays differ in length");
+    DoubleView va(a), vb(b);
+    return Value::number(arrayKernels().dot(va.data, vb.data, va.size));
+}
+
+// scale(arr, k) -> new array of arr[i] * k
+Value nativeScale(Args args)
+{
+    ListCell *list = expectArray(args, 0, "scale");
+    double k = args.size() > 1 ? args[1].num() : 1;
+    DoubleView v(list);
+    ListCell *out = gcNew<ListCell>();
+    Value result(out);
+    arrayKernels().scale(v.data, k, out->allocateDoubles((uint32_t)v.size), v.size);
+    return result;
+}
+
+// minmax(arr) -> {min, max}; both null for an empty array
+Value nativeMinmax(Args args)
+{
+    ListCell *list = expectArray(args, 0, "minmax");
+    Value fields[2];
+    if (list->length && list->kind == PACKED_SMI)
+    {
+        int32_t lo, hi;
+        arrayKernels().minmaxSmi(list->smis(), list->length, lo, hi);
+        fields[0] = Value::number(lo);
+        fields[1] = Value::number(hi);
+    }
+    else if (list->length)
+    {
+        DoubleView v(list);
+        double lo, hi;
+        arrayKernels().minmax(v.data, v.size, lo, hi);
+        fields[0] = Value::number(lo);
+        fields[1] = Value::number(hi);
+    }
+    ObjectLiteral layout({"min", "max"});
+    return layout.instantiate(fields);
+}
+
+// ==========================================
+// 13. CODE CACHE & STARTUP SNAPSHOTS
+// ==========================================
+
+// --code-cache DIR: the bytecode of each script is written to DIR, keyed by
+// a hash of its source, and later runs map the file instead of parsing.
+// Shapes and interned strings belong to an isolate, so the file stores text
+// and names; global slots are stored as the table they were resolved
+// against, and a load only succeeds if this isolate hands out the same slots.
+string codeCacheDir;
+bool traceCodeCache = false; // --trace-code-cache
+
+constexpr uint32_t kCodeCacheMagic = 0x43385653; // "SV8C"
+constexpr uint32_t kCodeCacheVersion = 3;        // Bump whenever the bytecode or this layout changes
+
+static_assert(is_trivially_copyable<Instruction>::value, "Instructions are copied to and from the file as bytes");
+
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull)
+{
+    auto p = (const uint8_t *)data;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= p[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+struct CodeCacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sourceHash;  // Also covers the flags that change the bytecode
+    uint64_t payloadHash; // Rejects truncated or damaged files
+    uint64_t payloadSize;
+};
+
+// Everything after the header is little-endian u32 fields, padded so each
+// instruction array starts 4-byte aligned and can be copied out in one block.
+// Strings are stored once, in a table at the front, and referenced by index.
+class CodeCacheWriter
+{
+    string body;
+    vector<string> strings;
+    unordered_map<string, uint32_t> stringIndex;
+
+    void u32(string &out, uint32_t v) { out.append((const char *)&v, sizeof v); }
+
+public:
+    void u32(uint32_t v) { u32(body, v); }
+    void f64(double d) { body.append((const char *)&d, sizeof d); }
+
+    void str(const string &text)
+    {
+        auto it = stringIndex.find(text);
+        if (it == stringIndex.end())
+        {
+            it = stringIndex.emplace(text, (uint32_t)strings.size()).first;
+            strings.push_back(text);
+        }
+        u32(it->second);
+    }
+
+    // False if the function holds a constant the file can't represent
+    bool function(const BytecodeFunction &fn)
+    {
+        if (!functionFields(fn))
+            return false;
+        u32((uint32_t)fn.functions.size());
+        for (auto &inner : fn.functions)
+        {
+            if (!function(*inner))
+                return false;
+        }
+        return true;
+    }
+
+    // Everything but the nested functions, which callers store their own way
+    bool functionFields(const BytecodeFunction &fn)
+    {
+        str(fn.name);
+        u32((uint32_t)fn.params.size());
+        for (auto &p : fn.params)
+            str(p);
+        u32((uint32_t)fn.registerCount);
+        u32((uint32_t)fn.slotCount);
+        u32(fn.localsInRegisters);
+        u32(fn.isAsync);
+        u32((uint32_t)fn.line);
+        u32((uint32_t)fn.col);
+
+        u32((uint32_t)fn.code.size());
+        for (auto &ins : fn.code)
+        {
+            Instruction record;
+            memset(static_cast<void *>(&record), 0, sizeof record); // Padding bytes too, so the file is reproducible
+            record.op = ins.op;
+            record.a = ins.a;
+            record.b = ins.b;
+            record.c = ins.c;
+            body.append((const char *)&record, sizeof record);
+        }
+
+        u32((uint32_t)fn.positions.size());
+        for (auto &pos : fn.positions)
+        {
+            u32(pos.pc);
+            u32((uint32_t)pos.line);
+            u32((uint32_t)pos.col);
+        }
+
+        u32((uint32_t)fn.constants.size());
+        for (auto &v : fn.constants)
+        {
+            if (v.isNumber())
+            {
+                u32(0);
+                f64(v.asNumber());
+            }
+            else if (v.is(V_STR))
+            {
+                u32(1);
+                str(v.asString()->flat());
+            }
+            else if (v.isNull() || v.isBool())
+                u32(v.isNull() ? 2 : v.asBool() ? 4 : 3);
+            else
+                return false;
+        }
+
+        u32((uint32_t)fn.names.size());
+        for (auto &n : fn.names)
+            str(n);
+
+        u32((uint32_t)fn.literals.size());
+        for (auto &lit : fn.literals)
+        {
+            u32((uint32_t)lit.slotOf.size());
+            for (int slot : lit.slotOf)
+                str(lit.shape->keys[slot]->value);
+        }
+
+        u32((uint32_t)fn.caches.size());
+        return true;
+    }
+
+    void globals(const GlobalScope &g)
+    {
+        u32((uint32_t)g.size());
+        for (size_t i = 0; i < g.size(); ++i)
+            str(g.nameOf((int)i));
+    }
+
+    // Just these names, as slots 0, 1, ...
+    void globals(const vector<string> &names)
+    {
+        u32((uint32_t)names.size());
+        for (auto &name : names)
+            str(name);
+    }
+
+    // Header, string table, then the body in the order it was written
+    string finish(uint64_t sourceHash, uint32_t magic = kCodeCacheMagic)
+    {
+        string payload;
+        u32(payload, (uint32_t)strings.size());
+        for (auto &text : strings)
+        {
+            u32(payload, (uint32_t)text.size());
+            payload += text;
+            payload.append((4 - text.size() % 4) % 4, '\0');
+        }
+        payload += body;
+
+        CodeCacheHeader header{magic, kCodeCacheVersion, sourceHash,
+                               fnv1a(payload.data(), payload.size()), payload.size()};
+        return string((const char *)&header, sizeof header) + payload;
+    }
+};
+
+// A read-only view of a whole file; empty if it can't be opened
+class MappedFile
+{
+    const uint8_t *base = nullptr;
+    size_t length = 0;
+    bool opened = false; // Even an empty file opens, though nothing is mapped
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+
+public:
+    explicit MappedFile(const string &path)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 0, nullptr);
+        LARGE_INTEGER size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size))
+            return;
+        opened = true;
+        if (size.QuadPart == 0)
+            return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            base = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        length = base ? (size_t)size.QuadPart : 0;
+        opened = base != nullptr;
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) == 0)
+        {
+            opened = st.st_size == 0;
+            void *p = opened ? MAP_FAILED : mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                base = (const uint8_t *)p;
+                length = (size_t)st.st_size;
+                opened = true;
+            }
+        }
+        close(fd); // The mapping keeps the file alive
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (base)
+            UnmapViewOfFile(base);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (base)
+            munmap((void *)base, length);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool isOpen() const { return opened; }
+    const uint8_t *data() const { return base; }
+    size_t size() const { return length; }
+    string_view text() const { return string_view((const char *)base, length); }
+};
+
+// Rebuilds functions straight from the mapping: strings are views into it
+// until they are interned, and instruction arrays are copied out whole.
+// Any inconsistency throws, which the caller treats as a cache miss.
+class CodeCacheReader
+{
+    const uint8_t *p;
+    const uint8_t *end;
+    vector<string_view> strings;
+
+    const uint8_t *take(size_t bytes)
+    {
+        if ((size_t)(end - p) < bytes)
+            throw runtime_error("truncated");
+        const uint8_t *at = p;
+        p += bytes;
+        return at;
+    }
+
+public:
+    uint32_t u32()
+    {
+        uint32_t v;
+        memcpy(&v, take(sizeof v), sizeof v);
+        return v;
+    }
+
+    double f64()
+    {
+        double d;
+        memcpy(&d, take(sizeof d), sizeof d);
+        return d;
+    }
+
+    // Counts are checked against the bytes left before anything is sized by them
+    uint32_t count(size_t minBytesEach)
+    {
+        uint32_t n = u32();
+        if (n > (size_t)(end - p) / max<size_t>(minBytesEach, 1))
+            throw runtime_error("bad count");
+        return n;
+    }
+
+    string_view str()
+    {
+        uint32_t i = u32();
+        if (i >= strings.size())
+            throw runtime_error("bad string index");
+        return strings[i];
+    }
+
+    CodeCacheReader(const uint8_t *data, size_t size) : p(data), end(data + size)
+    {
+        uint32_t n = count(4);
+        strings.reserve(n);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            uint32_t len = u32();
+            strings.emplace_back((const char *)take(len), len);
+            take((4 - len % 4) % 4);
+        }
+    }
+
+    // The file's global slots renumbered into `g`, for code that didn't
+    // come from a script run in this isolate
+    vector<int> globalSlots(GlobalScope &g)
+    {
+        vector<int> slots(count(4));
+        for (auto &slot : slots)
+            slot = g.slotFor(string(str()));
+        return slots;
+    }
+
+    // The file's global slots must be exactly the ones this isolate assigns
+    bool globals(GlobalScope &g)
+    {
+        uint32_t n = count(4);
+        for (uint32_t i = 0; i < n; ++i)
+        {
+            if (g.slotFor(string(str())) != (int)i)
+                return false;
+        }
+        return true;
+    }
+
+    shared_ptr<BytecodeFunction> function()
+    {
+        auto fn = functionFields();
+        uint32_t functionCount = count(4);
+        for (uint32_t i = 0; i < functionCount; ++i)
+            fn->functions.push_back(function());
+        return fn;
+    }
+
+    // A function without its nested functions; see CodeCacheWriter
+    shared_ptr<BytecodeFunction> functionFields()
+    {
+        auto fn = make_shared<BytecodeFunction>();
+        fn->name = string(str());
+        uint32_t paramCount = count(4);
+        for (uint32_t i = 0; i < paramCount; ++i)
+            fn->params.emplace_back(str());
+        fn->registerCount = (int)u32();
+        fn->slotCount = (int)u32();
+        fn->localsInRegisters = u32() != 0;
+        fn->isAsync = u32() != 0;
+        fn->line = (int)u32();
+        fn->col = (int)u32();
+
+        uint32_t codeSize = count(sizeof(Instruction));
+        fn->code.resize(codeSize);
+        memcpy(fn->code.data(), take(codeSize * sizeof(Instruction)), codeSize * sizeof(Instruction));
+        for (auto &ins : fn->code)
+        {
+            if (ins.op > OP_RETURN)
+                throw runtime_error("bad opcode");
+        }
+
+        uint32_t positionCount = count(3 * 4);
+        for (uint32_t i = 0; i < positionCount; ++i)
+        {
+            SourcePosition pos;
+            pos.pc = u32();
+            pos.line = (int)u32();
+            pos.col = (int)u32();
+            if (pos.pc >= codeSize || (i && pos.pc <= fn->positions.back().pc))
+                throw runtime_error("bad source position");
+            fn->positions.push_back(pos);
+        }
+
+        uint32_t constantCount = count(4);
+        for (uint32_t i = 0; i < constantCount; ++i)
+        {
+            uint32_t kind = u32();
+            switch (kind)
+            {
+            case 0:
+                fn->constants.push_back(Value::number(f64()));
+                break;
+            case 1:
+                fn->constants.push_back(Value(internString(str())));
+                break;
+            case 2:
+                fn->constants.push_back(Value());
+                break;
+            case 3:
+            case 4:
+                fn->constants.push_back(Value::boolean(kind == 4));
+                break;
+            default:
+                throw runtime_error("bad constant");
+            }
+        }
+
+        uint32_t nameCount = count(4);
+        for (uint32_t i = 0; i < nameCount; ++i)
+            fn->names.emplace_back(str());
+
+        uint32_t literalCount = count(4);
+        for (uint32_t i = 0; i < literalCount; ++i)
+        {
+            vector<string> keys(count(4));
+            for (auto &k : keys)
+                k = string(str());
+            fn->literals.emplace_back(keys);
+        }
+
+        uint32_t cacheCount = u32();
+        if (cacheCount > fn->code.size())
+            throw runtime_error("bad cache count");
+        fn->caches.resize(cacheCount);
+        return fn;
+    }
+
+    bool atEnd() const { return p == end; }
+};
+
+// Why a file can't be used, or null if its header and payload check out
+const char *checkHeader(const uint8_t *data, size_t size, uint32_t magic, uint64_t key)
+{
+    CodeCacheHeader header;
+    if (size < sizeof header)
+        return "truncated";
+    memcpy(&header, data, sizeof header);
+    if (header.magic != magic || header.version != kCodeCacheVersion || header.sourceHash != key)
+        return "stale";
+    if (header.payloadSize != size - sizeof header || header.payloadHash != fnv1a(data + sizeof header, (size_t)header.payloadSize))
+        return "damaged";
+    return nullptr;
+}
+
+uint64_t codeCacheKey(string_view source)
+{
+    uint64_t hash = fnv1a(source.data(), source.size());
+    uint32_t settings[] = {kCodeCacheVersion, (uint32_t)sizeof(Instruction), foldConstants};
+    return fnv1a(settings, sizeof settings, hash);
+}
+
+string codeCachePath(uint64_t key)
+{
+    char name[32];
+    snprintf(name, sizeof name, "%016llx.svc", (unsigned long long)key);
+    return codeCacheDir + "/" + name;
+}
+
+// Null on a miss: no file, a stale or damaged one, or different globals
+shared_ptr<BytecodeFunction> loadCodeCache(string_view source, GlobalScope &globals)
+{
+    uint64_t key = codeCacheKey(source);
+    string path = codeCachePath(key);
+    MappedFile file(path);
+    if (!file.data())
+        return nullptr;
+
+    shared_ptr<BytecodeFunction> code;
+    const char *problem = checkHeader(file.data(), file.size(), kCodeCacheMagic, key);
+    if (!problem)
+    {
+        try
+        {
+            CodeCacheReader reader(file.data() + sizeof(CodeCacheHeader), file.size() - sizeof(CodeCacheHeader));
+            if (!reader.globals(globals))
+                problem = "globals differ";
+            else
+            {
+                code = reader.function();
+                if (!reader.atEnd())
+                    problem = "trailing bytes";
+            }
+        }
+        catch (runtime_error &)
+        {
+            problem = "malformed";
+        }
+    }
+
+    if (traceCodeCache)
+        cout << "[code-cache] " << (problem ? string("miss (") + problem + ")" : string("hit")) << " " << path
+             << endl;
+    return problem ? nullptr : code;
+}
+
+// Written aside and renamed, so a concurrent reader sees all or nothing
+bool replaceFile(const string &path, const string &bytes)
+{
+    string temp = path + ".tmp" + to_string(hash<thread::id>()(this_thread::get_id()));
+    {
+        ofstream out(temp, ios::binary | ios::trunc);
+        out.write(bytes.data(), bytes.size());
+        if (!out)
+        {
+            out.close();
+            remove(temp.c_str());
+            return false;
+        }
+    }
+    if (rename(temp.c_str(), path.c_str()) != 0)
+    {
+        remove(temp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Best effort: a cache that can't be written only costs the next run a parse
+void storeCodeCache(string_view source, const BytecodeFunction &code, const GlobalScope &globals)
+{
+    uint64_t key = codeCacheKey(source);
+    CodeCacheWriter writer;
+    writer.globals(globals);
+    if (!writer.function(code))
+        return;
+    string bytes = writer.finish(key);
+
+    string path = codeCachePath(key);
+    if (!replaceFile(path, bytes))
+        return;
+    if (traceCodeCache)
+        cout << "[code-cache] wrote " << bytes.size() << " bytes to " << path << endl;
+}
+
+// A startup snapshot is the heap a prelude script leaves behind, in the
+// code cache's encoding: the global slot table, every bytecode function
+// the heap refers to, then every cell reachable from the globals. Cells are
+// written in two passes, first what it takes to allocate each one and then
+// the Values inside, so references can point forwards and form cycles.
+// Natives are C++ closures, so the snapshot names them by their index among
+// the isolate's builtins, and a snapshot only loads into a binary with the
+// same builtins (the key covers them).
+constexpr uint32_t kSnapshotMagic = 0x53385653;  // "SV8S"
+constexpr uint32_t kSnapshotVersion = 1;          // Bump whenever the cell layout below changes
+
+enum SnapshotValueTag : uint32_t
+{
+    SNAP_NUMBER,
+    SNAP_NULL,
+    SNAP_FALSE,
+    SNAP_TRUE,
+    SNAP_CELL,
+};
+
+class SnapshotWriter
+{
+    CodeCacheWriter out;
+    const vector<NativeCell *> &builtins;
+    unordered_map<const HeapCell *, uint32_t> cellIds;
+    vector<HeapCell *> cells;
+    unordered_map<const BytecodeFunction *, uint32_t> functionIds;
+    vector<const BytecodeFunction *> functions;
+
+    void reach(const Value &v)
+    {
+        if (v.isCell())
+            reach(v.asCell());
+    }
+
+    void reach(HeapCell *cell)
+    {
+        if (cell && cellIds.emplace(cell, (uint32_t)cells.size()).second)
+            cells.push_back(cell);
+    }
+
+    void reach(const BytecodeFunction *fn)
+    {
+        if (!functionIds.emplace(fn, (uint32_t)functions.size()).second)
+            return;
+        functions.push_back(fn);
+        for (auto &inner : fn->functions)
+            reach(inner.get());
+    }
+
+    // Cells reachable from `c`, so they get ids; throws on what can't be stored
+    void reachChildren(HeapCell *c)
+    {
+        switch (c->type)
+        {
+        case V_STR:
+            static_cast<StringCell *>(c)->flat();
+            break;
+        case V_LIST:
+        {
+            auto list = static_cast<ListCell *>(c);
+            for (uint32_t i = 0; i < list->length; ++i)
+                reach(list->get(i));
+            break;
+        }
+        case V_OBJ:
+            for (auto &v : static_cast<ObjectCell *>(c)->slots)
+                reach(v);
+            break;
+        case V_FUNC:
+        {
+            auto fn = static_cast<FunctionCell *>(c);
+            if (!fn->code)
+                throw runtime_error("can't snapshot a function without bytecode");
+            if (fn->code->lazy)
+                compileLazily(*fn->code); // Restored isolates shouldn't each parse it again
+            reach(fn->code.get());
+            reach(fn->closure);
+            break;
+        }
+        case V_NATIVE:
+            if (find(builtins.begin(), builtins.end(), c) == builtins.end())
+                throw runtime_error("can't snapshot a native that isn't a builtin");
+            break;
+        case V_ENV:
+        {
+            auto env = static_cast<Environment *>(c);
+            reach(env->parent);
+            for (auto &v : env->slots)
+                reach(v);
+            break;
+        }
+        case V_PROMISE:
+        {
+            auto promise = static_cast<PromiseCell *>(c);
+            if (!promise->reactions.empty())
+                throw runtime_error("can't snapshot a promise something is waiting on");
+            reach(promise->result);
+            break;
+        }
+        default:
+            throw runtime_error("can't snapshot a suspended async function");
+        }
+    }
+
+    void value(const Value &v)
+    {
+        if (v.isNumber())
+        {
+            out.u32(SNAP_NUMBER);
+            out.f64(v.asNumber());
+        }
+        else if (v.isCell())
+        {
+            out.u32(SNAP_CELL);
+            out.u32(cellIds.at(v.asCell()));
+        }
+        else
+            out.u32(v.isNull() ? SNAP_NULL : v.asBool() ? SNAP_TRUE : SNAP_FALSE);
+    }
+
+    // Null is stored as id 0, so cell ids are shifted by one
+    void cellRef(const HeapCell *c) { out.u32(c ? cellIds.at(c) + 1 : 0); }
+
+    void shell(HeapCell *c)
+    {
+        out.u32(c->type);
+        switch (c->type)
+        {
+        case V_STR:
+        {
+            auto str = static_cast<StringCell *>(c);
+            out.str(str->flat());
+            out.u32(str->interned);
+            break;
+        }
+        case V_LIST:
+            break;
+        case V_OBJ:
+        {
+            Shape *shape = static_cast<ObjectCell *>(c)->shape;
+            out.u32((uint32_t)shape->size());
+            for (auto key : shape->keys)
+                out.str(key->value);
+            break;
+        }
+        case V_FUNC: // The rest comes from the bytecode, as in OP_CLOSURE
+            out.u32(functionIds.at(static_cast<FunctionCell *>(c)->code.get()));
+            break;
+        case V_NATIVE:
+            out.u32((uint32_t)(find(builtins.begin(), builtins.end(), c) - builtins.begin()));
+            break;
+        case V_ENV:
+            out.u32((uint32_t)static_cast<Environment *>(c)->slots.size());
+            break;
+        case V_PROMISE:
+            out.u32(static_cast<PromiseCell *>(c)->settled);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void contents(HeapCell *c)
+    {
+        switch (c->type)
+        {
+        case V_LIST:
+        {
+            auto list = static_cast<ListCell *>(c);
+            out.u32(list->length);
+            for (uint32_t i = 0; i < list->length; ++i)
+                value(list->get(i));
+            break;
+        }
+        case V_OBJ:
+            for (auto &v : static_cast<ObjectCell *>(c)->slots)
+                value(v);
+            break;
+        case V_FUNC:
+            cellRef(static_cast<FunctionCell *>(c)->closure);
+            break;
+        case V_ENV:
+        {
+            auto env = static_cast<Environment *>(c);
+            cellRef(env->parent);
+            for (auto &v : env->slots)
+                value(v);
+            break;
+        }
+        case V_PROMISE:
+            value(static_cast<PromiseCell *>(c)->result);
+            break;
+        default:
+            break;
+        }
+    }
+
+public:
+    explicit SnapshotWriter(const vector<NativeCell *> &b) : builtins(b) {}
+
+    // Throws if the heap holds something a snapshot can't represent
+    string write(const GlobalScope &globals, uint64_t key)
+    {
+        for (auto &v : globals.allValues())
+            reach(v);
+        for (size_t i = 0; i < cells.size(); ++i)
+            reachChildren(cells[i]);
+
+        out.globals(globals);
+        out.u32((uint32_t)functions.size());
+        for (auto fn : functions)
+        {
+            if (!out.functionFields(*fn))
+                throw runtime_error("can't snapshot a function constant");
+            out.u32((uint32_t)fn->functions.size());
+            for (auto &inner : fn->functions)
+                out.u32(functionIds.at(inner.get()));
+        }
+        out.u32((uint32_t)cells.size());
+        for (auto c : cells)
+            shell(c);
+        for (auto c : cells)
+            contents(c);
+        for (size_t i = 0; i < globals.size(); ++i)
+        {
+            out.u32(globals.isDefined((int)i));
+            value(globals.allValues()[i]);
+        }
+
+        return out.finish(key, kSnapshotMagic);
+    }
+};
+
+// Recreates a snapshot's cells in the current isolate and defines its
+// globals. Needs the same builtins the snapshot was written with, already
+// installed; throws on anything inconsistent.
+class SnapshotReader
+{
+    CodeCacheReader in;
+    const vector<NativeCell *> &builtins;
+    vector<HeapCell *> cells;
+
+    Value value()
+    {
+        uint32_t tag = in.u32();
+        switch (tag)
+        {
+        case SNAP_NUMBER:
+            return Value::number(in.f64());
+        case SNAP_NULL:
+            return Value();
+        case SNAP_FALSE:
+        case SNAP_TRUE:
+            return Value::boolean(tag == SNAP_TRUE);
+        case SNAP_CELL:
+        {
+            uint32_t id = in.u32();
+            if (id >= cells.size())
+                throw runtime_error("bad cell reference");
+            return Value(cells[id]);
+        }
+        default:
+            throw runtime_error("bad value tag");
+        }
+    }
+
+    Environment *envRef()
+    {
+        uint32_t id = in.u32();
+        if (id == 0)
+            return nullptr;
+        if (id > cells.size() || cells[id - 1]->type != V_ENV)
+            throw runtime_error("bad environment reference");
+        return static_cast<Environment *>(cells[id - 1]);
+    }
+
+    HeapCell *shell(const vector<shared_ptr<BytecodeFunction>> &functions)
+    {
+        uint32_t type = in.u32();
+        switch (type)
+        {
+        case V_STR:
+        {
+            string_view text = in.str();
+            return in.u32() ? internString(text) : makeString(string(text)).asString();
+        }
+        case V_LIST:
+            return gcNew<ListCell>();
+        case V_OBJ:
+        {
+            auto obj = gcNew<ObjectCell>();
+            uint32_t keyCount = in.count(4);
+            bool dictionary = keyCount > (uint32_t)Shape::kMaxFastProperties;
+            for (uint32_t i = 0; i < keyCount; ++i)
+            {
+                string_view text = in.str();
+                // Big objects come back in dictionary mode, so their keys needn't be interned
+                StringCell *key = dictionary ? makeString(string(text)).asString() : internString(text);
+                if (obj->shape->find(key) >= 0)
+                    throw runtime_error("duplicate property");
+                obj->addProperty(key, Value());
+            }
+            return obj;
+        }
+        case V_FUNC:
+        {
+            uint32_t id = in.u32();
+            if (id >= functions.size())
+                throw runtime_error("bad function reference");
+            auto fn = gcNew<FunctionCell>();
+            fn->code = functions[id];
+            fn->params = fn->code->params;
+            fn->slotCount = fn->code->slotCount;
+            return fn;
+        }
+        case V_NATIVE:
+        {
+            uint32_t index = in.u32();
+            if (index >= builtins.size())
+                throw runtime_error("bad native reference");
+            return builtins[index];
+        }
+        case V_ENV:
+            return gcNew<Environment>(nullptr, in.count(4));
+        case V_PROMISE:
+        {
+            auto promise = gcNew<PromiseCell>();
+            promise->settled = in.u32() != 0;
+            return promise;
+        }
+        default:
+            throw runtime_error("bad cell type");
+        }
+    }
+
+    void contents(HeapCell *c)
+    {
+        switch (c->type)
+        {
+        case V_LIST:
+        {
+            auto list = static_cast<ListCell *>(c);
+            uint32_t length = in.count(4);
+            for (uint32_t i = 0; i < length; ++i)
+                list->push(value());
+            break;
+        }
+        case V_OBJ:
+            for (auto &v : static_cast<ObjectCell *>(c)->slots)
+                v = value();
+            break;
+        case V_FUNC:
+            static_cast<FunctionCell *>(c)->closure = envRef();
+            break;
+        case V_ENV:
+        {
+            auto env = static_cast<Environment *>(c);
+            env->parent = envRef();
+            for (auto &v : env->slots)
+                v = value();
+            break;
+        }
+        case V_PROMISE:
+            static_cast<PromiseCell *>(c)->result = value();
+            break;
+        default:
+            break;
+        }
+    }
+
+public:
+    // `data` is the whole snapshot; checkHeader() must have accepted it
+    SnapshotReader(const uint8_t *data, size_t size, const vector<NativeCell *> &b)
+        : in(data + sizeof(CodeCacheHeader), size - sizeof(CodeCacheHeader)), builtins(b) {}
+
+    // Allocates but never collects, so nothing is lost before the globals
+    // hold it all
+    void read(GlobalScope &globals)
+    {
+        if (!in.globals(globals))
+            throw runtime_error("globals differ");
+
+        vector<shared_ptr<BytecodeFunction>> functions(in.count(4));
+        vector<vector<uint32_t>> nested(functions.size());
+        for (size_t i = 0; i < functions.size(); ++i)
+        {
+            functions[i] = in.functionFields();
+            nested[i].resize(in.count(4));
+            for (auto &id : nested[i])
+                id = in.u32();
+        }
+        for (size_t i = 0; i < functions.size(); ++i)
+        {
+            for (uint32_t id : nested[i])
+            {
+                if (id >= functions.size())
+                    throw runtime_error("bad function reference");
+                functions[i]->functions.push_back(functions[id]);
+            }
+        }
+
+        cells.resize(in.count(4));
+        for (auto &c : cells)
+            c = shell(functions);
+        for (auto c : cells)
+            contents(c);
+        for (size_t i = 0; i < globals.size(); ++i)
+        {
+            bool defined = in.u32() != 0;
+            Value v = value();
+            if (defined)
+                globals.define((int)i, v);
+        }
+        if (!in.atEnd())
+            throw runtime_error("trailing bytes");
+    }
+};
+
+// ==========================================
+// 14. CPU PROFILER
+// ==========================================
+
+// A sampling profiler. A ticker thread asks the isolate's heap for an
+// interrupt every interval; at the next safepoint (a loop back-edge or a
+// function entry) the handler records the VM's frames with the source line
+// each one is at. Samples from every isolate go to one process-wide log,
+// written at exit as collapsed stacks for flamegraph.pl or, for a
+// .cpuprofile path, a Chrome DevTools profile.
+//
+// Code runs at most one loop iteration or call between safepoints, so the
+// sample lands at most that far from the tick; inside a loop body it lands
+// on the loop's line, where the back-edge is. Natives are charged to the
+// script frame that called them; time the loop spends blocked is "(idle)".
+
+string profilePath;           // --prof FILE
+int profileIntervalUs = 1000; // --prof-interval US
+
+class ProfileLog
+{
+    struct Function
+    {
+        string name;
+        int line, col; // Declaration, 0 for pseudo-frames
+    };
+
+    struct Sample
+    {
+        vector<pair<int, int>> stack; // (function, line it is at), outermost first
+        int64_t timeUs;
+    };
+
+    mutex lock;
+    vector<Function> functions;
+    map<tuple<string, int, int>, int> functionIds;
+    vector<Sample> samples;
+
+    static void writeJsonString(ostream &out, const string &s)
+    {
+        out << '"';
+        for (char c : s)
+        {
+            if (c == '"' || c == '\\')
+                out << '\\' << c;
+            else if ((unsigned char)c < 0x20)
+                out << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 15];
+            else
+                out << c;
+        }
+        out << '"';
+    }
+
+    void writeCollapsed(ostream &out)
+    {
+        map<string, size_t> counts;
+        for (auto &sample : samples)
+        {
+            string key;
+            for (auto &[function, line] : sample.stack)
+            {
+                if (!key.empty())
+                    key += ';';
+                key += functions[function].name;
+                if (line)
+                    key += ':' + to_string(line);
+            }
+            counts[key]++;
+        }
+        for (auto &[stack, count] : counts)
+            out << stack << ' ' << count << '\n';
+    }
+
+    // Chrome's format: a call tree whose nodes carry per-line hit counts,
+    // plus the leaf node of every sample and the time since the previous one
+    void writeCpuProfile(ostream &out)
+    {
+        struct Node
+        {
+            int parent, function;
+            vector<int> children;
+            size_t hits = 0;
+            map<int, size_t> lineHits;
+        };
+        vector<Node> nodes{{-1, -1, {}, 0, {}}}; // (root)
+        map<pair<int, int>, int> childOf;          // (parent, function) -> node
+        vector<int> leaves;
+
+        sort(samples.begin(), samples.end(),
+             [](const Sample &a, const Sample &b) { return a.timeUs < b.timeUs; });
+        for (auto &sample : samples)
+        {
+            int node = 0;
+            for (auto &[function, line] : sample.stack)
+            {
+                auto [it, added] = childOf.try_emplace({node, function}, (int)nodes.size());
+                if (added)
+                {
+                    nodes.push_back({node, function, {}, 0, {}});
+                    nodes[node].children.push_back(it->second);
+                }
+                node = it->second;
+            }
+            nodes[node].hits++;
+            if (!sample.stack.empty() && sample.stack.back().second)
+                nodes[node].lineHits[sample.stack.back().second]++;
+            leaves.push_back(node);
+        }
+
+        out << "{\"nodes\":[";
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            const Node &n = nodes[i];
+            const Function *f = n.function < 0 ? nullptr : &functions[n.function];
+            out << (i ? "," : "") << "{\"id\":" << i + 1 << ",\"callFrame\":{\"functionName\":";
+            writeJsonString(out, f ? f->name : "(root)");
+            // DevTools numbers lines and columns from 0 here, from 1 in positionTicks
+            out << ",\"scriptId\":\"0\",\"url\":\"\",\"lineNumber\":" << (f ? f->line - 1 : -1)
+                << ",\"columnNumber\":" << (f ? f->col - 1 : -1) << "},\"hitCount\":" << n.hits << ",\"children\":[";
+            for (size_t k = 0; k < n.children.size(); ++k)
+                out << (k ? "," : "") << n.children[k] + 1;
+            out << "],\"positionTicks\":[";
+            size_t k = 0;
+            for (auto &[line, hits] : n.lineHits)
+                out << (k++ ? "," : "") << "{\"line\":" << line << ",\"ticks\":" << hits << "}";
+            out << "]}";
+        }
+        int64_t start = samples.empty() ? 0 : samples.front().timeUs;
+        int64_t end = samples.empty() ? 0 : samples.back().timeUs;
+        out << "],\"startTime\":" << start << ",\"endTime\":" << end << ",\"samples\":[";
+        for (size_t i = 0; i < leaves.size(); ++i)
+            out << (i ? "," : "") << leaves[i] + 1;
+        out << "],\"timeDeltas\":[";
+        for (size_t i = 0; i < samples.size(); ++i)
+            out << (i ? "," : "") << samples[i].timeUs - (i ? samples[i - 1].timeUs : start);
+        out << "]}\n";
+    }
+
+public:
+    int functionId(const string &name, int line, int col)
+    {
+        lock_guard<mutex> guard(lock);
+        auto [it, added] = functionIds.try_emplace({name, line, col}, (int)functions.size());
+        if (added)
+            functions.push_back({name, line, col});
+        return it->second;
+    }
+
+    void add(vector<pair<int, int>> stack)
+    {
+        int64_t now = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+        lock_guard<mutex> guard(lock);
+        samples.push_back({move(stack), now});
+    }
+
+    void write(const string &path)
+    {
+        lock_guard<mutex> guard(lock);
+        ofstream out(path, ios::binary);
+        if (!out)
+            throw runtime_error("Cannot write profile " + path);
+        string suffix = ".cpuprofile";
+        bool chrome = path.size() >= suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0;
+        if (chrome)
+            writeCpuProfile(out);
+        else
+            writeCollapsed(out);
+    }
+};
+
+ProfileLog &profileLog()
+{
+    static ProfileLog log;
+    return log;
+}
+
+// Samples one isolate's VM while it exists
+class CpuProfiler
+{
+    Heap &heap;
+    VM &vm;
+    thread ticker;
+    mutex stopLock;
+    condition_variable stopWake;
+    bool stopping = false;
+
+    // Functions seen so far; holding them keeps their addresses from being reused
+    unordered_map<const BytecodeFunction *, int> ids;
+    vector<shared_ptr<BytecodeFunction>> seen;
+    int programId, idleId;
+
+    int idOf(const shared_ptr<BytecodeFunction> &fn)
+    {
+        auto [it, added] = ids.try_emplace(fn.get(), 0);
+        if (added)
+        {
+            it->second = profileLog().functionId(fn->name, fn->line, fn->col);
+            seen.push_back(fn);
+        }
+        return it->second;
+    }
+
+    void sample()
+    {
+        vector<pair<int, int>> stack;
+        vm.walkFrames([&](const shared_ptr<BytecodeFunction> &fn, size_t pc)
+        {
+            // Callers' pcs are return addresses: the call is one before
+            stack.push_back({idOf(fn), fn->positionAt(pc ? pc - 1 : 0).line});
+        });
+        if (stack.empty())
+            stack.push_back({programId, 0}); // Between tasks, outside any script
+        profileLog().add(move(stack));
+    }
+
+public:
+    CpuProfiler(Heap &h, VM &v) : heap(h), vm(v)
+    {
+        programId = profileLog().functionId("(program)", 0, 0);
+        idleId = profileLog().functionId("(idle)", 0, 0);
+        heap.interruptHandlers[Heap::INTERRUPT_PROFILE] = [this] { sample(); };
+        ticker = thread([this]
+        {
+            unique_lock<mutex> lock(stopLock);
+            while (!stopWake.wait_for(lock, chrono::microseconds(profileIntervalUs), [this] { return stopping; }))
+                heap.requestInterrupt(Heap::INTERRUPT_PROFILE);
+        });
+    }
+
+    ~CpuProfiler()
+    {
+        {
+            lock_guard<mutex> lock(stopLock);
+            stopping = true;
+        }
+        stopWake.notify_one();
+        ticker.join();
+        heap.interruptHandlers[Heap::INTERRUPT_PROFILE] = nullptr;
+    }
+
+    CpuProfiler(const CpuProfiler &) = delete;
+    CpuProfiler &operator=(const CpuProfiler &) = delete;
+
+    // The event loop is about to block: what follows is idle time
+    void idle() { profileLog().add({{idleId, 0}}); }
+};
+
+// ==========================================
+// 15. ISOLATES & THREAD POOL
+// ==========================================
+
+mutex outputMutex; // Serializes whole lines of output across isolates
+
+// Where print() sends its lines. The policy decides when waiting text is
+// pushed out: once the buffer fills (the default for pipes and files),
+// after every line (the default for a terminal), or only on an explicit
+// flush(). Callers hold outputMutex, since sinks can be shared by isolates.
+class OutputSink
+{
+public:
+    enum FlushPolicy
+    {
+        FLUSH_WHEN_FULL,
+        FLUSH_EACH_LINE,
+        FLUSH_EXPLICIT
+    };
+
+    virtual ~OutputSink() = default;
+
+    void writeLine(string_view line)
+    {
+        write(line);
+        write("\n");
+        if (policy == FLUSH_EACH_LINE)
+            flush();
+    }
+
+    virtual void write(string_view text) = 0;
+    virtual void flush() = 0;
+
+protected:
+    FlushPolicy policy = FLUSH_WHEN_FULL;
+};
+
+// A C stdio stream with a buffer of its own size. Standard output goes
+// through the same FILE as cout, so traces and errors written with cout stay
+// in order with printed lines. Under FLUSH_EXPLICIT a full buffer still has
+// to be written out; it is just sized so that rarely happens.
+class FileSink : public OutputSink
+{
+    FILE *file;
+    bool owned;
+
+public:
+    static constexpr size_t kBufferBytes = 64 * 1024;
+    static constexpr size_t kExplicitBufferBytes = 16 * 1024 * 1024;
+
+    // setvbuf must run before anything is written to `f`
+    FileSink(FILE *f, FlushPolicy p, bool ownsFile = false) : file(f), owned(ownsFile)
+    {
+        policy = p;
+        if (p == FLUSH_EACH_LINE)
+            setvbuf(file, nullptr, _IOLBF, kBufferBytes);
+        else
+            setvbuf(file, nullptr, _IOFBF, p == FLUSH_EXPLICIT ? kExplicitBufferBytes : kBufferBytes);
+    }
+
+    // Opens (and truncates) `path`; throws if it can't
+    FileSink(const string &path, FlushPolicy p) : FileSink(openOrThrow(path), p, true) {}
+
+    ~FileSink() override
+    {
+        if (owned)
+            fclose(file);
+        else
+            fflush(file);
+    }
+
+    void write(string_view text) override { fwrite(text.data(), 1, text.size(), file); }
+    void flush() override { fflush(file); }
+
+private:
+    static FILE *openOrThrow(const string &path)
+    {
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f)
+            throw runtime_error("Cannot open " + path + " for output");
+        return f;
+    }
+};
+
+// Collects output in memory, for embedders and tests
+class MemorySink : public OutputSink
+{
+    string text;
+
+public:
+    void write(string_view t) override { text += t; }
+    void flush() override {}
+
+    const string &contents() const { return text; }
+    string take() { return move(text); }
+};
+
+string outputPath;        // --output FILE
+bool outputPolicySet = false; // --flush given
+OutputSink::FlushPolicy outputPolicy = OutputSink::FLUSH_WHEN_FULL;
+
+// The sink isolates start with: stdout, or --output's file. Line-flushed
+// on a terminal unless --flush says otherwise.
+shared_ptr<OutputSink> defaultOutput()
+{
+    static shared_ptr<OutputSink> sink = []() -> shared_ptr<OutputSink>
+    {
+#ifdef _WIN32
+        bool terminal = _isatty(_fileno(stdout));
+#else
+        bool terminal = isatty(fileno(stdout));
+#endif
+        if (!outputPath.empty())
+            return make_shared<FileSink>(outputPath, outputPolicy);
+        return make_shared<FileSink>(stdout, outputPolicySet || !terminal ? outputPolicy : OutputSink::FLUSH_EACH_LINE);
+    }();
+    return sink;
+}
+
+bool dumpStats = false; // --dump-stats
+string preludePath;     // --prelude FILE: runs in every isolate before its scripts
+string snapshotPath;    // --snapshot FILE: where the prelude's snapshot is kept
+size_t compileThreads = 0; // --compile-threads N: compile lazy functions ahead of their first call
+
+// Counters summed over every isolate that has shut down, for --dump-stats
+class StatsLog
+{
+    mutex lock;
+    HeapStats heap;
+    RuntimeStats runtime;
+    size_t isolates = 0;
+
+public:
+    void add(const HeapStats &h, const RuntimeStats &r)
+    {
+        lock_guard<mutex> guard(lock);
+        isolates++;
+        heap.collections += h.collections;
+        heap.bytesAllocated += h.bytesAllocated;
+        heap.totalPauseMs += h.totalPauseMs;
+        for (int t = 0; t < V_FREE; ++t)
+            heap.cellsByType[t] += h.cellsByType[t];
+        runtime.userCalls += r.userCalls;
+        runtime.nativeCalls += r.nativeCalls;
+        for (int d = 0; d < RuntimeStats::kDepthBuckets; ++d)
+            runtime.scopeDepth[d] += r.scopeDepth[d];
+        runtime.timersQueued += r.timersQueued;
+        runtime.timersFired += r.timersFired;
+        runtime.timerLatenessMs += r.timerLatenessMs;
+        runtime.maxTimerLatenessMs = max(runtime.maxTimerLatenessMs, r.maxTimerLatenessMs);
+        runtime.microtasksRun += r.microtasksRun;
+        runtime.parses += r.parses;
+        runtime.parseMs += r.parseMs;
+    }
+
+    void write(ostream &out)
+    {
+        lock_guard<mutex> guard(lock);
+        out << "[stats] isolates " << isolates << "\n[stats] allocations";
+        for (int t = 0; t < V_FREE; ++t)
+            if (kCellTypeNames[t])
+                out << " " << kCellTypeNames[t] << "=" << heap.cellsByType[t];
+        out << "\n[stats] calls user=" << runtime.userCalls << " native=" << runtime.nativeCalls
+            << "\n[stats] scope depth";
+        for (int d = 0; d < RuntimeStats::kDepthBuckets; ++d)
+            out << " " << d << (d == RuntimeStats::kDepthBuckets - 1 ? "+=" : "=") << runtime.scopeDepth[d];
+        double avgLateMs = runtime.timersFired ? runtime.timerLatenessMs / runtime.timersFired : 0;
+        out << "\n[stats] timers queued=" << runtime.timersQueued << " fired=" << runtime.timersFired
+            << " late avg=" << avgLateMs << " ms max=" << runtime.maxTimerLatenessMs << " ms"
+            << "\n[stats] microtasks " << runtime.microtasksRun << "\n[stats] parse " << runtime.parses
+            << " sources, " << runtime.parseMs << " ms\n[stats] gc " << heap.collections << " collections, "
+            << heap.bytesAllocated / 1024 << " KB allocated, " << heap.totalPauseMs << " ms paused" << endl;
+    }
+};
+
+StatsLog &statsLog()
+{
+    static StatsLog log;
+    return log;
+}
+
+// Limits for untrusted code; 0 means no limit
+struct ExecutionLimits
+{
+    int64_t timeoutMs = 0;   // Wall-clock time for one run, its event loop included
+    size_t maxHeapBytes = 0; // Heap in use, in both execution modes (see Heap::setLimit)
+};
+
+ExecutionLimits defaultLimits; // --timeout MS, --max-heap MB
+
+// One thread for the whole process sleeps until the earliest armed deadline
+// and interrupts that heap, so a script over its time limit stops at its
+// next safepoint without a clock read on every back-edge
+class Watchdog
+{
+    mutex lock;
+    condition_variable wake;
+    map<Heap *, TimerClock::time_point> deadlines;
+    bool stopping = false;
+    thread worker;
+
+    void run()
+    {
+        unique_lock<mutex> guard(lock);
+        while (!stopping)
+        {
+            if (deadlines.empty())
+            {
+                wake.wait(guard);
+                continue;
+            }
+            auto next = min_element(deadlines.begin(), deadlines.end(),
+                                    [](auto &a, auto &b) { return a.second < b.second; });
+            if (TimerClock::now() < next->second)
+            {
+                wake.wait_until(guard, next->second);
+                continue;
+            }
+            next->first->requestInterrupt(Heap::INTERRUPT_TERMINATE);
+            deadlines.erase(next);
+        }
+    }
+
+public:
+    ~Watchdog()
+    {
+        if (!worker.joinable())
+            return;
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    void arm(Heap &heap, TimerClock::time_point deadline)
+    {
+        lock_guard<mutex> guard(lock);
+        if (!worker.joinable())
+            worker = thread([this] { run(); });
+        deadlines[&heap] = deadline;
+        wake.notify_one();
+    }
+
+    // Once this returns the deadline can no longer interrupt the heap
+    void disarm(Heap &heap)
+    {
+        lock_guard<mutex> guard(lock);
+        deadlines.erase(&heap);
+    }
+};
+
+Watchdog &watchdog()
+{
+    static Watchdog dog;
+    return dog;
+}
+
+// A parsed and resolved script, plus its bytecode unless --ast. Global slots
+// and object shapes are baked in, so it only runs on the isolate that made it.
+struct CompiledScript
+{
+    Isolate *owner;
+    vector<shared_ptr<ASTNode>> stmts;  // AST mode only
+    shared_ptr<BytecodeFunction> code; // Bytecode mode only
+};
+
+class Isolate
+{
+    // Compiled scripts held by the embedder; their constants are GC roots
+    vector<weak_ptr<CompiledScript>> scripts;
+
+    friend void markRoots(Isolate &isolate);
+
+    void pruneScripts()
+    {
+        scripts.erase(remove_if(scripts.begin(), scripts.end(),
+                                [](const weak_ptr<CompiledScript> &w) { return w.expired(); }),
+                      scripts.end());
+    }
+
+    // Dead handles are dropped before the list would grow, so a stream of
+    // one-off scripts doesn't pile them up between collections
+    void track(const shared_ptr<CompiledScript> &script)
+    {
+        if (scripts.size() == scripts.capacity())
+            pruneScripts();
+        scripts.push_back(script);
+    }
+
+public:
+    // Declared first so it is destroyed last, after everything pointing into it
+    Heap heap;
+    StringTable strings;
+    Shape rootShape;
+    GlobalScope globals;
+    RuntimeStats stats; // See also heap.stats
+    VM vm;
+    TimerQueue taskQueue;
+    MicrotaskQueue microtasks;
+    IoPoller io; // Sockets and file reads in flight
+    shared_ptr<OutputSink> output = defaultOutput(); // print()'s destination
+    unique_ptr<CpuProfiler> profiler;                // Only with --prof
+    ExecutionLimits limits;                          // Set with setLimits()
+    vector<NativeCell *> builtins; // In install order: how snapshots name natives
+
+    static thread_local Isolate *current;
+
+    // Makes an isolate current on this thread for the scope's lifetime
+    class Scope
+    {
+        Isolate *previous;
+
+    public:
+        explicit Scope(Isolate &isolate) : previous(current) { current = &isolate; }
+        ~Scope() { current = previous; }
+        Scope(const Scope &) = delete;
+        Scope &operator=(const Scope &) = delete;
+    };
+
+    // Brackets a run of script code with the time limit. Only the outermost
+    // Budget counts, so a run and the event loop after it can share one.
+    class Budget
+    {
+        Isolate &isolate;
+        bool outermost;
+
+    public:
+        explicit Budget(Isolate &i) : isolate(i), outermost(i.budgetDepth++ == 0)
+        {
+            if (!outermost)
+                return;
+            isolate.heap.cancelInterrupt(Heap::INTERRUPT_TERMINATE); // Aimed at a run already over
+            if (isolate.limits.timeoutMs > 0)
+            {
+                isolate.deadline = TimerClock::now() + chrono::milliseconds(isolate.limits.timeoutMs);
+                watchdog().arm(isolate.heap, isolate.deadline);
+            }
+        }
+        ~Budget()
+        {
+            isolate.budgetDepth--;
+            if (outermost && isolate.deadline != TimerClock::time_point::max())
+            {
+                watchdog().disarm(isolate.heap);
+                isolate.deadline = TimerClock::time_point::max();
+            }
+        }
+        Budget(const Budget &) = delete;
+        Budget &operator=(const Budget &) = delete;
+    };
+
+    Isolate() : Isolate(true) {}
+
+    // Without the prelude an isolate has only the builtins, which is what a
+    // startup snapshot is built on
+    explicit Isolate(bool withPrelude) : vm(heap, globals, stats)
+    {
+        heap.owner = this;
+        heap.interruptHandlers[Heap::INTERRUPT_TERMINATE] = [this] { terminated(); };
+        setLimits(defaultLimits);
+        Scope scope(*this);
+        installBuiltins();
+        for (auto &v : globals.allValues())
+            if (v.is(V_NATIVE))
+                builtins.push_back(v.asNative());
+        if (withPrelude && !preludePath.empty())
+            loadPrelude();
+        if (!profilePath.empty())
+            profiler = make_unique<CpuProfiler>(heap, vm);
+    }
+
+    ~Isolate()
+    {
+        if (dumpStats)
+            statsLog().add(heap.stats, stats);
+    }
+
+    Isolate(const Isolate &) = delete;
+    Isolate &operator=(const Isolate &) = delete;
+
+    void setLimits(const ExecutionLimits &l)
+    {
+        limits = l;
+        heap.setLimit(l.maxHeapBytes);
+    }
+
+    // Stop the running script at its next safepoint with an error. Safe from
+    // any thread and from a signal handler; dropped if nothing is running.
+    void terminate() { heap.requestInterrupt(Heap::INTERRUPT_TERMINATE); }
+
+    // Parse and resolve once; the result can be run any number of times.
+    // The source is only borrowed while this runs.
+    shared_ptr<CompiledScript> compile(string_view source)
+    {
+        Scope scope(*this);
+        bool useCache = !useAstInterpreter && !codeCacheDir.empty();
+        if (useCache)
+        {
+            if (auto code = loadCodeCache(source, globals))
+            {
+                auto script = make_shared<CompiledScript>();
+                script->owner = this;
+                script->code = code;
+                if (printBytecode)
+                    disassemble(*script->code);
+                track(script);
+                return script;
+            }
+        }
+
+        vector<shared_ptr<ASTNode>> stmts;
+        {
+            Parser parser(source);
+            // The tree-walker runs the AST it has, and a cached script must be whole
+            parser.lazyFunctions = lazyParsing && !useAstInterpreter && !useCache;
+            stmts = parser.parse();
+        }
+        auto script = compile(move(stmts));
+        if (useCache && script->code)
+            storeCodeCache(source, *script->code, globals);
+        return script;
+    }
+
+    // The rest of the pipeline, for statements that are already parsed
+    shared_ptr<CompiledScript> compile(vector<shared_ptr<ASTNode>> stmts)
+    {
+        Scope scope(*this);
+        auto script = make_shared<CompiledScript>();
+        script->owner = this;
+        script->stmts = move(stmts);
+        if (printAst)
+            dumpAst("parsed", script->stmts);
+        if (foldConstants)
+        {
+            size_t replaced = Folder::foldScript(script->stmts);
+            if (printAst)
+                dumpAst("folded (" + to_string(replaced) + " nodes replaced)", script->stmts);
+        }
+        Resolver::resolveScript(script->stmts);
+
+        if (!useAstInterpreter)
+        {
+            script->code = BytecodeCompiler::compileScript(script->stmts);
+            script->stmts.clear();
+            if (printBytecode)
+                disassemble(*script->code);
+            track(script);
+        }
+        return script;
+    }
+
+    // Run a script's synchronous part; returns the last statement's value
+    Value run(const CompiledScript &script)
+    {
+        if (script.owner != this)
+            throw runtime_error("Script was compiled by a different isolate");
+        Scope scope(*this);
+        Budget budget(*this);
+        heap.safepoint(); // A run that hit the heap limit leaves its garbage for the next one to collect
+        if (script.code)
+            return vm.execute(script.code, nullptr);
+
+        Value result;
+        for (auto &stmt : script.stmts)
+        {
+            HandleScope handles;
+            if (stmt)
+                result = handles.keep(stmt->eval(nullptr));
+            heap.safepoint();
+        }
+        return result;
+    }
+
+    void execute(string_view source) { run(*compile(source)); }
+
+    bool hasPendingWork() const { return !taskQueue.empty() || !microtasks.empty() || io.active(); }
+
+    // Run promise reactions until none are left, including the ones they queue
+    void drainMicrotasks()
+    {
+        Scope scope(*this);
+        while (!microtasks.empty())
+        {
+            Microtask job = microtasks.front();
+            stats.microtasksRun++;
+            try
+            {
+                const Reaction &r = job.reaction;
+                if (r.frame)
+                    vm.resume(r.frame, job.value);
+                else
+                    resolvePromise(r.derived, r.handler.isNull() ? job.value : callFunction(r.handler, {job.value}));
+            }
+            catch (...)
+            {
+                microtasks.pop();
+                throw;
+            }
+            microtasks.pop();
+            heap.safepoint();
+        }
+    }
+
+    // Finish the script's microtasks, then run I/O completions and timers
+    // as they come due, draining microtasks after each. With I/O in flight
+    // the loop blocks in the poller until the next timer deadline; with
+    // only timers it sleeps until exactly the next one is due.
+    void runEventLoop()
+    {
+        Scope scope(*this);
+        Budget budget(*this);
+        drainMicrotasks();
+        while (!taskQueue.empty() || io.active())
+        {
+            // Waits below stop at the deadline, which may pass while blocked
+            if (TimerClock::now() >= deadline)
+                terminated();
+            if (io.active())
+            {
+                auto wakeAt = taskQueue.empty() ? deadline : min(deadline, taskQueue.nextDeadline());
+                int timeoutMs = wakeAt == TimerClock::time_point::max() ? -1 : millisecondsUntil(wakeAt);
+                if (profiler && timeoutMs)
+                    profiler->idle();
+                io.poll(timeoutMs, [this]
+                {
+                    heap.safepoint();
+                    drainMicrotasks();
+                });
+            }
+            if (taskQueue.empty())
+                continue;
+            auto due = taskQueue.nextDeadline();
+            if (TimerClock::now() < due)
+            {
+                if (!io.active())
+                {
+                    if (profiler)
+                        profiler->idle();
+                    this_thread::sleep_until(min(due, deadline));
+                }
+                continue;
+            }
+            Task t = taskQueue.pop();
+            double lateMs = chrono::duration<double, milli>(TimerClock::now() - t.executeTime).count();
+            stats.timersFired++;
+            stats.timerLatenessMs += lateMs;
+            stats.maxTimerLatenessMs = max(stats.maxTimerLatenessMs, lateMs);
+            callFunction(t.callback, {});
+            heap.safepoint();
+            drainMicrotasks();
+        }
+    }
+
+private:
+    TimerClock::time_point deadline = TimerClock::time_point::max(); // Of the Budget in force
+    int budgetDepth = 0;
+
+    [[noreturn]] void terminated()
+    {
+        if (TimerClock::now() >= deadline)
+            throw runtime_error("Script exceeded its time limit of " + to_string(limits.timeoutMs) + " ms");
+        throw runtime_error("Script terminated");
+    }
+
+    void installBuiltins();
+    void loadPrelude();
+};
+
+thread_local Isolate *Isolate::current = nullptr;
+
+inline Heap &currentHeap() { return Isolate::current->heap; }
+inline RuntimeStats &currentStats() { return Isolate::current->stats; }
+inline GlobalScope &currentGlobals() { return Isolate::current->globals; }
+inline VM &currentVM() { return Isolate::current->vm; }
+inline Shape *currentRootShape() { return &Isolate::current->rootShape; }
+inline StringCell *internString(string_view text) { return Isolate::current->strings.intern(text); }
+inline StringCell *findInternedString(string_view text) { return Isolate::current->strings.find(text); }
+inline MicrotaskQueue &currentMicrotasks() { return Isolate::current->microtasks; }
+
+// Everything the collector treats as live: global bindings, the VM's
+// registers and frames, callbacks waiting in the task and microtask queues,
+// and the promises of I/O in flight
+void markRoots(Isolate &isolate)
+{
+    for (auto &v : isolate.globals.allValues())
+        isolate.heap.mark(v);
+    for (auto native : isolate.builtins)
+        isolate.heap.mark(native); // A snapshot may refer to one the globals no longer do
+    isolate.vm.markRoots();
+    isolate.strings.forEach([&](StringCell *s) { isolate.heap.mark(s); });
+    for (auto &t : isolate.taskQueue.pending())
+        isolate.heap.mark(t.callback);
+    for (auto &job : isolate.microtasks.pending())
+    {
+        isolate.heap.mark(job.reaction);
+        isolate.heap.mark(job.value);
+    }
+    isolate.io.markRoots(isolate.heap);
+    for (auto &v : isolate.heap.handles)
+        isolate.heap.mark(v);
+
+    isolate.pruneScripts();
+    for (auto &w : isolate.scripts)
+        if (auto script = w.lock())
+            isolate.heap.mark(script->code.get());
+}
+
+void Isolate::installBuiltins()
+{
+    // print("hello")
+    auto printFn = [](Args args)
+    {
+        string line;
+        for (auto &a : args)
+        {
+            a.appendTo(line);
+            line += ' ';
+        }
+        lock_guard<mutex> lock(outputMutex);
+        Isolate::current->output->writeLine(line);
+        return Value(); // returns null
+    };
+    globals.define("print", Value(gcNew<NativeCell>(printFn)));
+
+    // flush(): push buffered print() output out now
+    auto flushFn = [](Args)
+    {
+        lock_guard<mutex> lock(outputMutex);
+        Isolate::current->output->flush();
+        return Value();
+    };
+    globals.define("flush", Value(gcNew<NativeCell>(flushFn)));
+
+    // setTimeout(callback, ms)
+    auto timeoutFn = [](Args args)
+    {
+        if (args.size() < 2 || !(args[0].is(V_FUNC) || args[0].is(V_NATIVE)))
+            return Value();
+
+        // Push to Task Queue
+        Isolate::current->taskQueue.schedule(args[1].num(), args[0]);
+        Isolate::current->stats.timersQueued++;
+
+        return Value();
+    };
+    globals.define("setTimeout", Value(gcNew<NativeCell>(timeoutFn)));
+
+    // Promise(executor): calls executor(resolve) now; resolve(value) settles
+    // the promise, and later calls do nothing
+    auto promiseFn = [](Args args)
+    {
+        auto promise = gcNew<PromiseCell>();
+        auto resolve = gcNew<NativeCell>(nullptr);
+        resolve->bound = promise;
+        resolve->nativeFn = [resolve](Args args)
+        {
+            resolvePromise(static_cast<PromiseCell *>(resolve->bound), args.empty() ? Value() : args[0]);
+            return Value();
+        };
+        if (!args.empty())
+        {
+            if (!args[0].is(V_FUNC) && !args[0].is(V_NATIVE))
+                throw runtime_error("Promise executor is not a function");
+            callFunction(args[0], {Value(resolve)});
+        }
+        return Value(promise);
+    };
+    globals.define("Promise", Value(gcNew<NativeCell>(promiseFn)));
+
+#ifdef HAVE_EPOLL
+    // Non-blocking I/O (section 11). Sockets are numbers; every promise
+    // settles with null on failure or end of stream.
+    // readFile(path) -> promise of the contents
+    auto readFileFn = [](Args args)
+    {
+        return Isolate::current->io.readFile(args.empty() ? "" : args[0].toString());
+    };
+    globals.define("readFile", Value(gcNew<NativeCell>(readFileFn)));
+
+    // listen(port, handler) -> listening socket; handler(socket) per connection
+    auto listenFn = [](Args args)
+    {
+        if (args.size() < 2 || !(args[1].is(V_FUNC) || args[1].is(V_NATIVE)))
+            throw runtime_error("listen(port, handler) needs a handler function");
+        return Value::number(Isolate::current->io.listen((int)args[0].num(), args[1]));
+    };
+    globals.define("listen", Value(gcNew<NativeCell>(listenFn)));
+
+    // connect(host, port) -> promise of a socket
+    auto connectFn = [](Args args)
+    {
+        if (args.size() < 2)
+            throw runtime_error("connect(host, port) needs a host and a port");
+        return Isolate::current->io.connect(args[0].toString(), (int)args[1].num());
+    };
+    globals.define("connect", Value(gcNew<NativeCell>(connectFn)));
+
+    // fetch("http://host/path") -> promise of {status, body}
+    auto fetchFn = [](Args args)
+    {
+        return Isolate::current->io.fetch(args.empty() ? "" : args[0].toString());
+    };
+    globals.define("fetch", Value(gcNew<NativeCell>(fetchFn)));
+
+    // socketRead(socket) -> promise of the next chunk
+    auto socketReadFn = [](Args args)
+    {
+        return Isolate::current->io.read(args.empty() ? -1 : (int)args[0].num());
+    };
+    globals.define("socketRead", Value(gcNew<NativeCell>(socketReadFn)));
+
+    // socketWrite(socket, text) -> promise of the byte count, once all is sent
+    auto socketWriteFn = [](Args args)
+    {
+        if (args.size() < 2)
+            throw runtime_error("socketWrite(socket, text) needs the text to send");
+        return Isolate::current->io.write((int)args[0].num(), args[1].toString());
+    };
+    globals.define("socketWrite", Value(gcNew<NativeCell>(socketWriteFn)));
+
+    // socketClose(socket)
+    auto socketCloseFn = [](Args args)
+    {
+        Isolate::current->io.close(args.empty() ? -1 : (int)args[0].num());
+        return Value();
+    };
+    globals.define("socketClose", Value(gcNew<NativeCell>(socketCloseFn)));
+#endif
+
+    // gc(): collect at the next safepoint
+    auto gcFn = [](Args)
+    {
+        currentHeap().requestCollection();
+        return Value();
+    };
+    globals.define("gc", Value(gcNew<NativeCell>(gcFn)));
+
+    // heapStats() -> {collections, allocated, live, cells, freed, arenas, pauseMs}
+    auto heapStatsFn = [](Args)
+    {
+        // Shapes belong to the isolate, so the layout can't be cached across calls
+        ObjectLiteral layout({"collections", "allocated", "live", "cells", "freed", "arenas", "pauseMs"});
+        const HeapStats &st = currentHeap().stats;
+        Value fields[] = {Value::number(st.collections), Value::number(st.bytesAllocated),
+                          Value::number(st.liveBytes), Value::number(st.liveCells),
+                          Value::number(st.freedCells), Value::number(st.arenas),
+                          Value::number(st.totalPauseMs)};
+        return layout.instantiate(fields);
+    };
+    globals.define("heapStats", Value(gcNew<NativeCell>(heapStatsFn)));
+
+    // __stats() -> the runtime counters, with allocations as {type: count}
+    // and scopeDepth[d] the variable accesses that walked d scopes
+    auto runtimeStatsFn = [](Args)
+    {
+        const RuntimeStats &st = Isolate::current->stats;
+        const HeapStats &heapSt = currentHeap().stats;
+        vector<string> typeNames;
+        vector<Value> counts;
+        for (int t = 0; t < V_FREE; ++t)
+        {
+            if (kCellTypeNames[t])
+            {
+                typeNames.push_back(kCellTypeNames[t]);
+                counts.push_back(Value::number(heapSt.cellsByType[t]));
+            }
+        }
+        Value allocations = ObjectLiteral(typeNames).instantiate(counts.data());
+        auto depths = gcNew<ListCell>();
+        Value depthList(depths);
+        for (size_t n : st.scopeDepth)
+            depths->push(Value::number(n));
+
+        ObjectLiteral layout({"allocations", "userCalls", "nativeCalls", "scopeDepth", "timersQueued",
+                              "timersFired", "timerLatenessMs", "maxTimerLatenessMs", "microtasks", "parses",
+                              "parseMs"});
+        Value fields[] = {allocations,
+                          Value::number(st.userCalls),
+                          Value::number(st.nativeCalls),
+                          depthList,
+                          Value::number(st.timersQueued),
+                          Value::number(st.timersFired),
+                          Value::number(st.timerLatenessMs),
+                          Value::number(st.maxTimerLatenessMs),
+                          Value::number(st.microtasksRun),
+                          Value::number(st.parses),
+                          Value::number(st.parseMs)};
+        return layout.instantiate(fields);
+    };
+    globals.define("__stats", Value(gcNew<NativeCell>(runtimeStatsFn)));
+
+    // Vectorized array built-ins (section 12)
+    globals.define("sum", Value(gcNew<NativeCell>(nativeSum)));
+    globals.define("dot", Value(gcNew<NativeCell>(nativeDot)));
+    globals.define("scale", Value(gcNew<NativeCell>(nativeScale)));
+    globals.define("minmax", Value(gcNew<NativeCell>(nativeMinmax)));
+}
+
+string readPrelude()
+{
+    ifstream in(preludePath, ios::binary);
+    if (!in)
+        throw runtime_error("Cannot open prelude " + preludePath);
+    return string(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+// --prelude: the first isolate that needs the prelude builds a startup
+// snapshot of it in a scratch isolate, and every isolate after that,
+// including the first, just deserializes the snapshot. The prelude's own
+// output appears once, when it is built. With --snapshot the blob also goes
+// to a file, which later processes map instead of running the prelude; a
+// file for a different prelude or binary is rebuilt. The blob is shared
+// read-only: each isolate still gets its own copy of the cells.
+class StartupSnapshot
+{
+    string built;               // Made by this process
+    unique_ptr<MappedFile> file; // Or mapped from --snapshot
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+    uint64_t key = 0;
+
+    StartupSnapshot()
+    {
+        string source = readPrelude();
+        Isolate builder(false);
+        uint32_t settings[] = {kCodeCacheVersion, kSnapshotVersion, (uint32_t)sizeof(Instruction), foldConstants,
+                               (uint32_t)builder.builtins.size()};
+        key = fnv1a(settings, sizeof settings, fnv1a(source.data(), source.size()));
+
+        if (!snapshotPath.empty())
+        {
+            file = make_unique<MappedFile>(snapshotPath);
+            if (file->data() && !checkHeader(file->data(), file->size(), kSnapshotMagic, key))
+            {
+                data = file->data();
+                size = file->size();
+                return;
+            }
+            file.reset();
+        }
+
+        try
+        {
+            builder.execute(source);
+            builder.runEventLoop();
+        }
+        catch (exception &e)
+        {
+            throw runtime_error(string("Prelude: ") + e.what());
+        }
+        try
+        {
+            Isolate::Scope scope(builder); // Lazy functions get compiled on the way
+            built = SnapshotWriter(builder.builtins).write(builder.globals, key);
+        }
+        catch (runtime_error &e)
+        {
+            throw runtime_error(string("Prelude can't be snapshotted: ") + e.what());
+        }
+        data = (const uint8_t *)built.data();
+        size = built.size();
+        if (!snapshotPath.empty() && !replaceFile(snapshotPath, built))
+            cout << "Warning: cannot write snapshot " << snapshotPath << endl;
+    }
+
+public:
+    static const StartupSnapshot &get()
+    {
+        static StartupSnapshot snapshot; // Built once, even with isolates starting on many threads
+        return snapshot;
+    }
+
+    void restore(Isolate &isolate) const
+    {
+        try
+        {
+            SnapshotReader(data, size, isolate.builtins).read(isolate.globals);
+        }
+        catch (runtime_error &e)
+        {
+            throw runtime_error(string("Bad startup snapshot (") + e.what() + ")");
+        }
+    }
+};
+
+// The tree-walker's functions have no bytecode to snapshot, so --ast runs
+// the prelude in each isolate instead
+void Isolate::loadPrelude()
+{
+    if (useAstInterpreter)
+    {
+        static const string source = readPrelude();
+        execute(source);
+        runEventLoop();
+        return;
+    }
+    StartupSnapshot::get().restore(*this);
+}
 
-    shared_ptr<ASTNode> parsePrimary()
+// Runs independent scripts on a fixed set of worker threads, each script in
+// a fresh Isolate. Every worker owns a deque: submit() deals jobs out
+// round-robin, a worker takes from the front of its own deque and, once that
+// runs dry, steals from the back of another worker's.
+class IsolatePool
+{
+    struct Job
+    {
+        string_view source;
+        promise<string> result; // Error message, empty on success
+    };
+
+    struct WorkerQueue
+    {
+        mutex lock;
+        deque<Job> jobs;
+    };
+
+    vector<unique_ptr<WorkerQueue>> queues;
+    vector<thread> workers;
+    atomic<size_t> nextQueue{0};
+
+    mutex idleLock; // Guards queued and stopping
+    condition_variable wake;
+    size_t queued = 0;
+    bool stopping = false;
+
+    bool takeJob(size_t self, Job &out)
     {
-        skipWhitespace();
-        char c = peek();
+        for (size_t k = 0; k < queues.size(); ++k)
+        {
+            WorkerQueue &q = *queues[(self + k) % queues.size()];
+            lock_guard<mutex> lock(q.lock);
+            if (q.jobs.empty())
+                continue;
+            if (k == 0)
+            {
+                out = move(q.jobs.front());
+                q.jobs.pop_front();
+            }
+            else
+            {
+                out = move(q.jobs.back());
+                q.jobs.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
 
-        if (isdigit(c))
-            return make_shared<NumberNode>(stod(parseToken()));
-        if (c == '"')
+    static string runJob(string_view source)
+    {
+        try
         {
-            string s = parseToken();
-            return make_shared<StringNode>(s.substr(1, s.length() - 2));
+            Isolate isolate;
+            Isolate::Budget budget(isolate); // One time limit for the whole job
+            isolate.execute(source);
+            isolate.runEventLoop();
         }
-        if (c == '[')
+        catch (exception &e)
         {
-            advance(); // [
-            auto arr = make_shared<ArrayNode>();
-            while (peek() != ']')
+            return e.what();
+        }
+        return "";
+    }
+
+    void workerLoop(size_t self)
+    {
+        while (true)
+        {
+            Job job;
+            if (takeJob(self, job))
             {
-                arr->elements.push_back(parseExpression());
-                skipWhitespace();
-                if (peek() == ',')
-                    advance();
-            }
-            advance(); // ]
-            return arr;
-        }
-        if (isalpha(c))
-        {
-            string name = parseToken();
-            skipWhitespace();
-            if (peek() == '(')
-            {              // Function Call
-                advance(); // (
-                vector<shared_ptr<ASTNode>> args;
-                while (peek() != ')')
                 {
-                    args.push_back(parseExpression());
-                    skipWhitespace();
-                    if (peek() == ',')
-                        advance();
+                    lock_guard<mutex> lock(idleLock);
+                    --queued;
                 }
-                advance(); // )
-                return make_shared<CallNode>(name, args);
+                job.result.set_value(runJob(job.source));
+                continue;
             }
-            return make_shared<IdentifierNode>(name);
+            unique_lock<mutex> lock(idleLock);
+            wake.wait(lock, [&] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
         }
+    }
 
-        return nullptr; // Error or unsupported
+public:
+    explicit IsolatePool(size_t threadCount)
+    {
+        threadCount = max<size_t>(threadCount, 1);
+        for (size_t i = 0; i < threadCount; ++i)
+            queues.push_back(make_unique<WorkerQueue>());
+        for (size_t i = 0; i < threadCount; ++i)
+            workers.emplace_back([this, i] { workerLoop(i); });
     }
 
-    shared_ptr<ASTNode> parseBlock()
+    // Finishes every queued script before joining the workers
+    ~IsolatePool()
     {
-        advance(); // {
-        auto block = make_shared<BlockNode>();
-        while (peek() != '}' && pos < src.size())
         {
-            block->statements.push_back(parseStatement());
-            skipWhitespace();
+            lock_guard<mutex> lock(idleLock);
+            stopping = true;
         }
-        advance(); // }
-        return block;
+        wake.notify_all();
+        for (auto &w : workers)
+            w.join();
     }
 
-    shared_ptr<ASTNode> parseStatement()
+    // The source is borrowed: it must stay alive until the future is ready
+    future<string> submit(string_view source)
     {
-        skipWhitespace();
-        string tokenStr;
-        size_t checkpoint = pos;
-
-        // Peek next word
-        if (isalpha(peek()))
+        Job job{source, {}};
+        future<string> result = job.result.get_future();
+        WorkerQueue &q = *queues[nextQueue++ % queues.size()];
         {
-            while (isalpha(peek()))
-                tokenStr += advance();
+            lock_guard<mutex> lock(q.lock);
+            q.jobs.push_back(move(job));
         }
-
-        if (tokenStr == "var")
         {
-            skipWhitespace();
-            string name = parseToken();
-            skipWhitespace();
-            char eq = advance(); // =
-            auto val = parseExpression();
-            skipWhitespace();
-            if (peek() == ';')
-                advance();
-            return make_shared<VarDeclNode>(name, val);
+            lock_guard<mutex> lock(idleLock);
+            ++queued;
         }
-        else if (tokenStr == "if")
+        wake.notify_one();
+        return result;
+    }
+};
+
+// Parses and compiles a lazy function's declaration in the current isolate
+shared_ptr<BytecodeFunction> compileSpan(const SourceSpan &span)
+{
+    string text = span.text();
+    auto stmts = Parser(text, span.line).parse();
+    if (foldConstants)
+        Folder::foldScript(stmts);
+    Resolver::resolveScript(stmts);
+    return BytecodeCompiler::compileScript(stmts)->functions.at(0);
+}
+
+struct CompileTask
+{
+    enum State
+    {
+        QUEUED,
+        RUNNING,
+        DONE
+    };
+    mutex lock;
+    condition_variable done;
+    State state = QUEUED;
+    string code; // The function as CodeCacheWriter wrote it; empty if it didn't compile
+};
+
+// Compiles lazy functions ahead of their first call, on threads shared by
+// every isolate. Parsing interns strings and resolving assigns global
+// slots, so each worker compiles in an isolate of its own and hands the
+// function back in the code cache's encoding, global slots by name.
+
+// Calls f on every global slot operand in fn and the functions inside it
+template <class F>
+void forEachGlobalSlot(BytecodeFunction &fn, F &&f)
+{
+    for (auto &ins : fn.code)
+    {
+        if (ins.op == OP_LDA_GLOBAL || ins.op == OP_STA_GLOBAL || ins.op == OP_DEF_GLOBAL)
+            f(ins.a);
+    }
+    for (auto &inner : fn.functions)
+        forEachGlobalSlot(*inner, f);
+}
+
+// Points a function compiled in another isolate at this one's global slots
+void renumberGlobals(BytecodeFunction &fn, const vector<int> &slots)
+{
+    forEachGlobalSlot(fn, [&](int &slot) { slot = slots.at(slot); });
+}
+
+class BackgroundCompiler
+{
+    struct Job
+    {
+        SourceSpan span;
+        weak_ptr<CompileTask> task; // Expires if the function is dropped first
+    };
+
+    mutex lock; // Guards jobs and stopping
+    condition_variable wake;
+    deque<Job> jobs;
+    bool stopping = false;
+    vector<thread> workers;
+
+    static string compile(const SourceSpan &span)
+    {
+        try
         {
-            skipWhitespace();
-            advance(); // (
-            auto cond = parseExpression();
-            advance(); // )
-            skipWhitespace();
-            auto thenB = parseBlock(); // Assumes { }
-            shared_ptr<ASTNode> elseB = nullptr;
-            skipWhitespace();
-            // simple hack to peek 'else'
-            size_t p2 = pos;
-            string nxt;
-            while (isalpha(src[p2]))
-                nxt += src[p2++];
-            if (nxt == "else")
-            {
-                pos = p2;
-                skipWhitespace();
-                elseB = parseBlock();
-            }
-            return make_shared<IfNode>(cond, thenB, elseB);
+            auto fn = compileSpan(span);
+            // Only the globals this function uses, renumbered from 0: the
+            // worker's own table holds every name its past jobs have seen
+            vector<string> names;
+            unordered_map<int, int> compact;
+            GlobalScope &g = currentGlobals();
+            forEachGlobalSlot(*fn, [&](int &slot)
+            {
+                auto it = compact.try_emplace(slot, (int)names.size()).first;
+                if (it->second == (int)names.size())
+                    names.push_back(g.nameOf(slot));
+                slot = it->second;
+            });
+            CodeCacheWriter out;
+            out.globals(names);
+            if (out.function(*fn))
+                return out.finish(0);
         }
-        else if (tokenStr == "while")
+        catch (exception &)
         {
-            skipWhitespace();
-            advance(); // (
-            auto cond = parseExpression();
-            advance(); // )
-            skipWhitespace();
-            auto body = parseBlock();
-            return make_shared<WhileNode>(cond, body);
+            // The first call compiles it again and reports the error
         }
-        else if (tokenStr == "function")
-        {
-            skipWhitespace();
-            string name = parseToken();
-            advance(); // (
-            vector<string> params;
-            while (peek() != ')')
-            {
-                skipWhitespace();
-                string p;
-                while (isalnum(peek()))
-                    p += advance();
-                params.push_back(p);
-                skipWhitespace();
-                if (peek() == ',')
-                    advance();
-            }
-            advance(); // )
-            skipWhitespace();
-            auto body = parseBlock();
-            return make_shared<FunctionDeclNode>(name, params, body);
+        return "";
+    }
+
+    void workerLoop()
+    {
+        Isolate isolate(false);
+        isolate.setLimits({});
+        isolate.profiler.reset(); // No script runs here to sample
+        Isolate::Scope scope(isolate);
+        while (true)
+        {
+            Job job;
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+                if (stopping)
+                    return;
+                job = move(jobs.front());
+                jobs.pop_front();
+            }
+            auto task = job.task.lock();
+            if (!task)
+                continue;
+            {
+                lock_guard<mutex> guard(task->lock);
+                if (task->state != CompileTask::QUEUED)
+                    continue; // Called before we got to it
+                task->state = CompileTask::RUNNING;
+            }
+            string code = compile(job.span);
+            {
+                lock_guard<mutex> guard(task->lock);
+                task->code = move(code);
+                task->state = CompileTask::DONE;
+            }
+            task->done.notify_all();
+            isolate.heap.safepoint(); // Everything the compile allocated is garbage now
         }
+    }
 
-        // Reset if not a keyword, it's an expression or assignment
-        pos = checkpoint;
-        return parseExpression();
+public:
+    explicit BackgroundCompiler(size_t threadCount)
+    {
+        statsLog(); // Built first so it outlives the workers' isolates, which add to it
+        for (size_t i = 0; i < threadCount; ++i)
+            workers.emplace_back([this] { workerLoop(); });
     }
 
-    vector<shared_ptr<ASTNode>> parse()
+    // Queued jobs are dropped: their functions compile when called
+    ~BackgroundCompiler()
     {
-        vector<shared_ptr<ASTNode>> stmts;
-        while (pos < src.size())
         {
-            skipWhitespace();
-            if (pos >= src.size())
-                break;
-            stmts.push_back(parseStatement());
-            skipWhitespace();
-            if (peek() == ';')
-                advance();
+            lock_guard<mutex> guard(lock);
+            stopping = true;
         }
-        return stmts;
+        wake.notify_all();
+        for (auto &w : workers)
+            w.join();
+    }
+
+    shared_ptr<CompileTask> submit(const SourceSpan &span)
+    {
+        auto task = make_shared<CompileTask>();
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.push_back({span, task});
+        }
+        wake.notify_one();
+        return task;
     }
 };
 
+mutex backgroundCompilerLock; // Guards backgroundCompiler
+unique_ptr<BackgroundCompiler> backgroundCompiler; // Started by the first lazy function
+
+shared_ptr<CompileTask> compileInBackground(const SourceSpan &span)
+{
+    if (!compileThreads)
+        return nullptr;
+    lock_guard<mutex> guard(backgroundCompilerLock);
+    if (!backgroundCompiler)
+        backgroundCompiler = make_unique<BackgroundCompiler>(compileThreads);
+    return backgroundCompiler->submit(span);
+}
+
+// Joins the workers, so their isolates have reported to --dump-stats
+void stopCompileThreads()
+{
+    lock_guard<mutex> guard(backgroundCompilerLock);
+    backgroundCompiler.reset();
+}
+
+void compileLazily(BytecodeFunction &fn)
+{
+    string code;
+    if (auto &task = fn.lazy->task)
+    {
+        unique_lock<mutex> guard(task->lock);
+        if (task->state == CompileTask::QUEUED)
+            task->state = CompileTask::DONE; // Not started: compiling it here beats waiting
+        task->done.wait(guard, [&] { return task->state == CompileTask::DONE; });
+        code = move(task->code);
+    }
+
+    shared_ptr<BytecodeFunction> compiled;
+    if (!code.empty())
+    {
+        CodeCacheReader in((const uint8_t *)code.data() + sizeof(CodeCacheHeader),
+                           code.size() - sizeof(CodeCacheHeader));
+        vector<int> slots = in.globalSlots(currentGlobals());
+        compiled = in.function();
+        renumberGlobals(*compiled, slots);
+    }
+    else
+        compiled = compileSpan(fn.lazy->span); // Throws the syntax error, if that's why
+    fn = move(*compiled); // Clears fn.lazy too
+    if (printBytecode)
+        disassemble(fn);
+}
+
 // ==========================================
-// 5. EVENT LOOP (ASYNC SIMULATION)
+// 16. EMBEDDING API
 // ==========================================
 
-struct Task
+// Natives take the same signature as the built-in print and setTimeout
+using NativeFunction = function<Value(Args)>;
+
+// A compiled script handle; must not outlive the Engine that compiled it
+using Script = shared_ptr<CompiledScript>;
+
+// Library entry point: one Engine is one isolate. A Script compiled once can
+// be run again and again, with different global bindings each time.
+// Values handed back to the host stay valid until the next run or call;
+// store them in a global to keep them alive longer.
+class Engine
 {
-    long long executeTime;
-    function<void()> callback;
+    Isolate isolate;
 
-    // Min-heap comparator (smallest time first)
-    bool operator>(const Task &other) const
+public:
+    Script compile(const string &source) { return isolate.compile(source); }
+
+    // Define each binding as a global, run the script, then drain its
+    // timers; the time limit covers both
+    Value run(const Script &script, const vector<pair<string, Value>> &bindings = {})
     {
-        return executeTime > other.executeTime;
+        if (!script)
+            throw runtime_error("Empty script handle");
+        for (auto &b : bindings)
+            isolate.globals.define(b.first, b.second);
+        Isolate::Budget budget(isolate);
+        Value result = isolate.run(*script);
+        isolate.runEventLoop();
+        return result;
     }
+
+    Value eval(const string &source) { return run(compile(source)); }
+
+    // Call a script function value, e.g. one a script stored in a global
+    Value call(const Value &callable, const vector<Value> &args)
+    {
+        Isolate::Scope scope(isolate);
+        Isolate::Budget budget(isolate);
+        if (!callable.is(V_FUNC) && !callable.is(V_NATIVE))
+            throw runtime_error("Not a function");
+        return callFunction(callable, args);
+    }
+
+    // For untrusted scripts: later runs and calls stop with an error once
+    // they pass the time limit, or once the heap outgrows its cap
+    void setLimits(const ExecutionLimits &limits) { isolate.setLimits(limits); }
+
+    // Stop the current run from another thread, e.g. a host's own watchdog
+    void terminate() { isolate.terminate(); }
+
+    void registerNative(const string &name, NativeFunction fn)
+    {
+        Isolate::Scope scope(isolate);
+        isolate.globals.define(name, Value(gcNew<NativeCell>(move(fn))));
+    }
+
+    void setGlobal(const string &name, Value val) { isolate.globals.define(name, val); }
+
+    // Null if the global was never defined
+    Value getGlobal(const string &name)
+    {
+        int slot = isolate.globals.slotFor(name);
+        return isolate.globals.isDefined(slot) ? isolate.globals.get(slot) : Value();
+    }
+
+    Value newString(const string &s)
+    {
+        Isolate::Scope scope(isolate);
+        return makeString(s);
+    }
+
+    // Send print() somewhere else, e.g. a MemorySink to capture it
+    void setOutput(shared_ptr<OutputSink> sink) { isolate.output = move(sink); }
+
+    // Counters since the engine started; see __stats() for the script's view
+    const RuntimeStats &stats() const { return isolate.stats; }
+    const HeapStats &heapStats() const { return isolate.heap.stats; }
+
+    // Escape hatch for the REPL and tools that need the isolate itself
+    Isolate &raw() { return isolate; }
+};
+
+// ==========================================
+// 17. BENCHMARKS
+// ==========================================
+
+// Every operator new on this thread, so the harness can report allocations
+// per op. Thread-local so pool workers don't contend on a shared counter.
+thread_local size_t allocationCount = 0;
+
+// Out of line so the compiler never pairs an inlined malloc with a free
+NOINLINE void *operator new(size_t size)
+{
+    ++allocationCount;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+NOINLINE void operator delete(void *p) noexcept { free(p); }
+NOINLINE void operator delete(void *p, size_t) noexcept { free(p); }
+
+size_t peakRssKb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc);
+    return pmc.PeakWorkingSetSize / 1024;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+// One workload: a script plus how many operations one run of it performs
+struct Benchmark
+{
+    string name;
+    string source;
+    size_t ops;
+    bool parseOnly = false; // Time Parser::parse() rather than execution
 };
 
-vector<Task> taskQueue;
+vector<Benchmark> benchmarkSuite()
+{
+    vector<Benchmark> suite;
+
+    // fib(25) makes 242785 calls
+    suite.push_back({"fib", "function fib(n) { if (n < 2) { n } else { fib(n - 1) + fib(n - 2) } }\nfib(25)\n", 242785});
+
+    suite.push_back({"loop", "var i = 0\nvar s = 0\nwhile (i < 2000000) { s = s + i * 2; i = i + 1 }\n", 2000000});
+
+    suite.push_back({"strcat", "var s = \"\"\nvar i = 0\nwhile (i < 20000) { s = s + \"x\"; i = i + 1 }\n", 20000});
+
+    string elements;
+    for (int i = 0; i < 1000; ++i)
+        elements += (i ? ", " : "") + to_string(i);
+    suite.push_back({"array", "var i = 0\nwhile (i < 2000) { var a = [" + elements + "]; i = i + 1 }\n", 2000});
+
+    suite.push_back({"object", "var i = 0\nwhile (i < 500000) { var o = {a: i, b: \"x\", c: i + 1}; i = i + 1 }\n", 500000});
 
-long long getCurrentTime()
+    // One object used as a map: computed keys, each stored and read back
+    suite.push_back({"dynamic_keys",
+                     "var o = {}\nvar i = 0\nwhile (i < 100000) { o[\"k\" + i] = i; i = i + 1 }\n"
+                     "var s = 0\ni = 0\nwhile (i < 100000) { s = s + o[\"k\" + i]; i = i + 1 }\n",
+                     200000});
+
+    suite.push_back({"print", "var i = 0\nwhile (i < 200000) { print(i * 0.5, \"x\"); i = i + 1 }\n", 200000});
+
+    suite.push_back({"timers", "var n = 0\nfunction tick() { n = n + 1 }\nvar i = 0\nwhile (i < 50000) { setTimeout(tick, 0); i = i + 1 }\n", 50000});
+
+    // The same reduction in script and through the native; ops = elements summed
+    string build = "var a = []\nvar j = 0\nwhile (j < 10000) { a.push(j * 0.5); j = j + 1 }\nvar r = 0\nvar s = 0\n";
+    suite.push_back({"sum_loop", build + "while (r < 200) { j = 0; s = 0; while (j < 10000) { s = s + a[j]; j = j + 1 }; r = r + 1 }\n", 2000000});
+    suite.push_back({"sum_native", build + "while (r < 20000) { s = sum(a); r = r + 1 }\n", 200000000});
+
+    // ops = statements parsed
+    string big;
+    for (int i = 0; i < 20000; ++i)
+        big += "var v" + to_string(i) + " = {a: " + to_string(i) + ", b: \"s\", c: [1, 2, 3]}\n"
+               "function f" + to_string(i) + "(x, y) { if (x > y) { x - y } else { y * 2 + x / 3 } }\n";
+    suite.push_back({"parse", big, 40000, true});
+
+    return suite;
+}
+
+// --bench: run the suite in every execution mode, one JSON object per line.
+// tinyjs --bench prints the same fields, so the outputs can be concatenated.
+void runBenchmarks()
 {
-    using namespace std::chrono;
-    return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+    bool savedMode = useAstInterpreter, savedJit = jitEnabled;
+    for (string mode : {"bytecode", "jit", "ast"})
+    {
+        useAstInterpreter = mode == "ast";
+        jitEnabled = mode == "jit";
+        for (auto &b : benchmarkSuite())
+        {
+            Engine engine;
+            engine.setOutput(make_shared<MemorySink>()); // Keep print() out of the JSON
+            size_t allocsBefore = allocationCount;
+            size_t cellsBefore = engine.raw().heap.stats.cellsAllocated;
+            auto start = chrono::steady_clock::now();
+            if (b.parseOnly)
+            {
+                Isolate::Scope scope(engine.raw());
+                Parser parser(b.source);
+                parser.parse();
+            }
+            else
+                engine.run(engine.compile(b.source));
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+            size_t allocs = allocationCount - allocsBefore;
+            size_t cells = engine.raw().heap.stats.cellsAllocated - cellsBefore;
+
+            cout << "{\"engine\":\"small_v8\",\"mode\":\"" << mode
+                 << "\",\"bench\":\"" << b.name << "\",\"status\":\"ok\",\"ops\":" << b.ops
+                 << ",\"ns_per_op\":" << ns / b.ops
+                 << ",\"allocs_per_op\":" << (double)allocs / b.ops
+                 << ",\"cells_per_op\":" << (double)cells / b.ops
+                 << ",\"gc_collections\":" << engine.raw().heap.stats.collections
+                 << ",\"peak_rss_kb\":" << peakRssKb() << "}" << endl;
+        }
+    }
+    useAstInterpreter = savedMode;
+    jitEnabled = savedJit;
 }
 
 // ==========================================
-// 6. MAIN & SETUP
+// 18. MAIN & SETUP
 // ==========================================
 
-int main()
+// --threads N a.js b.js ...: run each file in its own isolate on the pool.
+// Files are mapped and parsed in place rather than read into a string.
+int runScriptFiles(size_t threadCount, const vector<string> &files)
 {
-    auto globalEnv = make_shared<Environment>();
+    vector<unique_ptr<MappedFile>> sources; // Declared first: outlives the pool's jobs
+    IsolatePool pool(threadCount);
+    vector<future<string>> results;
+    for (auto &file : files)
+    {
+        sources.push_back(make_unique<MappedFile>(file));
+        if (!sources.back()->isOpen())
+            throw runtime_error("Cannot open " + file);
+        results.push_back(pool.submit(sources.back()->text()));
+    }
+
+    int failures = 0;
+    for (size_t i = 0; i < files.size(); ++i)
+    {
+        string error = results[i].get();
+        if (error.empty())
+            continue;
+        lock_guard<mutex> lock(outputMutex);
+        cout << files[i] << ": Runtime Error: " << error << endl;
+        ++failures;
+    }
+    return failures ? 1 : 0;
+}
 
-    // --- Define Native Functions ---
+// -: the program arrives on stdin, and each top-level statement runs as
+// soon as it is complete, so output starts early and memory is bounded by
+// the longest statement rather than the whole input. Text is only offered
+// to the parser at line ends outside brackets and strings, the places a
+// statement can end.
+int runStream(istream &in)
+{
+    Isolate isolate;
+    Isolate::Scope scope(isolate); // Parsing interns strings
+    string pending; // Read but not yet run
+    int pendingLine = 1;
+    int depth = 0;
+    bool inString = false;
 
-    // print("hello")
-    auto printFn = make_shared<Value>();
-    printFn->type = V_NATIVE;
-    printFn->nativeFn = [](vector<shared_ptr<Value>> args)
+    auto runComplete = [&](bool atEnd)
     {
-        for (auto a : args)
-            cout << a->toString() << " ";
-        cout << endl;
-        return make_shared<Value>(); // returns null
+        vector<shared_ptr<ASTNode>> stmts;
+        size_t consumed = pending.size();
+        {
+            Parser parser(pending, pendingLine);
+            stmts = atEnd ? parser.parse() : parser.parseComplete(consumed);
+        }
+        pendingLine += (int)count(pending.begin(), pending.begin() + consumed, '\n');
+        pending.erase(0, consumed);
+        if (!stmts.empty())
+            isolate.run(*isolate.compile(move(stmts)));
     };
-    globalEnv->define("print", printFn);
 
-    // setTimeout(callback, ms)
-    auto timeoutFn = make_shared<Value>();
-    timeoutFn->type = V_NATIVE;
-    timeoutFn->nativeFn = [&](vector<shared_ptr<Value>> args)
+    try
+    {
+        string line;
+        while (getline(in, line))
+        {
+            for (char c : line)
+            {
+                if (c == '"')
+                    inString = !inString;
+                else if (!inString && (c == '(' || c == '{' || c == '['))
+                    ++depth;
+                else if (!inString && (c == ')' || c == '}' || c == ']'))
+                    --depth;
+            }
+            pending += line;
+            pending += '\n';
+            if (depth <= 0 && !inString)
+                runComplete(false);
+        }
+        runComplete(true);
+        isolate.runEventLoop();
+    }
+    catch (exception &e)
     {
-        if (args.size() < 2 || args[0]->type != V_FUNC)
-            return make_shared<Value>();
+        lock_guard<mutex> lock(outputMutex);
+        cout << "<stdin>: Runtime Error: " << e.what() << endl;
+        return 1;
+    }
+    return 0;
+}
 
-        long long delay = (long long)args[1]->numVal;
-        auto callback = args[0];
+// The isolate running REPL input, for Ctrl-C; null while waiting for input
+atomic<Isolate *> replRunning{nullptr};
 
-        // Push to Task Queue
-        Task t;
-        t.executeTime = getCurrentTime() + delay;
-        t.callback = [callback, globalEnv]()
+// Ctrl-C stops the running code, or quits at the prompt
+extern "C" void onReplInterrupt(int sig)
+{
+    if (Isolate *isolate = replRunning.load())
+    {
+        signal(sig, onReplInterrupt); // Some platforms reset the handler
+        isolate->terminate();
+        return;
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+int main(int argc, char **argv)
+{
+    size_t threadCount = 0;
+    bool bench = false;
+    vector<string> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        if (arg == "--ast")
+            useAstInterpreter = true;
+        else if (arg == "--print-bytecode")
+            printBytecode = true;
+        else if (arg == "--print-ast")
+            printAst = true;
+        else if (arg == "--no-fold")
+            foldConstants = false;
+        else if (arg == "--no-lazy")
+            lazyParsing = false;
+        else if (arg == "--compile-threads" && i + 1 < argc)
+            compileThreads = stoul(argv[++i]);
+        else if (arg == "--trace-gc")
+            Heap::traceGC = true;
+        else if (arg == "--no-simd")
+            disableSimd = true;
+        else if (arg == "--jit")
+            jitEnabled = true;
+        else if (arg == "--trace-jit")
+            traceJit = true;
+        else if (arg == "--code-cache" && i + 1 < argc)
+            codeCacheDir = argv[++i];
+        else if (arg == "--trace-code-cache")
+            traceCodeCache = true;
+        else if (arg == "--output" && i + 1 < argc)
+            outputPath = argv[++i];
+        else if (arg == "--flush" && i + 1 < argc)
         {
-            // Execute the closure body
-            auto scope = make_shared<Environment>(callback->closure);
-            callback->body->eval(scope);
-        };
-        taskQueue.push_back(t);
+            string policy = argv[++i];
+            outputPolicySet = true;
+            if (policy == "line")
+                outputPolicy = OutputSink::FLUSH_EACH_LINE;
+            else if (policy == "full")
+                outputPolicy = OutputSink::FLUSH_WHEN_FULL;
+            else if (policy == "explicit")
+                outputPolicy = OutputSink::FLUSH_EXPLICIT;
+            else
+            {
+                cout << "Unknown --flush policy: " << policy << " (line, full or explicit)" << endl;
+                return 1;
+            }
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+            threadCount = stoul(argv[++i]);
+        else if (arg == "--bench")
+            bench = true;
+        else if (arg == "--prof" && i + 1 < argc)
+            profilePath = argv[++i];
+        else if (arg == "--prof-interval" && i + 1 < argc)
+            profileIntervalUs = max(1, stoi(argv[++i]));
+        else if (arg == "--dump-stats")
+            dumpStats = true;
+        else if (arg == "--prelude" && i + 1 < argc)
+            preludePath = argv[++i];
+        else if (arg == "--snapshot" && i + 1 < argc)
+            snapshotPath = argv[++i];
+        else if (arg == "--timeout" && i + 1 < argc)
+            defaultLimits.timeoutMs = max(0LL, stoll(argv[++i]));
+        else if (arg == "--max-heap" && i + 1 < argc)
+            defaultLimits.maxHeapBytes = (size_t)max(0LL, stoll(argv[++i])) * 1024 * 1024;
+        else
+            files.push_back(arg);
+    }
 
-        return make_shared<Value>();
-    };
-    globalEnv->define("setTimeout", timeoutFn);
+    if (!profilePath.empty() && useAstInterpreter)
+    {
+        cout << "--prof samples the bytecode VM and can't be used with --ast" << endl;
+        return 1;
+    }
+
+    // Written once every isolate is gone, however main returns
+    struct ExitReports
+    {
+        ~ExitReports()
+        {
+            stopCompileThreads();
+            if (dumpStats)
+                statsLog().write(cerr);
+            if (profilePath.empty())
+                return;
+            try
+            {
+                profileLog().write(profilePath);
+            }
+            catch (exception &e)
+            {
+                cout << "Error: " << e.what() << endl;
+            }
+        }
+    } exitReports;
+
+    // Configures stdout's buffering, so it must come before any output
+    try
+    {
+        defaultOutput();
+    }
+    catch (exception &e)
+    {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    if (bench)
+    {
+        runBenchmarks();
+        return 0;
+    }
+
+    if (files.size() == 1 && files[0] == "-")
+        return runStream(cin);
+
+    if (!files.empty())
+    {
+        try
+        {
+            return runScriptFiles(threadCount ? threadCount : thread::hardware_concurrency(), files);
+        }
+        catch (exception &e)
+        {
+            cout << "Error: " << e.what() << endl;
+            return 1;
+        }
+    }
+
+    Isolate isolate;
+    signal(SIGINT, onReplInterrupt);
 
     cout << "--- JS Engine V8-Mini (Async supported) ---" << endl;
     cout << "Enter code. Type 'run' to execute." << endl;
@@ -740,53 +9364,24 @@ int main()
             break;
         if (line == "run")
         {
+            replRunning = &isolate;
             try
             {
-                Parser parser(code);
-                auto stmts = parser.parse();
-
                 // 1. Run Synchronous Code
-                for (auto &stmt : stmts)
-                {
-                    if (stmt)
-                        stmt->eval(globalEnv);
-                }
+                isolate.execute(code);
 
                 // 2. Run Event Loop (Async)
-                if (!taskQueue.empty())
+                if (isolate.hasPendingWork())
                 {
                     cout << "[Event Loop] Processing async tasks..." << endl;
-                    while (!taskQueue.empty())
-                    {
-                        long long now = getCurrentTime();
-                        bool ranTask = false;
-
-                        // Simple loop to find ready tasks (inefficient but works for demo)
-                        for (auto it = taskQueue.begin(); it != taskQueue.end();)
-                        {
-                            if (now >= it->executeTime)
-                            {
-                                it->callback();
-                                it = taskQueue.erase(it);
-                                ranTask = true;
-                            }
-                            else
-                            {
-                                ++it;
-                            }
-                        }
-
-                        if (!ranTask && !taskQueue.empty())
-                        {
-                            this_thread::sleep_for(chrono::milliseconds(10));
-                        }
-                    }
+                    isolate.runEventLoop();
                 }
             }
             catch (exception &e)
             {
                 cout << "Runtime Error: " << e.what() << endl;
             }
+            replRunning = nullptr;
             code = "";
             cout << "\nReady." << endl;
         }
@@ -796,4 +9391,4 @@ int main()
         }
     }
     return 0;
-}
\ No newline at end of file
+}
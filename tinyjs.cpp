@@ -2,10 +2,23 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <memory>
 #include <cctype>
 #include <sstream>
+#include <fstream>
 #include <stdexcept>
 #include <cmath>
+#include <charconv>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
 
 using namespace std;
 
@@ -31,9 +44,22 @@ struct Value
     {
         if (type == T_NUM)
         {
-            // Remove trailing zeros for display
-            string s = to_string(numVal);
-            return s.substr(0, s.find_last_not_of('0') + 1);
+            // to_string's "%f" with trailing zeros removed, minus its locale
+            // lookup and temporaries; whole numbers skip the float formatting
+            char buf[320];
+            char *end;
+            if (fabs(numVal) < 1e15 && numVal == trunc(numVal) && !(numVal == 0 && signbit(numVal)))
+            {
+                end = to_chars(buf, buf + sizeof buf, (long long)numVal).ptr;
+                *end++ = '.';
+            }
+            else
+            {
+                end = to_chars(buf, buf + sizeof buf, numVal, chars_format::fixed, 6).ptr;
+                while (end[-1] == '0')
+                    --end;
+            }
+            return string(buf, end);
         }
         if (type == T_STR)
             return strVal;
@@ -101,17 +127,32 @@ struct Token
 
 class Lexer
 {
-    string src;
+    string src; // When streaming, just the current line
     size_t pos = 0;
+    istream *in = nullptr;
+
+    // Is there a character at pos? Streams are read a line at a time, only
+    // once the previous line is used up, so memory stays one line deep
+    bool more()
+    {
+        if (pos < src.size())
+            return true;
+        if (!in || !getline(*in, src))
+            return false;
+        src += '\n';
+        pos = 0;
+        return true;
+    }
 
 public:
     Lexer(string s) : src(s) {}
+    Lexer(istream &stream) : in(&stream) {}
 
     Token nextToken()
     {
-        while (pos < src.size() && isspace(src[pos]))
+        while (more() && isspace(src[pos]))
             pos++;
-        if (pos >= src.size())
+        if (!more())
             return {END, ""};
 
         char current = src[pos];
@@ -120,7 +161,7 @@ public:
         if (isdigit(current))
         {
             string numStr;
-            while (pos < src.size() && (isdigit(src[pos]) || src[pos] == '.'))
+            while (more() && (isdigit(src[pos]) || src[pos] == '.'))
             {
                 numStr += src[pos++];
             }
@@ -132,7 +173,7 @@ public:
         {
             pos++; // skip opening quote
             string str;
-            while (pos < src.size() && src[pos] != '"')
+            while (more() && src[pos] != '"')
             {
                 str += src[pos++];
             }
@@ -144,7 +185,7 @@ public:
         if (isalpha(current))
         {
             string id;
-            while (pos < src.size() && isalnum(src[pos]))
+            while (more() && isalnum(src[pos]))
             {
                 id += src[pos++];
             }
@@ -185,21 +226,21 @@ public:
         case ';':
             return {SEMI, ";"};
         case '=':
-            if (pos < src.size() && src[pos] == '=')
+            if (more() && src[pos] == '=')
             {
                 pos++;
                 return {EQ, "=="};
             }
             return {ASSIGN, "="};
         case '&':
-            if (pos < src.size() && src[pos] == '&')
+            if (more() && src[pos] == '&')
             {
                 pos++;
                 return {AND, "&&"};
             }
             break;
         case '|':
-            if (pos < src.size() && src[pos] == '|')
+            if (more() && src[pos] == '|')
             {
                 pos++;
                 return {OR, "||"};
@@ -216,14 +257,186 @@ public:
     }
 };
 
-// --- 3. THE INTERPRETER (The "Brain") ---
+// --- 3. THE AST (The "Plan") ---
+// Each statement is parsed once into these nodes and can then run any
+// number of times, so a while body is not re-lexed per iteration. Names are
+// resolved while parsing: every variable is a fixed slot in one flat array,
+// and a block's slots are reused once the block has closed.
+
+struct Runtime
+{
+    vector<Variable> vars; // Indexed by the slots the parser hands out
+    ostream *out = &cout;  // Where `print` goes
+};
+
+struct Expr
+{
+    virtual ~Expr() = default;
+    virtual Value eval(Runtime &rt) const = 0;
+};
+
+struct Literal : Expr
+{
+    Value val;
+    Literal(Value v) : val(move(v)) {}
+    Value eval(Runtime &) const override { return val; }
+};
+
+struct VarRef : Expr
+{
+    int slot;
+    VarRef(int s) : slot(s) {}
+    Value eval(Runtime &rt) const override { return rt.vars[slot].val; }
+};
+
+// A name no scope declares at this point; only an error if it is reached
+struct UndefinedVar : Expr
+{
+    string name;
+    UndefinedVar(string n) : name(move(n)) {}
+    Value eval(Runtime &) const override { throw runtime_error("Undefined variable: " + name); }
+};
+
+struct BinaryExpr : Expr
+{
+    TokenType op;
+    unique_ptr<Expr> left, right;
+    BinaryExpr(TokenType o, unique_ptr<Expr> l, unique_ptr<Expr> r) : op(o), left(move(l)), right(move(r)) {}
+
+    Value eval(Runtime &rt) const override
+    {
+        Value l = left->eval(rt);
+        Value r = right->eval(rt);
+        switch (op)
+        {
+        case MUL:
+            l.numVal *= r.numVal;
+            return l;
+        case DIV:
+            l.numVal /= r.numVal;
+            return l;
+        case PLUS:
+        case MINUS:
+            if (l.type == T_STR || r.type == T_STR)
+                return {T_STR, 0, l.toString() + r.toString()};
+            if (op == PLUS)
+                l.numVal += r.numVal;
+            else
+                l.numVal -= r.numVal;
+            return l;
+        case GT:
+            return {T_BOOL, 0, "", l.numVal > r.numVal};
+        case LT:
+            return {T_BOOL, 0, "", l.numVal < r.numVal};
+        default:
+            return {T_BOOL, 0, "", l.numVal == r.numVal}; // Simplified equality
+        }
+    }
+};
+
+struct Stmt
+{
+    virtual ~Stmt() = default;
+    virtual void exec(Runtime &rt) const = 0;
+};
+
+struct LetStmt : Stmt
+{
+    string name;
+    int slot;
+    bool isConst;
+    bool redeclared; // The scope already has this name: an error once reached
+    unique_ptr<Expr> init;
+    LetStmt(string n, int s, bool c, bool r, unique_ptr<Expr> e)
+        : name(move(n)), slot(s), isConst(c), redeclared(r), init(move(e)) {}
+
+    void exec(Runtime &rt) const override
+    {
+        Value v = init->eval(rt);
+        if (redeclared)
+            throw runtime_error("Variable '" + name + "' already declared.");
+        rt.vars[slot] = {move(v), isConst};
+    }
+};
+
+struct AssignStmt : Stmt
+{
+    string name;
+    int slot; // -1: not declared in any enclosing scope
+    unique_ptr<Expr> value;
+    AssignStmt(string n, int s, unique_ptr<Expr> e) : name(move(n)), slot(s), value(move(e)) {}
+
+    void exec(Runtime &rt) const override
+    {
+        Value v = value->eval(rt);
+        if (slot < 0)
+            throw runtime_error("Variable not declared: " + name);
+        Variable &var = rt.vars[slot];
+        if (var.isConst)
+            throw runtime_error("Cannot reassign const variable: " + name);
+        var.val = move(v);
+    }
+};
+
+struct PrintStmt : Stmt
+{
+    unique_ptr<Expr> value;
+    PrintStmt(unique_ptr<Expr> e) : value(move(e)) {}
+    // No endl: the stream's buffer decides when to write
+    void exec(Runtime &rt) const override { *rt.out << value->eval(rt).toString() << '\n'; }
+};
+
+struct BlockStmt : Stmt
+{
+    vector<unique_ptr<Stmt>> body;
+    void exec(Runtime &rt) const override
+    {
+        for (auto &s : body)
+            s->exec(rt);
+    }
+};
+
+struct IfStmt : Stmt
+{
+    unique_ptr<Expr> cond;
+    unique_ptr<Stmt> then, otherwise; // otherwise may be null
+    IfStmt(unique_ptr<Expr> c, unique_ptr<Stmt> t, unique_ptr<Stmt> o)
+        : cond(move(c)), then(move(t)), otherwise(move(o)) {}
+
+    void exec(Runtime &rt) const override
+    {
+        if (cond->eval(rt).isTruthy())
+            then->exec(rt);
+        else if (otherwise)
+            otherwise->exec(rt);
+    }
+};
+
+struct WhileStmt : Stmt
+{
+    unique_ptr<Expr> cond;
+    unique_ptr<Stmt> body;
+    WhileStmt(unique_ptr<Expr> c, unique_ptr<Stmt> b) : cond(move(c)), body(move(b)) {}
+
+    void exec(Runtime &rt) const override
+    {
+        while (cond->eval(rt).isTruthy())
+            body->exec(rt);
+    }
+};
+
+// --- 4. THE INTERPRETER (The "Brain") ---
+// Parses one top-level statement at a time and runs it straight away, so
+// streamed input still executes as it arrives.
 
 class Interpreter
 {
     Lexer lexer;
     Token currentToken;
-    // Stack of Scopes (Global -> Block -> Block)
-    vector<map<string, Variable>> scopes;
+    Runtime rt;
+    // Stack of Scopes (Global -> Block -> Block), name -> slot
+    vector<map<string, int>> scopes;
+    int nextSlot = 0;
 
 public:
     Interpreter(string src) : lexer(src)
@@ -232,6 +445,13 @@ public:
         currentToken = lexer.nextToken();
     }
 
+    // Executes statements as they arrive on the stream
+    Interpreter(istream &in) : lexer(in)
+    {
+        scopes.push_back({}); // Global Scope
+        currentToken = lexer.nextToken();
+    }
+
     void eat(TokenType t)
     {
         if (currentToken.type == t)
@@ -245,139 +465,122 @@ public:
     }
 
     // Variable Management
-    Variable *findVar(string name)
+    int findVar(const string &name) const
     {
         // Look in scopes from inner to outer
         for (int i = scopes.size() - 1; i >= 0; i--)
         {
-            if (scopes[i].count(name))
-            {
-                return &scopes[i][name];
-            }
+            auto it = scopes[i].find(name);
+            if (it != scopes[i].end())
+                return it->second;
         }
-        return nullptr;
-    }
-
-    void declareVar(string name, Value val, bool isConst)
-    {
-        if (scopes.back().count(name))
-            throw runtime_error("Variable '" + name + "' already declared.");
-        scopes.back()[name] = {val, isConst};
+        return -1;
     }
 
     // --- Expression Parsing (PEMDAS logic) ---
 
-    Value factor()
+    unique_ptr<Expr> factor()
     {
         Token t = currentToken;
         if (t.type == NUMBER)
         {
             eat(NUMBER);
-            return {T_NUM, stod(t.text)};
+            return make_unique<Literal>(Value{T_NUM, stod(t.text)});
         }
         if (t.type == STRING)
         {
             eat(STRING);
-            return {T_STR, 0, t.text};
+            return make_unique<Literal>(Value{T_STR, 0, t.text});
         }
         if (t.type == ID)
         {
             eat(ID);
-            Variable *v = findVar(t.text);
-            if (!v)
-                throw runtime_error("Undefined variable: " + t.text);
-            return v->val;
+            int slot = findVar(t.text);
+            if (slot < 0)
+                return make_unique<UndefinedVar>(t.text);
+            return make_unique<VarRef>(slot);
         }
         if (t.type == LPAREN)
         {
             eat(LPAREN);
-            Value v = expression();
+            auto e = expression();
             eat(RPAREN);
-            return v;
+            return e;
         }
         throw runtime_error("Unexpected factor: " + t.text);
     }
 
-    Value term()
+    unique_ptr<Expr> term()
     {
-        Value left = factor();
+        auto left = factor();
         while (currentToken.type == MUL || currentToken.type == DIV)
         {
             TokenType op = currentToken.type;
             eat(op);
-            Value right = factor();
-            if (op == MUL)
-                left.numVal *= right.numVal;
-            else
-                left.numVal /= right.numVal;
+            left = make_unique<BinaryExpr>(op, move(left), factor());
         }
         return left;
     }
 
-    Value additive()
+    unique_ptr<Expr> additive()
     {
-        Value left = term();
+        auto left = term();
         while (currentToken.type == PLUS || currentToken.type == MINUS)
         {
             TokenType op = currentToken.type;
             eat(op);
-            Value right = term();
-            if (left.type == T_STR || right.type == T_STR)
-            {
-                left = {T_STR, 0, left.toString() + right.toString()};
-            }
-            else if (op == PLUS)
-            {
-                left.numVal += right.numVal;
-            }
-            else
-            {
-                left.numVal -= right.numVal;
-            }
+            left = make_unique<BinaryExpr>(op, move(left), term());
         }
         return left;
     }
 
-    Value comparison()
+    unique_ptr<Expr> comparison()
     {
-        Value left = additive();
+        auto left = additive();
         while (currentToken.type == GT || currentToken.type == LT || currentToken.type == EQ)
         {
             TokenType op = currentToken.type;
             eat(op);
-            Value right = additive();
-            bool res = false;
-            if (op == GT)
-                res = left.numVal > right.numVal;
-            if (op == LT)
-                res = left.numVal < right.numVal;
-            if (op == EQ)
-                res = left.numVal == right.numVal; // Simplified equality
-            left = {T_BOOL, 0, "", res};
+            left = make_unique<BinaryExpr>(op, move(left), additive());
         }
         return left;
     }
 
-    Value expression()
+    unique_ptr<Expr> expression()
     {
         return comparison();
     }
 
     // --- Statement Parsing ---
 
-    void block()
+    unique_ptr<Stmt> block()
     {
         eat(LBRACE);
         scopes.push_back({}); // New Scope
+        int firstSlot = nextSlot;
+        auto b = make_unique<BlockStmt>();
         while (currentToken.type != RBRACE && currentToken.type != END)
         {
-            statement();
+            b->body.push_back(statement());
         }
-        scopes.pop_back(); // End Scope
+        scopes.pop_back(); // End Scope: later blocks reuse its slots
+        nextSlot = firstSlot;
         eat(RBRACE);
+        return b;
     }
 
-    void statement()
+    // The body of an if, else or while. As in JS, a declaration there needs
+    // braces: it would otherwise exist only if the branch ran.
+    unique_ptr<Stmt> branch()
+    {
+        if (currentToken.type == LBRACE)
+            return block();
+        if (currentToken.type == LET || currentToken.type == CONST)
+            throw runtime_error("Declaration needs a block here: " + currentToken.text);
+        return statement();
+    }
+
+    unique_ptr<Stmt> statement()
     {
         if (currentToken.type == LET || currentToken.type == CONST)
         {
@@ -386,115 +589,71 @@ public:
             string name = currentToken.text;
             eat(ID);
             eat(ASSIGN);
-            Value v = expression();
-            declareVar(name, v, isConst);
+            auto init = expression(); // Resolved before the name exists, so `let x = x` sees an outer x
             eat(SEMI);
+            bool redeclared = scopes.back().count(name) > 0;
+            int slot = redeclared ? scopes.back()[name] : (scopes.back()[name] = nextSlot++);
+            if ((int)rt.vars.size() < nextSlot)
+                rt.vars.resize(nextSlot);
+            return make_unique<LetStmt>(name, slot, isConst, redeclared, move(init));
         }
-        else if (currentToken.type == PRINT)
+        if (currentToken.type == PRINT)
         {
             eat(PRINT);
-            Value v = expression();
-            cout << v.toString() << endl;
+            auto v = expression();
             eat(SEMI);
+            return make_unique<PrintStmt>(move(v));
         }
-        else if (currentToken.type == IF)
+        if (currentToken.type == IF)
         {
             eat(IF);
             eat(LPAREN);
-            Value cond = expression();
+            auto cond = expression();
             eat(RPAREN);
-            if (cond.isTruthy())
-            {
-                if (currentToken.type == LBRACE)
-                    block();
-                else
-                    statement();
-            }
-            else
-            {
-                // Skip the true block
-                // (Note: In a full compiler we would parse but not execute.
-                // In this simple interpreter, we skip tokens.
-                // A true skip implementation is complex, so we cheat:
-                // We actually execute both paths in this simple version unless we use blocks.
-                // NOTE: For a perfect IF/ELSE skip in a 1-file Interpreter,
-                // we need an AST. Since we are doing direct-execution,
-                // IFs are tricky. We will assume the user uses Blocks {}.)
-                int braces = 0;
-                while (true)
-                {
-                    if (currentToken.type == LBRACE)
-                        braces++;
-                    if (currentToken.type == RBRACE)
-                    {
-                        braces--;
-                        if (braces == 0)
-                        {
-                            eat(RBRACE);
-                            break;
-                        }
-                    }
-                    if (currentToken.type == END)
-                        break;
-                    currentToken = lexer.nextToken();
-                }
-            }
+            auto then = branch();
+            unique_ptr<Stmt> otherwise;
             if (currentToken.type == ELSE)
             {
                 eat(ELSE);
-                if (!cond.isTruthy())
-                {
-                    if (currentToken.type == LBRACE)
-                        block();
-                    else
-                        statement();
-                }
+                otherwise = branch();
             }
+            return make_unique<IfStmt>(move(cond), move(then), move(otherwise));
         }
-        else if (currentToken.type == WHILE)
+        if (currentToken.type == WHILE)
         {
-            // Saving position to loop back requires reading the file into a list of tokens first
-            // or seeking the file pointer. For this demo, WHILE is hard in single-pass.
-            // But we can support a "Do once" or simple logic.
-            // **Correction**: To make WHILE work here, we would need to store the Token list.
-            cout << "Warning: 'while' loops require AST architecture (skipped in this version)." << endl;
-            // Consume tokens to avoid crash
             eat(WHILE);
-            while (currentToken.type != SEMI && currentToken.type != RBRACE)
-                currentToken = lexer.nextToken();
+            eat(LPAREN);
+            auto cond = expression();
+            eat(RPAREN);
+            return make_unique<WhileStmt>(move(cond), branch());
         }
-        else if (currentToken.type == LBRACE)
+        if (currentToken.type == LBRACE)
         {
-            block();
+            return block();
         }
-        else if (currentToken.type == ID)
+        if (currentToken.type == ID)
         {
             // Assignment: x = 10;
             string name = currentToken.text;
             eat(ID);
             eat(ASSIGN);
-            Value v = expression();
-            Variable *var = findVar(name);
-            if (!var)
-                throw runtime_error("Variable not declared: " + name);
-            if (var->isConst)
-                throw runtime_error("Cannot reassign const variable: " + name);
-            var->val = v;
+            auto v = expression();
             eat(SEMI);
+            return make_unique<AssignStmt>(name, findVar(name), move(v));
         }
-        else
-        {
-            eat(SEMI); // Empty statement
-        }
+        eat(SEMI); // Empty statement
+        return make_unique<BlockStmt>();
     }
 
+    void setOutput(ostream &stream) { rt.out = &stream; }
+
     void run()
     {
         while (currentToken.type != END)
         {
             try
             {
-                statement();
+                statement()->exec(rt);
             }
             catch (const exception &e)
             {
@@ -505,10 +664,138 @@ public:
     }
 };
 
-int main()
+// --- 5. BENCHMARKS ---
+// --bench prints one JSON object per line with the same fields as
+// small_v8_engine --bench, so the two outputs can be concatenated.
+
+size_t allocationCount = 0; // Every operator new, for allocations per op
+
+// Out of line so the compiler never pairs an inlined malloc with a free
+#ifdef _MSC_VER
+#define BENCH_NOINLINE __declspec(noinline)
+#else
+#define BENCH_NOINLINE __attribute__((noinline))
+#endif
+
+BENCH_NOINLINE void *operator new(size_t size)
 {
+    ++allocationCount;
+    if (void *p = malloc(size ? size : 1))
+        return p;
+    throw bad_alloc();
+}
+
+BENCH_NOINLINE void operator delete(void *p) noexcept { free(p); }
+BENCH_NOINLINE void operator delete(void *p, size_t) noexcept { free(p); }
+
+size_t peakRssKb()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof pmc);
+    return pmc.PeakWorkingSetSize / 1024;
+#else
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // Bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+struct Benchmark
+{
+    string name;
+    string source; // Empty: the language can't express this workload yet
+    size_t ops;
+};
+
+vector<Benchmark> benchmarkSuite()
+{
+    vector<Benchmark> suite;
+
+    // No functions, arrays, objects or timers yet
+    suite.push_back({"fib", "", 0});
+
+    suite.push_back({"loop", "let i = 0; let s = 0; while (i < 2000000) { s = s + i * 2; i = i + 1; }", 2000000});
+
+    suite.push_back({"strcat", "let s = \"\"; let i = 0; while (i < 20000) { s = s + \"x\"; i = i + 1; }", 20000});
+
+    suite.push_back({"array", "", 0});
+    suite.push_back({"object", "", 0});
+    suite.push_back({"print", "let i = 0; while (i < 200000) { print i * 0.5 + \"x\"; i = i + 1; }", 200000});
+
+    suite.push_back({"timers", "", 0});
+    suite.push_back({"sum_loop", "", 0});
+    suite.push_back({"sum_native", "", 0});
+
+    // Each statement is parsed and then run straight away; ops = statements
+    string big;
+    for (int i = 0; i < 40000; ++i)
+        big += "let v" + to_string(i) + " = " + to_string(i) + " * 2 + 1; ";
+    suite.push_back({"parse", big, 40000});
+
+    return suite;
+}
+
+void runBenchmarks()
+{
+    for (auto &b : benchmarkSuite())
+    {
+        cout << "{\"engine\":\"tinyjs\",\"mode\":\"direct\",\"bench\":\"" << b.name << "\"";
+        if (b.source.empty())
+        {
+            cout << ",\"status\":\"unsupported\"}" << endl;
+            continue;
+        }
+        size_t allocsBefore = allocationCount;
+        auto start = chrono::steady_clock::now();
+        {
+            ostringstream discard;
+            Interpreter interpreter(b.source);
+            interpreter.setOutput(discard);
+            interpreter.run();
+        }
+        double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+        size_t allocs = allocationCount - allocsBefore;
+        cout << ",\"status\":\"ok\",\"ops\":" << b.ops
+             << ",\"ns_per_op\":" << ns / b.ops
+             << ",\"allocs_per_op\":" << (double)allocs / b.ops
+             << ",\"peak_rss_kb\":" << peakRssKb() << "}" << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && string(argv[1]) == "--bench")
+    {
+        runBenchmarks();
+        return 0;
+    }
+
+    // tinyjs FILE, or tinyjs - for stdin: streamed, never held in memory whole
+    if (argc > 1)
+    {
+        string path = argv[1];
+        ifstream file;
+        if (path != "-")
+        {
+            file.open(path);
+            if (!file)
+            {
+                cout << "Error: Cannot open " << path << endl;
+                return 1;
+            }
+        }
+        Interpreter interpreter(path == "-" ? cin : file);
+        interpreter.run();
+        return 0;
+    }
+
     cout << "--- TinyJS Interpreter (Type 'exit' to quit) ---" << endl;
-    cout << "Supports: let, const, print, if/else, math, strings" << endl;
+    cout << "Supports: let, const, print, if/else, while, math, strings" << endl;
     cout << "Enter your code (one line or multiple, end with 'run'):" << endl;
 
     string line, fullCode;